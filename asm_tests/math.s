@@ -24,6 +24,7 @@ ld  c, $00ab   ; Load c from $00ab (High Byte of previously written data)
 shl c, $#0008  ; Shift c left by 8 bits so that we can add on our low byte
 add c, $00ac   ; Add low byte to c
 shr c, $#0001  ; Shift the entire register right by one bit to test shr 
+.assert c, $#7f76 ; 0xfeed shifted right by one bit
 
 ; Test the remaining math instructions
 ; Expected Result in a: 0x0bb4
@@ -31,3 +32,5 @@ ld  a, $#1337 ; Ready value to be operated on
 sub a, $#0321 ; Subtract 0x0321 from a
 and a, $#0b0c ; Bitwise and with mask 0x0b0c on a
 or  a, $#0bb0 ; Bitwise or with mask 0x0bb0 on a
+.assert a, $#0bb4
+.assert $00ab, $#fe ; High byte of the value written on device 2
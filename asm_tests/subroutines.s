@@ -29,5 +29,6 @@ rts
 ; End Subroutine MATH_TEST
 
   PROGRAM_END:
+.assert a, $#0bb4 ; Result of MATH_TEST
 nop
 ; End Label PROGRAM_END
\ No newline at end of file
@@ -0,0 +1,156 @@
+// t(heft)asm ; bench/embed.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+/// Assembles a small snippet from memory over and over on several threads
+/// through asm_assemble, the way a test harness embedding tasm would. The
+/// snippet includes a header which is served from memory as well, nothing
+/// touches the disk. Every thread checks its image against the first one
+/// and a faulty snippet has to produce a structured diagnostic.
+///
+/// Built by bench_cmd of build.mb once the assembler is built, or by hand
+/// from the repository root:
+///   SRC=$(ls src/*.c src/butter/*.c | grep -v main.c)
+///   clang -O3 -Isrc/ bench/embed.c $SRC -o embed_bench -lm -lpthread
+///
+/// Usage: embed_bench [iterations per thread] [threads]
+
+#include <assembler.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char header[] = ".symbols\n"
+                             "IO_PORT $6000\n"
+                             "VALUE $#0042\n";
+
+static const char snippet[] = ".text\n"
+                              ".inc \"header.inc\"\n"
+                              "start:\n"
+                              "  ld a, ?VALUE\n"
+                              "  st a, ?IO_PORT\n"
+                              "  add a, $#0001\n"
+                              "  brn start\n";
+
+static const char faulty[] = ".text\n"
+                             "  ld a, $#0001\n"
+                             "  brn nowhere\n";
+
+typedef struct bench_thread_t {
+  pthread_t thread;
+  size_t iterations;
+  uint8_t image[64];
+  size_t image_size;
+  size_t failures;
+} bench_thread_t;
+
+static double _now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static uint8_t _read(void *user, const char *path, const char **src,
+                     size_t *size) {
+  (void)user;
+  if (strcmp(path, "header.inc") != 0) {
+    errno = ENOENT;
+    return 0;
+  }
+
+  *src = header;
+  *size = sizeof(header) - 1;
+  return 1;
+}
+
+static void _diag(void *user, const asm_diag_t *diag) {
+  asm_diag_t *dest = user;
+  *dest = *diag;
+  dest->detail = NULL;
+}
+
+static void *_run(void *arg) {
+  bench_thread_t *bt = arg;
+  asm_opts_t opts;
+  asm_init_opts(&opts);
+  opts.read = _read;
+
+  for (size_t i = 0; i < bt->iterations; i++) {
+    uint8_t buf[64];
+    uint8_t *dest = buf;
+    size_t size = sizeof(buf);
+    err_t err = asm_assemble("snippet.s", snippet, sizeof(snippet) - 1,
+                             &opts, &dest, &size);
+    if (err != TASM_OK) {
+      bt->failures++;
+      continue;
+    }
+
+    if (i == 0) {
+      memcpy(bt->image, buf, size);
+      bt->image_size = size;
+    } else if (size != bt->image_size || memcmp(bt->image, buf, size) != 0) {
+      bt->failures++;
+    }
+  }
+
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  size_t iterations = 100000;
+  size_t thread_count = 4;
+  if (argc > 1)
+    iterations = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    thread_count = strtoul(argv[2], NULL, 10);
+  if (iterations == 0 || thread_count == 0)
+    return 1;
+
+  // The faulty snippet has to be reported through the callback
+  asm_diag_t diag = {0};
+  asm_opts_t opts;
+  asm_init_opts(&opts);
+  opts.diag = _diag;
+  opts.user = &diag;
+  uint8_t *dest = NULL;
+  size_t size = 0;
+  err_t err =
+      asm_assemble("faulty.s", faulty, sizeof(faulty) - 1, &opts, &dest, &size);
+  fprintf(stderr, "faulty.s: %s at %s:%u:%u \"%.*s\"\n", asm_errname(err),
+          diag.file != NULL ? "faulty.s" : "?", diag.line, diag.col,
+          (int)diag.where_len, diag.where);
+  if (err != TASM_INVALID_LABEL || diag.err != err || diag.line != 3)
+    return 1;
+
+  bench_thread_t *threads = calloc(thread_count, sizeof(bench_thread_t));
+  double start = _now_ms();
+  for (size_t t = 0; t < thread_count; t++) {
+    threads[t].iterations = iterations;
+    pthread_create(&threads[t].thread, NULL, _run, &threads[t]);
+  }
+
+  size_t failures = 0;
+  for (size_t t = 0; t < thread_count; t++) {
+    pthread_join(threads[t].thread, NULL);
+    failures += threads[t].failures;
+    if (threads[t].image_size != threads[0].image_size ||
+        memcmp(threads[t].image, threads[0].image, threads[0].image_size))
+      failures++;
+  }
+  double elapsed = _now_ms() - start;
+
+  size_t total = iterations * thread_count;
+  fprintf(stderr,
+          "%zu assemblies on %zu threads in %.1f ms, %.2f us each, "
+          "%zu failures\n",
+          total, thread_count, elapsed, elapsed * 1000.0 / total, failures);
+
+  free(threads);
+  return failures != 0;
+}
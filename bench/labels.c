@@ -0,0 +1,85 @@
+// t(heft)asm ; bench/labels.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+/// Measures how label resolution and tree translation scale with the number
+/// of labels. Every label is followed by a branch to a pseudo-random other
+/// label, so each translated instruction performs one label lookup.
+///
+/// Built by bench_cmd of build.mb once the assembler is built, or by hand
+/// from the repository root:
+///   SRC=$(ls src/*.c src/butter/*.c | grep -v main.c)
+///   clang -O3 -Isrc/ bench/labels.c $SRC -o labels_bench -lm -lpthread
+
+#include <assembler.h>
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double _now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int _gen_source(char *path, size_t labels) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+    return 0;
+
+  fprintf(f, ".text\n");
+  for (size_t i = 0; i < labels; i++)
+    fprintf(f, "L%zu:\nbrn L%zu\n", i, (i * 7919) % labels);
+
+  fclose(f);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  size_t max_labels = 1000000;
+  if (argc > 1)
+    max_labels = strtoul(argv[1], NULL, 10);
+
+  // Only the table is written, the progress of every run would break it up
+  log_set_level(LOG_LEVEL_ERR);
+
+  char path[] = "/tmp/tasm_label_bench.s";
+  printf("%10s %12s %12s %14s\n", "labels", "resolve ms", "translate ms",
+         "ns per label");
+
+  for (size_t n = 1000; n <= max_labels; n *= 10) {
+    if (!_gen_source(path, n)) {
+      fprintf(stderr, "could not write %s\n", path);
+      return 1;
+    }
+
+    asm_tree_t ast;
+    asm_init_tree(&ast);
+    if (asm_parse_file(path, &ast) != TASM_OK)
+      return 1;
+
+    double start = _now_ms();
+    asm_resolve_labels(&ast);
+    double resolve = _now_ms() - start;
+
+    uint8_t *bin;
+    size_t size;
+    start = _now_ms();
+    err_t err = asm_translate_tree(&ast, &bin, &size);
+    double translate = _now_ms() - start;
+    if (err != TASM_OK)
+      return 1;
+
+    printf("%10zu %12.2f %12.2f %14.1f\n", n, resolve, translate,
+           translate * 1000000.0 / n);
+
+    free(bin);
+    asm_free_tree(&ast);
+  }
+
+  remove(path);
+  return 0;
+}
@@ -0,0 +1,168 @@
+// t(heft)asm ; bench/lookup.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+/// Compares get_inst/get_dir against the previous lookup, which lowercased
+/// every keyword into a fresh allocation and compared it against each
+/// table entry. The token stream consists of the keywords of the given
+/// sources (default: asm_tests/), repeated until enough lookups are made.
+///
+/// Built by bench_cmd of build.mb once the assembler is built, or by hand
+/// from the repository root:
+///   SRC=$(ls src/*.c src/butter/*.c | grep -v main.c)
+///   clang -O3 -Isrc/ bench/lookup.c $SRC -o lookup_bench -lm -lpthread
+
+#include <assembler.h>
+#include <lexer.h>
+
+#include <butter/strutils.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOOKUPS 20000000
+
+static double _now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+//-- Previous implementation --//
+
+/// In the order of directive_t, including the directives added since
+static char *old_directives[] = {"inc",     "nullpadding", "byte",
+                                 "bytes",   "padding",     "text",
+                                 "symbols", "export",      "assert"};
+#define OLD_DIRECTIVE_COUNT (sizeof(old_directives) / sizeof(old_directives[0]))
+
+static int _old_get_dir(char *str) {
+  char *lower = str_lower(str);
+
+  int dir = DIR_INVALID;
+  for (int i = 0; i < (int)OLD_DIRECTIVE_COUNT; i++) {
+    if (strcmp(old_directives[i], lower) == 0) {
+      dir = i;
+      break;
+    }
+  }
+
+  free(lower);
+  return dir;
+}
+
+static inst_t _old_get_inst(char *str) {
+  char *lower = str_lower(str);
+
+  inst_t inst = INST_INVALID;
+  for (int i = 0; i < INST_COUNT; i++) {
+    if (strcmp(inst_descriptors[i].name, lower) == 0) {
+      inst = inst_descriptors[i].inst;
+      break;
+    }
+  }
+
+  free(lower);
+  return inst;
+}
+
+//-- Token stream --//
+
+typedef struct keyword_t {
+  char *str;
+  size_t len;
+  uint8_t is_dir;
+} keyword_t;
+
+static size_t _collect(char *path, keyword_t **keywords, size_t count) {
+  const char *src;
+  size_t size;
+  if (!lexer_map_file(path, &src, &size)) {
+    fprintf(stderr, "could not map %s\n", path);
+    return count;
+  }
+
+  size_t pos = 0;
+  while (pos < size) {
+    size_t len = lexer_line_len(src + pos, size - pos);
+    lexer_t lex;
+    asm_tok_t tok;
+    lexer_init(&lex, src + pos, len);
+    if (lexer_next(&lex, &tok) &&
+        tok.str[tok.len - 1] != TASM_CHAR_LABEL_POSTFIX) {
+      *keywords = realloc(*keywords, sizeof(keyword_t) * (count + 1));
+      uint8_t is_dir = tok.str[0] == TASM_CHAR_DIRECTIVE_PREFIX;
+      (*keywords)[count].str = strndup(tok.str + is_dir, tok.len - is_dir);
+      (*keywords)[count].len = tok.len - is_dir;
+      (*keywords)[count].is_dir = is_dir;
+      count++;
+    }
+    pos += len + 1;
+  }
+
+  lexer_unmap_file(src, size);
+  return count;
+}
+
+int main(int argc, char **argv) {
+  char *defaults[] = {"asm_tests/initial_orders.s", "asm_tests/math.s",
+                      "asm_tests/subroutines.s",
+                      "asm_tests/reserved_addr.inc"};
+  char **files = defaults;
+  int file_count = 4;
+  if (argc > 1) {
+    files = argv + 1;
+    file_count = argc - 1;
+  }
+
+  keyword_t *keywords = NULL;
+  size_t count = 0;
+  for (int i = 0; i < file_count; i++)
+    count = _collect(files[i], &keywords, count);
+
+  if (count == 0) {
+    fprintf(stderr, "no keywords found\n");
+    return 1;
+  }
+
+  // Verify both implementations agree before timing them
+  for (size_t k = 0; k < count; k++) {
+    keyword_t kw = keywords[k];
+    int old = kw.is_dir ? _old_get_dir(kw.str) : (int)_old_get_inst(kw.str);
+    int new = kw.is_dir ? (int)get_dir(kw.str, kw.len)
+                        : (int)get_inst(kw.str, kw.len);
+    if (old != new)
+      fprintf(stderr, "mismatch for \"%s\": %d != %d\n", kw.str, old, new);
+  }
+
+  volatile unsigned long sink = 0;
+  double start = _now_ms();
+  for (size_t i = 0; i < LOOKUPS; i++) {
+    keyword_t kw = keywords[i % count];
+    sink += kw.is_dir ? (unsigned long)_old_get_dir(kw.str)
+                      : (unsigned long)_old_get_inst(kw.str);
+  }
+  double old_ms = _now_ms() - start;
+
+  start = _now_ms();
+  for (size_t i = 0; i < LOOKUPS; i++) {
+    keyword_t kw = keywords[i % count];
+    sink += kw.is_dir ? (unsigned long)get_dir(kw.str, kw.len)
+                      : (unsigned long)get_inst(kw.str, kw.len);
+  }
+  double new_ms = _now_ms() - start;
+
+  printf("%zu distinct keyword occurrences, %d lookups\n", count, LOOKUPS);
+  printf("previous: %8.2f ms (%5.1f ns/lookup)\n", old_ms,
+         old_ms * 1000000.0 / LOOKUPS);
+  printf("current:  %8.2f ms (%5.1f ns/lookup)\n", new_ms,
+         new_ms * 1000000.0 / LOOKUPS);
+
+  for (size_t k = 0; k < count; k++)
+    free(keywords[k].str);
+  free(keywords);
+  return 0;
+}
@@ -0,0 +1,406 @@
+// t(heft)asm ; bench/suite.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+/// Generates a synthetic assembly of configurable size and times every
+/// phase of assembling it: parsing, label resolution, symbol replacement,
+/// encoding and writing the image. The results of all runs are printed as
+/// a single JSON object on stdout, a readable summary goes to stderr.
+///
+/// The generated source consists of a main file and a chain of depth
+/// includes. Symbols are defined in their own include, instructions, labels
+/// and string literals are spread evenly over the main file and the chain.
+///
+/// Built by bench_cmd of build.mb once the assembler is built, or by hand
+/// from the repository root:
+///   SRC=$(ls src/*.c src/butter/*.c | grep -v main.c)
+///   clang -O3 -Isrc/ bench/suite.c $SRC -o suite_bench -lm -lpthread
+///
+/// Example:
+///   ./suite_bench -n 1000000 -l 50000 -k 5000 -d 8 > result.json
+
+#include <assembler.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PHASE_COUNT 5
+
+static const char *phase_names[PHASE_COUNT] = {"parse", "resolve_labels",
+                                               "replace_symbols", "encode",
+                                               "write"};
+
+typedef struct bench_config_t {
+  size_t instructions;
+  size_t labels;
+  size_t symbols;
+  size_t depth;
+  size_t strings;
+  size_t string_len;
+  size_t runs;
+  size_t jobs;
+  char *dir;
+} bench_config_t;
+
+typedef struct bench_source_t {
+  size_t files;
+  size_t bytes;
+  size_t lines;
+} bench_source_t;
+
+static double _now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/// Deterministic pseudo-random numbers, so every run assembles the same
+/// source
+static size_t _next_rand(size_t *state) {
+  *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+  return *state >> 33;
+}
+
+/// Share of count which goes to part out of parts
+static size_t _share(size_t count, size_t part, size_t parts) {
+  return count / parts + (part < count % parts);
+}
+
+static FILE *_open_part(bench_config_t *cfg, bench_source_t *out,
+                        const char *name) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", cfg->dir, name);
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+    fprintf(stderr, "could not write %s\n", path);
+
+  out->files++;
+  return f;
+}
+
+static void _close_part(FILE *f, bench_source_t *out) {
+  out->bytes += ftell(f);
+  fclose(f);
+}
+
+static void _gen_string(FILE *f, size_t len, size_t *rand) {
+  fprintf(f, ".bytes %zut \"", len);
+  for (size_t i = 0; i < len; i++) {
+    // Escapes force the parser to copy the literal
+    if (_next_rand(rand) % 64 == 0) {
+      fputs("\\n", f);
+      continue;
+    }
+
+    fputc('a' + _next_rand(rand) % 26, f);
+  }
+  fputs("\"\n", f);
+}
+
+/// Writes the instructions, labels and strings of one part of the chain.
+/// Labels are numbered globally, first_label is the first one of this part.
+static void _gen_code(FILE *f, bench_config_t *cfg, bench_source_t *out,
+                      size_t part, size_t first_label, size_t *rand) {
+  size_t parts = cfg->depth + 1;
+  size_t insts = _share(cfg->instructions, part, parts);
+  size_t labels = _share(cfg->labels, part, parts);
+  size_t strings = _share(cfg->strings, part, parts);
+
+  size_t label = 0;
+  size_t string = 0;
+  for (size_t i = 0; i < insts; i++) {
+    if (label < labels && i * labels / insts >= label) {
+      fprintf(f, "L%zu:\n", first_label + label++);
+      out->lines++;
+    }
+
+    if (string < strings && i * strings / insts >= string) {
+      _gen_string(f, cfg->string_len, rand);
+      string++;
+      out->lines++;
+    }
+
+    switch (i % 4) {
+    case 0:
+      if (cfg->symbols > 0) {
+        fprintf(f, "  ld a, ?S%zu\n", _next_rand(rand) % cfg->symbols);
+        break;
+      }
+      // fallthrough
+    case 1:
+      fprintf(f, "  add a, $#%.4zx ; comment\n", _next_rand(rand) & 0xffff);
+      break;
+    case 2:
+      fprintf(f, "  st a, $%.4zx\n", _next_rand(rand) & 0xffff);
+      break;
+    case 3:
+      if (cfg->labels > 0) {
+        fprintf(f, "  brn L%zu\n", _next_rand(rand) % cfg->labels);
+        break;
+      }
+
+      fprintf(f, "  nop\n");
+      break;
+    }
+    out->lines++;
+  }
+
+  // Labels which did not get an instruction
+  for (; label < labels; label++) {
+    fprintf(f, "L%zu:\n", first_label + label);
+    out->lines++;
+  }
+}
+
+static int _gen_source(bench_config_t *cfg, bench_source_t *out) {
+  mkdir(cfg->dir, 0777);
+  memset(out, 0, sizeof(bench_source_t));
+  size_t rand = 1;
+
+  FILE *f = _open_part(cfg, out, "symbols.inc");
+  if (f == NULL)
+    return 0;
+
+  // Includes are parsed after the including file, so the section has to be
+  // set here
+  fprintf(f, ".symbols\n");
+  for (size_t i = 0; i < cfg->symbols; i++)
+    fprintf(f, "S%zu $#%.4zx\n", i, _next_rand(&rand) & 0xffff);
+  out->lines += cfg->symbols + 1;
+  _close_part(f, out);
+
+  size_t first_label = 0;
+  for (size_t part = 0; part <= cfg->depth; part++) {
+    char name[64];
+    if (part == 0)
+      snprintf(name, sizeof(name), "main.s");
+    else
+      snprintf(name, sizeof(name), "part%zu.inc", part);
+
+    f = _open_part(cfg, out, name);
+    if (f == NULL)
+      return 0;
+
+    if (part == 0) {
+      fprintf(f, ".inc \"symbols.inc\"\n");
+      out->lines++;
+    }
+
+    fprintf(f, ".text\n");
+    out->lines++;
+    _gen_code(f, cfg, out, part, first_label, &rand);
+    first_label += _share(cfg->labels, part, cfg->depth + 1);
+
+    if (part < cfg->depth) {
+      fprintf(f, ".inc \"part%zu.inc\"\n", part + 1);
+      out->lines++;
+    }
+
+    _close_part(f, out);
+  }
+
+  return 1;
+}
+
+/// Runs all phases once, writing their durations to times
+static err_t _run(bench_config_t *cfg, double *times, size_t *out_size) {
+  asm_tree_t ast;
+  asm_init_tree(&ast);
+  ast.opts.jobs = cfg->jobs;
+
+  double start = _now_ms();
+  err_t err = asm_parse_file("main.s", &ast);
+  times[0] = _now_ms() - start;
+  if (err != TASM_OK)
+    goto run_cleanup;
+
+  start = _now_ms();
+  err = asm_resolve_labels(&ast);
+  times[1] = _now_ms() - start;
+  if (err != TASM_OK)
+    goto run_cleanup;
+
+  start = _now_ms();
+  err = asm_replace_symbols(&ast);
+  times[2] = _now_ms() - start;
+  if (err != TASM_OK)
+    goto run_cleanup;
+
+  uint8_t *bin;
+  start = _now_ms();
+  err = asm_encode_tree(&ast, &bin, out_size);
+  times[3] = _now_ms() - start;
+  if (err != TASM_OK) {
+    free(bin);
+    goto run_cleanup;
+  }
+
+  start = _now_ms();
+  FILE *out = fopen("out.bin", "w");
+  if (out != NULL) {
+    fwrite(bin, *out_size, 1, out);
+    fclose(out);
+  }
+  times[4] = _now_ms() - start;
+  free(bin);
+
+run_cleanup:
+  asm_free_tree(&ast);
+  return err;
+}
+
+static int _cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void _print_phase(FILE *json, const char *name, double *times,
+                         size_t runs, int last) {
+  double sum = 0;
+  for (size_t i = 0; i < runs; i++)
+    sum += times[i];
+
+  qsort(times, runs, sizeof(double), _cmp_double);
+  double median = runs % 2 ? times[runs / 2]
+                           : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+
+  fprintf(json,
+          "    \"%s\": {\"min_ms\": %.3f, \"median_ms\": %.3f, "
+          "\"mean_ms\": %.3f, \"max_ms\": %.3f}%s\n",
+          name, times[0], median, sum / runs, times[runs - 1],
+          last ? "" : ",");
+  fprintf(stderr, "%-16s %10.2f %10.2f %10.2f\n", name, times[0], median,
+          times[runs - 1]);
+}
+
+static void _usage(char *prog) {
+  fprintf(stderr,
+          "usage: %s [-n instructions] [-l labels] [-k symbols] [-d depth]\n"
+          "       [-t strings] [-s string length] [-r runs] [-j jobs]\n"
+          "       [-w work directory]\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  bench_config_t cfg = {.instructions = 100000,
+                        .labels = 10000,
+                        .symbols = 1000,
+                        .depth = 4,
+                        .strings = 100,
+                        .string_len = 256,
+                        .runs = 5,
+                        .jobs = 1,
+                        .dir = "/tmp/tasm_bench"};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:l:k:d:t:s:r:j:w:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      cfg.instructions = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      cfg.labels = strtoul(optarg, NULL, 10);
+      break;
+    case 'k':
+      cfg.symbols = strtoul(optarg, NULL, 10);
+      break;
+    case 'd':
+      cfg.depth = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      cfg.strings = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      cfg.string_len = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      cfg.runs = strtoul(optarg, NULL, 10);
+      break;
+    case 'j':
+      cfg.jobs = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      cfg.dir = optarg;
+      break;
+    default:
+      _usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (cfg.runs == 0 || cfg.jobs == 0) {
+    _usage(argv[0]);
+    return 1;
+  }
+
+  bench_source_t src;
+  if (!_gen_source(&cfg, &src))
+    return 1;
+
+  // Includes are resolved relative to the working directory
+  if (chdir(cfg.dir) != 0) {
+    fprintf(stderr, "could not enter %s\n", cfg.dir);
+    return 1;
+  }
+
+  // The assembler logs to stdout, keep it out of the results
+  fflush(stdout);
+  FILE *json = fdopen(dup(STDOUT_FILENO), "w");
+  if (json == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    return 1;
+
+  double *times = malloc(sizeof(double) * PHASE_COUNT * cfg.runs);
+  size_t out_size = 0;
+  for (size_t r = 0; r < cfg.runs; r++) {
+    double run_times[PHASE_COUNT] = {0};
+    err_t err = _run(&cfg, run_times, &out_size);
+    if (err != TASM_OK) {
+      fprintf(stderr, "assembly failed: %s\n", asm_errname(err));
+      return 1;
+    }
+
+    for (size_t p = 0; p < PHASE_COUNT; p++)
+      times[p * cfg.runs + r] = run_times[p];
+  }
+
+  fprintf(stderr, "%zu files, %zu lines, %zu bytes -> %zu bytes\n",
+          src.files, src.lines, src.bytes, out_size);
+  fprintf(stderr, "%-16s %10s %10s %10s\n", "phase", "min ms", "median ms",
+          "max ms");
+
+  fprintf(json, "{\n");
+  fprintf(json, "  \"version\": \"%s\",\n", TASM_VERSION);
+  fprintf(json,
+          "  \"config\": {\"instructions\": %zu, \"labels\": %zu, "
+          "\"symbols\": %zu, \"depth\": %zu, \"strings\": %zu, "
+          "\"string_len\": %zu, \"runs\": %zu, \"jobs\": %zu},\n",
+          cfg.instructions, cfg.labels, cfg.symbols, cfg.depth, cfg.strings,
+          cfg.string_len, cfg.runs, cfg.jobs);
+  fprintf(json,
+          "  \"source\": {\"files\": %zu, \"lines\": %zu, \"bytes\": %zu},\n",
+          src.files, src.lines, src.bytes);
+  fprintf(json, "  \"output_bytes\": %zu,\n", out_size);
+  fprintf(json, "  \"phases\": {\n");
+
+  double total[cfg.runs];
+  for (size_t r = 0; r < cfg.runs; r++) {
+    total[r] = 0;
+    for (size_t p = 0; p < PHASE_COUNT; p++)
+      total[r] += times[p * cfg.runs + r];
+  }
+
+  for (size_t p = 0; p < PHASE_COUNT; p++)
+    _print_phase(json, phase_names[p], &times[p * cfg.runs], cfg.runs, 0);
+  _print_phase(json, "total", total, cfg.runs, 1);
+
+  fprintf(json, "  }\n}\n");
+  fclose(json);
+  free(times);
+  return 0;
+}
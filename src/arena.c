@@ -0,0 +1,112 @@
+// t(heft)asm ; arena.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <arena.h>
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+static arena_block_t *_new_block(arena_t *arena, size_t min_size) {
+  size_t size = min_size > ARENA_BLOCK_SIZE ? min_size : ARENA_BLOCK_SIZE;
+  arena_block_t *block = malloc(sizeof(arena_block_t) + size);
+  block->size = size;
+  block->used = 0;
+  block->next = arena->head;
+  arena->head = block;
+  return block;
+}
+
+static void *_alloc(arena_t *arena, size_t size, size_t align) {
+  arena_block_t *block = arena->head;
+  if (block != NULL) {
+    uintptr_t free_ptr = (uintptr_t)(block->data + block->used);
+    size_t start = ((free_ptr + align - 1) & ~(align - 1)) -
+                   (uintptr_t)block->data;
+    if (start + size <= block->size) {
+      block->used = start + size;
+      return block->data + start;
+    }
+  }
+
+  // malloc aligns for any type, so a fresh block needs no padding
+  block = _new_block(arena, size);
+  block->used = size;
+  return block->data;
+}
+
+void arena_init(arena_t *arena) { arena->head = NULL; }
+
+void arena_free(arena_t *arena) {
+  arena_block_t *block = arena->head;
+  while (block != NULL) {
+    arena_block_t *next = block->next;
+    free(block);
+    block = next;
+  }
+
+  arena->head = NULL;
+}
+
+void arena_reset(arena_t *arena) {
+  arena_block_t *block = arena->head;
+  if (block == NULL)
+    return;
+
+  arena_t rest = {.head = block->next};
+  arena_free(&rest);
+  block->next = NULL;
+  block->used = 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  return _alloc(arena, size, ARENA_ALIGN);
+}
+
+void *arena_realloc(arena_t *arena, void *ptr, size_t old_size,
+                    size_t new_size) {
+  if (ptr == NULL)
+    return arena_alloc(arena, new_size);
+
+  if (new_size <= old_size)
+    return ptr;
+
+  // Extend in place if ptr is the last allocation in the current block
+  arena_block_t *block = arena->head;
+  if ((char *)ptr + old_size == block->data + block->used &&
+      (char *)ptr + new_size <= block->data + block->size) {
+    block->used += new_size - old_size;
+    return ptr;
+  }
+
+  void *new = arena_alloc(arena, new_size);
+  memcpy(new, ptr, old_size);
+  return new;
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len) {
+  char *ret = _alloc(arena, len + 1, 1);
+  memcpy(ret, str, len);
+  ret[len] = 0;
+  return ret;
+}
+
+char *arena_strdup(arena_t *arena, const char *str) {
+  return arena_strndup(arena, str, strlen(str));
+}
+
+void arena_grow_array(arena_t *arena, void **ptr, size_t elem_size,
+                      size_t count, size_t *capacity) {
+  if (count < *capacity)
+    return;
+
+  size_t new_capacity = *capacity == 0 ? 8 : *capacity * 2;
+  *ptr = arena_realloc(arena, *ptr, *capacity * elem_size,
+                       new_capacity * elem_size);
+  *capacity = new_capacity;
+}
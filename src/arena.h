@@ -0,0 +1,57 @@
+// t(heft)asm ; arena.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Bump allocator owning all memory of an assembly context. Allocations are
+/// never freed individually, arena_free releases everything at once.
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct arena_block_t {
+  struct arena_block_t *next;
+  size_t size;
+  size_t used;
+  char data[];
+} arena_block_t;
+
+typedef struct arena_t {
+  arena_block_t *head;
+} arena_t;
+
+void arena_init(arena_t *arena);
+
+/// Releases all blocks of the arena, every pointer obtained from it becomes
+/// invalid.
+void arena_free(arena_t *arena);
+
+/// Releases everything allocated from the arena but keeps its most recent
+/// block for further allocations, every pointer obtained from it becomes
+/// invalid.
+void arena_reset(arena_t *arena);
+
+/// Allocates size bytes aligned for any type
+void *arena_alloc(arena_t *arena, size_t size);
+
+/// Grows an allocation from old_size to new_size. If ptr is the most recent
+/// allocation of the arena it is extended in place, otherwise its contents
+/// are copied to a new allocation. ptr may be NULL.
+void *arena_realloc(arena_t *arena, void *ptr, size_t old_size,
+                    size_t new_size);
+
+/// Copies len bytes of str into the arena and terminates the copy
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+
+char *arena_strdup(arena_t *arena, const char *str);
+
+/// Grows the array *ptr of elem_size sized elements geometrically so that it
+/// can hold at least count + 1 elements. *capacity is updated accordingly.
+void arena_grow_array(arena_t *arena, void **ptr, size_t elem_size,
+                      size_t count, size_t *capacity);
+
+#endif
@@ -5,26 +5,142 @@
 
 #include <assembler.h>
 
+#include <cache.h>
 #include <debug_utils.h>
+#include <engine.h>
+#include <intern.h>
 #include <log.h>
+#include <search_path.h>
+#include <tef.h>
 
 #include <butter/strutils.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 //-- Static Utilities --//
 
-static uint8_t _handle_err(err_t err, char *file, char *line,
-                           uint32_t linenum) {
+/// Reports an error to the diagnostic callback of the tree, or logs it if
+/// there is none. detail may be NULL.
+static uint8_t _handle_err(asm_tree_t *ast, err_t err, const char *file,
+                           uint32_t linenum, asm_tok_t where,
+                           const char *detail) {
+  if (ast->opts.diag != NULL) {
+    asm_diag_t diag = {.err = err,
+                       .file = file,
+                       .line = linenum,
+                       .col = where.col,
+                       .where = where.str,
+                       .where_len = where.len,
+                       .detail = detail};
+    ast->opts.diag(ast->opts.user, &diag);
+    return 0;
+  }
+
+  if (detail != NULL)
+    log_err("%s\n", detail);
   log_err("Assembly failed!\n");
   log_err("%s\n", asm_errname(err));
-  log_err("%s:%lu: %s\n", file, linenum, line);
+  log_err("%s:%u:%u: %.*s\n", file, linenum, where.col, (int)where.len,
+          where.str);
   return 0;
 }
 
+static asm_tok_t _unknown_tok(uint16_t col) {
+  return (asm_tok_t){.str = "?", .len = 1, .col = col, .flags = 0};
+}
+
+/// Reports a source file which can not be read, err_errno is its errno
+static void _report_open_err(asm_tree_t *ast, const char *file,
+                             int err_errno) {
+  char detail[256];
+  snprintf(detail, sizeof(detail), "Error opening \"%s\": %s", file,
+           strerror(err_errno));
+  if (ast->opts.diag != NULL)
+    _handle_err(ast, TASM_IO_ERROR, file, 0, _unknown_tok(0), detail);
+  else
+    log_err("%s\n", detail);
+}
+
+/// Describes a chain of count includes which leads back to its first file
+static void _cycle_detail(char *detail, size_t size, const char **files,
+                          size_t count) {
+  size_t len = snprintf(detail, size, "\"%s\" includes itself:", files[0]);
+  for (size_t i = 0; i < count && len < size; i++)
+    len += snprintf(detail + len, size - len, "%s\"%s\"",
+                    i == 0 ? " " : " -> ", files[i]);
+}
+
+static double _now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/// Parses the digits of an unsigned number in the given base, base 0
+/// detects it like strtoul. Parsing stops at the first invalid character,
+/// the number of consumed characters is returned.
+static size_t _parse_num(const char *str, size_t len, int base,
+                         unsigned long *dest) {
+  size_t i = 0;
+  if (base == 0) {
+    base = 10;
+    if (len > 1 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+      base = 16;
+      i = 2;
+    } else if (len > 0 && str[0] == '0') {
+      base = 8;
+    }
+  }
+
+  unsigned long value = 0;
+  for (; i < len; i++) {
+    int digit;
+    char c = str[i];
+    if (c >= '0' && c <= '9')
+      digit = c - '0';
+    else if (c >= 'a' && c <= 'z')
+      digit = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'Z')
+      digit = c - 'A' + 10;
+    else
+      break;
+
+    if (digit >= base)
+      break;
+    value = value * base + digit;
+  }
+
+  *dest = value;
+  return i;
+}
+
+/// Parses the number of an address/value parameter. Numbers are hexadecimal
+/// unless postfixed with TASM_CHAR_DECIMAL_POSTFIX, or with
+/// TASM_CHAR_BINARY_POSTFIX while consisting only of binary digits.
+static unsigned long _parse_literal(const char *str, size_t len) {
+  unsigned long value = 0;
+  if (len > 1 && str[len - 1] == TASM_CHAR_DECIMAL_POSTFIX) {
+    _parse_num(str, len - 1, 10, &value);
+  } else if (len > 1 && str[len - 1] == TASM_CHAR_BINARY_POSTFIX &&
+             _parse_num(str, len - 1, 2, &value) == len - 1) {
+    // value already parsed as binary
+  } else {
+    _parse_num(str, len, 16, &value);
+  }
+
+  return value;
+}
+
 static reg_t _get_register(char reg_id) {
   switch (reg_id) {
   case 'a':
@@ -51,11 +167,12 @@ static size_t _dir_exp_size(asm_exp_t exp) {
   case DIR_BYTES:
   case DIR_PADDING:
   case DIR_NULLPAD:
-    if (exp.parameters == NULL || exp.parameters[0] == NULL)
+    if (exp.parameter_count == 0)
       return 0;
 
-    char *pend;
-    return (size_t)strtol(exp.parameters[0], &pend, 0);
+    unsigned long size;
+    _parse_num(exp.parameters[0].str, exp.parameters[0].len, 0, &size);
+    return (size_t)size;
   case DIR_BYTE:
     return 1;
   default:
@@ -63,50 +180,42 @@ static size_t _dir_exp_size(asm_exp_t exp) {
   }
 }
 
-static size_t _get_inst_size(inst_t inst) {
-  for (int i = 0; i < INST_COUNT; i++) {
-    if (inst_descriptors[i].inst == inst) {
-      return inst_descriptors[i].size;
-    }
-  }
+/// inst_descriptors indexed by opcode, mnemonics sharing an opcode map to
+/// the first of them
+static inst_descriptor_t *_inst_table[256];
+static pthread_once_t _inst_table_once = PTHREAD_ONCE_INIT;
 
-  return 0;
+static void _init_inst_table() {
+  for (int i = INST_COUNT - 1; i >= 0; i--)
+    _inst_table[inst_descriptors[i].inst & 0xff] = &inst_descriptors[i];
 }
 
-static size_t _get_inst_param_count(inst_t inst) {
-  for (int i = 0; i < INST_COUNT; i++) {
-    if (inst_descriptors[i].inst == inst) {
-      return inst_descriptors[i].param_count;
-    }
-  }
-
-  return 0;
+/// Returns the descriptor of inst, NULL if it is INST_INVALID
+static inst_descriptor_t *_get_inst_descriptor(inst_t inst) {
+  pthread_once(&_inst_table_once, _init_inst_table);
+  return inst == INST_INVALID ? NULL : _inst_table[inst & 0xff];
 }
 
-static size_t _precalc_size(asm_tree_t *ast) {
-  size_t ret = 0;
-
-  for (size_t b = 0; b < ast->branch_count; b++) {
-    asm_tree_branch_t branch = ast->branches[b];
-
-    for (size_t e = 0; e < branch.exp_count; e++) {
-      asm_exp_t exp = branch.asm_exp[e];
-      if (exp.type != EXP_INSTRUCTION) {
-        if (exp.type == EXP_LABEL)
-          continue;
-        if (exp.directive != DIR_NULLPAD && exp.directive != DIR_BYTE &&
-            exp.directive != DIR_BYTES)
-          continue;
-
-        ret += _dir_exp_size(exp);
-        continue;
-      }
+static size_t _get_inst_size(inst_t inst) {
+  inst_descriptor_t *desc = _get_inst_descriptor(inst);
+  return desc != NULL ? desc->size : 0;
+}
 
-      ret += _get_inst_size(exp.inst);
-    }
+/// Number of bytes exp takes up in the output
+static size_t _exp_size(asm_exp_t *exp) {
+  switch (exp->type) {
+  case EXP_DIRECTIVE:
+    return _dir_exp_size(*exp);
+  case EXP_INSTRUCTION:
+    return _get_inst_size(exp->inst);
+  default:
+    return 0;
   }
+}
 
-  return ret;
+static size_t _get_inst_param_count(inst_t inst) {
+  inst_descriptor_t *desc = _get_inst_descriptor(inst);
+  return desc != NULL ? desc->param_count : 0;
 }
 
 static void _mod_inst_address(uint8_t *inst) {
@@ -147,582 +256,3995 @@ static void _mod_inst_register(uint8_t *inst, reg_t reg) {
   }
 }
 
-static err_t _get_label_addr(asm_tree_t *ast, char *label, uint16_t *dest) {
-  err_t ret = TASM_INVALID_LABEL;
-  for (size_t b = 0; b < ast->branch_count; b++) {
-    asm_tree_branch_t *branch = &ast->branches[b];
-    for (size_t e = 0; e < branch->exp_count; e++) {
-      asm_exp_t *exp = &branch->asm_exp[e];
-      if (exp->type != EXP_LABEL)
-        continue;
+static err_t _get_label_addr(asm_tree_t *ast, uint32_t id, uint32_t *dest) {
+  size_t position;
+  if (!idmap_get(&ast->label_map, id, &position))
+    return TASM_INVALID_LABEL;
 
-      if (strcmp(exp->parameters[0], label) != 0)
-        continue;
+  *dest = position & 0xffff;
+  return TASM_OK;
+}
+
+/// Returns the symbol with the interned name id, NULL if there is none
+static asm_symbol_t *_get_symbol(asm_tree_t *ast, uint32_t id) {
+  size_t ix;
+  if (!idmap_get(&ast->symbol_map, id, &ix))
+    return NULL;
+
+  return &ast->symbols[ix];
+}
+
+/// Returns the symbol a parameter refers to, NULL if there is none. Names
+/// which were never interned can not belong to a symbol either.
+static asm_symbol_t *_find_symbol(asm_tree_t *ast, asm_tok_t param) {
+  return _get_symbol(ast, intern_find(param.str + 1, param.len - 1));
+}
+
+/// Decodes a parameter into the operand it is encoded as. The value of
+/// labels and symbols is left at 0, see _intern_operand.
+static void _decode_operand(asm_tok_t tok, uint8_t *kind, uint32_t *value) {
+  const char *str = tok.str;
+  size_t len = tok.len;
+  *value = 0;
+  if (len == 0) {
+    *kind = OPERAND_EMPTY;
+    return;
+  }
+
+  switch (str[0]) {
+  case TASM_CHAR_CHAR_CONT:
+    *kind = len == 3 ? OPERAND_CHAR : OPERAND_INVALID;
+    *value = len == 3 ? (uint8_t)str[1] : TASM_INVALID_PARAMETER_FORMAT;
+    return;
+  case TASM_CHAR_ADDRESS_PREFIX:
+    if (len < 2) {
+      *kind = OPERAND_INVALID;
+      *value = TASM_INVALID_PARAMETER_FORMAT;
+      return;
+    }
 
-      *dest = exp->lbl_position;
-      ret = TASM_OK;
-      goto _get_label_addr_exit;
+    size_t offset = str[1] == TASM_CHAR_VALUE_PREFIX ? 2 : 1;
+    *kind = offset == 2 ? OPERAND_VALUE : OPERAND_ADDRESS;
+    *value = _parse_literal(str + offset, len - offset) & 0xffff;
+    return;
+  case 'a':
+  case 'c':
+  case 'd':
+  case 'e':
+  case 'f':
+  case 'g':
+  case 'h':
+    *kind = len == 1 ? OPERAND_REGISTER : OPERAND_IGNORED;
+    *value = len == 1 ? _get_register(str[0]) : 0;
+    return;
+  case TASM_CHAR_SYMBOL_USAGE_PREFIX:
+    // Strings are never replaced, so they end up as label names
+    if (!(tok.flags & TOK_STRING)) {
+      *kind = OPERAND_SYMBOL;
+      return;
     }
+    break;
+  default:
+    break;
   }
 
-_get_label_addr_exit:
-  return ret;
+  *kind = OPERAND_LABEL;
 }
 
-static err_t _do_dir_include(asm_tree_t *ast, char **params,
-                             size_t param_count) {
-  if (param_count < 1)
-    return TASM_DIRECTIVE_MISSING_PARAMETER;
+/// Returns the value of a decoded operand with the name of a label or
+/// symbol interned
+static uint32_t _intern_operand(asm_tok_t tok, uint8_t kind, uint32_t value) {
+  if (kind == OPERAND_LABEL)
+    return intern(tok.str, tok.len);
+  if (kind == OPERAND_SYMBOL)
+    return intern(tok.str + 1, tok.len - 1);
+
+  return value;
+}
+
+/// Returns the operand a symbol usage is replaced with. Values naming a
+/// label are only interned once a symbol is used, most never are. Names
+/// which were never interned can not belong to a label either.
+static uint32_t _symbol_operand(asm_symbol_t *symbol) {
+  if (symbol->kind == OPERAND_LABEL)
+    return intern_find(symbol->value.str, symbol->value.len);
 
-  return asm_parse_file(params[0], ast);
+  return symbol->operand;
 }
 
-static char *_get_symbol(asm_tree_t *ast, char *name) {
-  for (size_t s = 0; s < ast->symbol_count; s++) {
-    if (strcmp(name, ast->symbols[s].name) == 0)
-      return strdup(ast->symbols[s].value);
+/// Makes room for count more operands in the branch, returns the index of
+/// the first one
+static size_t _reserve_operands(asm_tree_branch_t *branch, size_t count) {
+  size_t needed = branch->operand_count + count;
+  if (needed > branch->operand_capacity) {
+    size_t capacity = branch->operand_capacity;
+    if (capacity == 0)
+      capacity = 16;
+    while (capacity < needed)
+      capacity *= 2;
+
+    branch->operand_kinds =
+        arena_realloc(&branch->arena, branch->operand_kinds,
+                      branch->operand_capacity, capacity);
+    branch->operand_values =
+        arena_realloc(&branch->arena, branch->operand_values,
+                      sizeof(uint32_t) * branch->operand_capacity,
+                      sizeof(uint32_t) * capacity);
+    branch->operand_capacity = capacity;
   }
 
-  return NULL;
+  size_t first = branch->operand_count;
+  branch->operand_count = needed;
+  return first;
+}
+
+/// Decodes params and appends them to the operands of the branch
+static void _push_operands(asm_tree_branch_t *branch, asm_tok_t *params,
+                           size_t count) {
+  size_t first = _reserve_operands(branch, count);
+  for (size_t p = 0; p < count; p++) {
+    uint8_t *kind = &branch->operand_kinds[first + p];
+    uint32_t *value = &branch->operand_values[first + p];
+    _decode_operand(params[p], kind, value);
+    *value = _intern_operand(params[p], *kind, *value);
+  }
+}
+
+/// Gives a cloned branch its own copy of the operands before they change
+static void _own_operands(asm_tree_branch_t *branch) {
+  if (!branch->operands_borrowed)
+    return;
+
+  uint8_t *kinds = arena_alloc(&branch->arena, branch->operand_count);
+  uint32_t *values =
+      arena_alloc(&branch->arena, sizeof(uint32_t) * branch->operand_count);
+  memcpy(kinds, branch->operand_kinds, branch->operand_count);
+  memcpy(values, branch->operand_values,
+         sizeof(uint32_t) * branch->operand_count);
+  branch->operand_kinds = kinds;
+  branch->operand_values = values;
+  branch->operands_borrowed = 0;
+}
+
+/// Converts the escape sequences of a string token into a copy owned by
+/// the arena. The converted string is never longer than the source.
+static asm_tok_t _materialize_str(asm_tree_branch_t *branch, asm_tok_t tok) {
+  char *buf = arena_strndup(&branch->arena, tok.str, tok.len);
+  char *converted = convert_escape_sequences(buf);
+  size_t len = strlen(converted);
+  memcpy(buf, converted, len + 1);
+  free(converted);
+
+  tok.str = buf;
+  tok.len = len;
+  tok.flags &= ~TOK_ESCAPED;
+  return tok;
 }
 
-static uint8_t _str_closed(char *str) {
-  size_t len = strlen(str);
+//-- Constant Expressions --//
+
+/// Deepest nesting of operators, parentheses and symbol references in the
+/// value of a symbol
+#define CONST_MAX_DEPTH 1024
+
+/// Operand of an OPERAND_EXPR symbol: it was not evaluated yet, it is being
+/// evaluated or its evaluation failed with the err_t or'd to CONST_FAILED
+#define CONST_PENDING 0
+#define CONST_EVALUATING 1
+#define CONST_FAILED 0x100
+
+/// Result of a constant expression. Plain numbers have no kind, they
+/// become an immediate value when used by an instruction.
+typedef struct _const_t {
+  uint8_t kind;
+  uint32_t value;
+} _const_t;
+
+typedef struct _const_parser_t {
+  asm_tree_t *ast;
+  const char *pos;
+  const char *end;
+  size_t depth;
+  /// Symbols which are not defined are an error, otherwise the value is
+  /// evaluated again later
+  uint8_t final;
+  /// Set if a symbol which is not defined was used
+  uint8_t missing;
+} _const_parser_t;
+
+static err_t _eval_symbol(asm_tree_t *ast, asm_symbol_t *symbol,
+                          uint8_t final, size_t depth, uint8_t *missing);
+
+static err_t _const_binary(_const_parser_t *p, int min_prec,
+                           _const_t *dest);
+
+static uint8_t _is_name_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c == '.';
+}
 
-  if (len == 1) {
-    return str[0] == TASM_CHAR_STRING_CONT;
-  } else if (len == 0) {
+/// Returns 1 if the value of a symbol is a constant expression: it uses an
+/// operator, refers to another symbol or is a plain number
+static uint8_t _is_const_exp(asm_tok_t value) {
+  if (value.len == 0 || (value.flags & TOK_STRING))
+    return 0;
+  if (value.str[0] == TASM_CHAR_SYMBOL_USAGE_PREFIX ||
+      (value.str[0] >= '0' && value.str[0] <= '9'))
     return 1;
+
+  static const char operators[] = "+-*/%<>&|^~()";
+  for (size_t i = 0; i < value.len; i++) {
+    // A character literal may hold anything
+    if (value.str[i] == TASM_CHAR_CHAR_CONT) {
+      i += 2;
+      continue;
+    }
+
+    if (memchr(operators, value.str[i], sizeof(operators) - 1) != NULL)
+      return 1;
   }
 
-  return (str[len - 1] == TASM_CHAR_STRING_CONT &&
-          str[len - 2] != TASM_CHAR_ESCAPE);
+  return 0;
 }
 
-static uint8_t _parse_str_tok(char **dest, char *tok) {
-  if (dest == NULL) {
-    log_wrn("internal: _parse_str_tok received NULL-poiting dest param!\n");
+/// Precedence of the kinds of results, an operation takes the kind of the
+/// operand whose kind ranks higher
+static int _const_rank(uint8_t kind) {
+  switch (kind) {
+  case OPERAND_ADDRESS:
+    return 3;
+  case OPERAND_VALUE:
+    return 2;
+  case OPERAND_CHAR:
+    return 1;
+  default:
     return 0;
   }
+}
 
-  char *tokcpy = strdup(tok);
-
-  uint8_t is_end = _str_closed(tokcpy);
-  if (is_end) {
-    tokcpy[strlen(tokcpy) - 1] = 0;
+/// Reads a single literal: a character, an address or immediate value like
+/// the operands of instructions, or a plain number which is decimal unless
+/// prefixed with 0x. Returns 0 if str is none of these.
+static uint8_t _const_literal(const char *str, size_t len, _const_t *dest) {
+  if (len == 3 && str[0] == TASM_CHAR_CHAR_CONT &&
+      str[2] == TASM_CHAR_CHAR_CONT) {
+    dest->kind = OPERAND_CHAR;
+    dest->value = (uint8_t)str[1];
+    return 1;
   }
 
-  char *fmt_tok = convert_escape_sequences(tokcpy);
+  if (len > 1 && str[0] == TASM_CHAR_ADDRESS_PREFIX) {
+    size_t offset = str[1] == TASM_CHAR_VALUE_PREFIX ? 2 : 1;
+    if (len == offset)
+      return 0;
+
+    dest->kind = offset == 2 ? OPERAND_VALUE : OPERAND_ADDRESS;
+    dest->value = _parse_literal(str + offset, len - offset) & 0xffff;
+    return 1;
+  }
 
-  // Assemble new string
-  char whitespace[] = " ";
-  char *new = malloc(strlen(dest[0]) + strlen(fmt_tok) + 2);
-  strcpy(new, dest[0]);
-  strcpy(new + strlen(dest[0]), whitespace);
-  strcpy(new + strlen(dest[0]) + 1, fmt_tok);
+  if (len == 0 || str[0] < '0' || str[0] > '9')
+    return 0;
 
-  // Swap pointers, free old string
-  free(dest[0]);
-  dest[0] = new;
+  unsigned long value;
+  if (len > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+    if (_parse_num(str + 2, len - 2, 16, &value) != len - 2)
+      return 0;
+  } else if (str[len - 1] == TASM_CHAR_DECIMAL_POSTFIX) {
+    if (_parse_num(str, len - 1, 10, &value) != len - 1)
+      return 0;
+  } else if (_parse_num(str, len, 10, &value) != len) {
+    return 0;
+  }
 
-  // cleanup
-  free(fmt_tok);
-  free(tokcpy);
+  dest->kind = OPERAND_NONE;
+  dest->value = value;
+  return 1;
+}
 
-  return !is_end;
+static void _const_skip(_const_parser_t *p) {
+  while (p->pos < p->end && (*p->pos == ' ' || *p->pos == '\t'))
+    p->pos++;
 }
 
-//-- Assembly Funcs --//
+/// Reads a parenthesized expression
+static err_t _const_group(_const_parser_t *p, _const_t *dest) {
+  p->pos++;
+  err_t err = _const_binary(p, 1, dest);
+  if (err != TASM_OK)
+    return err;
 
-err_t asm_parse_symbol(asm_tree_t *ast, char *name, size_t word_count,
-                       char **words) {
-  if (name == NULL || words == NULL) {
-    log_wrn("internal: asm_parse_symbol was passed one or more NULL-values\n");
-    return TASM_OK;
-  }
+  _const_skip(p);
+  if (p->pos >= p->end || *p->pos != ')')
+    return TASM_INVALID_PARAMETER_FORMAT;
 
-  if (ast->symbol_count == 0) {
-    ast->symbols = malloc(sizeof(asm_symbol_t));
-  } else {
-    ast->symbols =
-        realloc(ast->symbols, sizeof(asm_symbol_t) * (ast->symbol_count + 1));
+  p->pos++;
+  return TASM_OK;
+}
+
+/// Takes the value of the symbol named by the first len bytes of name.
+/// Only symbols holding a number, an address, an immediate value or a
+/// character can be used in expressions.
+static err_t _const_symbol(_const_parser_t *p, const char *name, size_t len,
+                           _const_t *dest) {
+  asm_tree_t *ast = p->ast;
+  ast->stats.symbol_lookups++;
+  asm_symbol_t *symbol = _get_symbol(ast, intern_find(name, len));
+  if (symbol == NULL) {
+    p->missing = 1;
+    return TASM_INVALID_SYMBOL;
   }
 
-  ast->symbols[ast->symbol_count].name = strdup(name);
-  ast->symbols[ast->symbol_count].value =
-      str_from_strarr(words, word_count, ' ');
+  uint8_t missing = 0;
+  err_t err = _eval_symbol(ast, symbol, p->final, p->depth + 1, &missing);
+  p->missing |= missing;
+  if (err != TASM_OK)
+    return err;
 
-  for (size_t i = 0; i < word_count; i++)
-    free(words[i]);
+  // Evaluated symbols hold their result as a literal
+  asm_tok_t value = symbol->value;
+  if ((value.flags & TOK_STRING) ||
+      !_const_literal(value.str, value.len, dest))
+    return TASM_INVALID_TYPE;
 
-  free(words);
-  ast->symbol_count++;
   return TASM_OK;
 }
 
-err_t asm_parse_exp(asm_tree_t *ast, char *keyword, size_t param_count,
-                    char **params, uint32_t line) {
-  err_t ret = TASM_OK;
-
-  if (ast->curr_section == DIR_SYMBOLS &&
-      keyword[0] != TASM_CHAR_DIRECTIVE_PREFIX)
-    return asm_parse_symbol(ast, keyword, param_count, params);
+/// Reads a call of HI or LO, which take the high and low byte of their
+/// argument, or a symbol, which may carry the usage prefix
+static err_t _const_name(_const_parser_t *p, _const_t *dest) {
+  if (*p->pos == TASM_CHAR_SYMBOL_USAGE_PREFIX)
+    p->pos++;
 
-  asm_tree_branch_t *branch = &ast->branches[ast->branch_count - 1];
+  const char *name = p->pos;
+  while (p->pos < p->end && _is_name_char(*p->pos))
+    p->pos++;
 
-  if (branch->exp_count == 0) {
-    branch->asm_exp = malloc(sizeof(asm_exp_t));
-  } else {
-    branch->asm_exp =
-        realloc(branch->asm_exp, sizeof(asm_exp_t) * (branch->exp_count + 1));
-  }
+  size_t len = p->pos - name;
+  if (len == 0)
+    return TASM_INVALID_PARAMETER_FORMAT;
 
-  branch->asm_exp[branch->exp_count].line = line;
-  branch->asm_exp[branch->exp_count].parameter_count = param_count;
-  branch->asm_exp[branch->exp_count].parameters = params;
+  _const_skip(p);
+  if (p->pos >= p->end || *p->pos != '(')
+    return _const_symbol(p, name, len, dest);
 
-  branch->asm_exp[branch->exp_count].type = EXP_INSTRUCTION;
-  if (keyword[0] == TASM_CHAR_DIRECTIVE_PREFIX) {
-    branch->asm_exp[branch->exp_count].type = EXP_DIRECTIVE;
-    branch->asm_exp[branch->exp_count].directive = get_dir(keyword + 1);
+  uint8_t hi = len == 2 && (name[0] | 0x20) == 'h' && (name[1] | 0x20) == 'i';
+  uint8_t lo = len == 2 && (name[0] | 0x20) == 'l' && (name[1] | 0x20) == 'o';
+  if (!hi && !lo)
+    return TASM_INVALID_PARAMETER_FORMAT;
 
-    switch (branch->asm_exp[branch->exp_count].directive) {
-    case DIR_SYMBOLS:
-      ast->curr_section = DIR_SYMBOLS;
-      break;
-    case DIR_TEXT:
-      ast->curr_section = DIR_TEXT;
-      break;
-    default:
-      break;
-    }
-  } else if (keyword[strlen(keyword) - 1] == TASM_CHAR_LABEL_POSTFIX) {
-    branch->asm_exp[branch->exp_count].type = EXP_LABEL;
-    branch->asm_exp[branch->exp_count].parameter_count = 1;
-    branch->asm_exp[branch->exp_count].parameters = malloc(sizeof(char *));
-    branch->asm_exp[branch->exp_count].parameters[0] = strdup(keyword);
-    branch->asm_exp[branch->exp_count].parameters[0][strlen(keyword) - 1] = 0;
-  } else {
-    branch->asm_exp[branch->exp_count].inst = get_inst(keyword);
-  }
-  branch->exp_count++;
+  err_t err = _const_group(p, dest);
+  if (err != TASM_OK)
+    return err;
 
-  return ret;
+  dest->kind = OPERAND_NONE;
+  dest->value = (hi ? dest->value >> 8 : dest->value) & 0xff;
+  return TASM_OK;
 }
 
-err_t asm_parse_line(asm_tree_t *ast, char *line, uint32_t line_num) {
-  err_t ret = TASM_OK;
-  char *linecpy = strdup(line);
+static err_t _const_primary(_const_parser_t *p, _const_t *dest) {
+  const char *start = p->pos;
+  if (*start == '(')
+    return _const_group(p, dest);
+
+  if (*start == TASM_CHAR_CHAR_CONT) {
+    if (p->end - start < 3)
+      return TASM_INVALID_PARAMETER_FORMAT;
+    p->pos += 3;
+  } else if (*start == TASM_CHAR_ADDRESS_PREFIX ||
+             (*start >= '0' && *start <= '9')) {
+    p->pos++;
+    if (*start == TASM_CHAR_ADDRESS_PREFIX && p->pos < p->end &&
+        *p->pos == TASM_CHAR_VALUE_PREFIX)
+      p->pos++;
+    while (p->pos < p->end && _is_name_char(*p->pos))
+      p->pos++;
+  } else {
+    return _const_name(p, dest);
+  }
 
-  char *keyword = NULL;
+  if (!_const_literal(start, p->pos - start, dest))
+    return TASM_INVALID_PARAMETER_FORMAT;
 
-  // Trim whitespace
-  char *clean_line = trim_whitespace(linecpy);
-  if (clean_line[0] == TASM_CHAR_COMMENT)
-    goto parse_line_cleanup;
+  return TASM_OK;
+}
 
-  char *pstrtok;
-  char *tok = strtok_r(clean_line, " ", &pstrtok);
-  if (tok == NULL)
-    goto parse_line_cleanup;
+static err_t _const_unary(_const_parser_t *p, _const_t *dest) {
+  _const_skip(p);
+  if (p->pos >= p->end)
+    return TASM_INVALID_PARAMETER_FORMAT;
+  if (p->depth >= CONST_MAX_DEPTH)
+    return TASM_INVALID_SYMBOL;
+
+  char op = *p->pos;
+  if (op != '-' && op != '~' && op != '+') {
+    p->depth++;
+    err_t err = _const_primary(p, dest);
+    p->depth--;
+    return err;
+  }
 
-  size_t parameter_count = 0;
-  char **parameters = NULL;
-
-  uint8_t ix = 0;
-  uint8_t in_string = 0;
-  while (tok != NULL) {
-    if (ix == 0) {
-      keyword = strdup(tok);
-      goto parse_line_next_tok;
-    }
-
-    if (in_string) {
-      char *strptr = parameters[parameter_count - 1];
-      in_string = _parse_str_tok(&strptr, tok);
-      parameters[parameter_count - 1] = strptr;
-      goto parse_line_next_tok;
-    } else if (tok[0] == TASM_CHAR_COMMENT) {
-      break;
-    }
+  p->pos++;
+  p->depth++;
+  err_t err = _const_unary(p, dest);
+  p->depth--;
+  if (err != TASM_OK)
+    return err;
 
-    if (parameter_count == 0) {
-      parameters = malloc(sizeof(char *));
-    } else {
-      parameters = realloc(parameters, sizeof(char *) * (parameter_count + 1));
-    }
+  if (op == '-')
+    dest->value = -dest->value;
+  else if (op == '~')
+    dest->value = ~dest->value;
 
-    if (tok[0] == TASM_CHAR_STRING_CONT) {
-      in_string = 1;
-      parameters[parameter_count] = strdup(tok + 1);
-    } else {
-      parameters[parameter_count] = strdup(tok);
-      if (tok[strlen(tok) - 1] == TASM_CHAR_PARAM_SEPERATOR)
-        parameters[parameter_count][strlen(tok) - 1] = 0;
-    }
+  return TASM_OK;
+}
 
-    parameter_count++;
+/// Returns the precedence of the binary operator at the position, 0 if
+/// there is none. op is set to its first character.
+static int _const_operator(_const_parser_t *p, char *op) {
+  _const_skip(p);
+  if (p->pos >= p->end)
+    return 0;
 
-  parse_line_next_tok:
-    tok = strtok_r(NULL, " ", &pstrtok);
-    ix++;
+  *op = *p->pos;
+  switch (*op) {
+  case '|':
+    return 1;
+  case '^':
+    return 2;
+  case '&':
+    return 3;
+  case '<':
+  case '>':
+    return p->pos + 1 < p->end && p->pos[1] == *op ? 4 : 0;
+  case '+':
+  case '-':
+    return 5;
+  case '*':
+  case '/':
+  case '%':
+    return 6;
+  default:
+    return 0;
   }
+}
 
-  if (in_string) {
-    if (!_str_closed(parameters[parameter_count - 1])) {
-      ret = TASM_STRING_NOT_CLOSED;
-      goto parse_line_cleanup;
-    } else {
-      size_t len = strlen(parameters[parameter_count - 1]);
-      parameters[parameter_count - 1][len - 1] = 0;
-    }
+static err_t _const_apply(char op, _const_t *lhs, const _const_t *rhs) {
+  uint32_t a = lhs->value;
+  uint32_t b = rhs->value;
+  switch (op) {
+  case '|':
+    a |= b;
+    break;
+  case '^':
+    a ^= b;
+    break;
+  case '&':
+    a &= b;
+    break;
+  case '<':
+    a = b < 32 ? a << b : 0;
+    break;
+  case '>':
+    a = b < 32 ? a >> b : 0;
+    break;
+  case '+':
+    a += b;
+    break;
+  case '-':
+    a -= b;
+    break;
+  case '*':
+    a *= b;
+    break;
+  case '/':
+  case '%':
+    if (b == 0)
+      return TASM_INVALID_PARAMETER;
+    a = op == '/' ? a / b : a % b;
+    break;
   }
 
-  ret = asm_parse_exp(ast, keyword, parameter_count, parameters, line_num);
-parse_line_cleanup:
-  free(linecpy);
-  if (keyword != NULL)
-    free(keyword);
-  return ret;
+  lhs->value = a;
+  if (_const_rank(rhs->kind) > _const_rank(lhs->kind))
+    lhs->kind = rhs->kind;
+  return TASM_OK;
 }
 
-err_t asm_parse_file(char *src_fl, asm_tree_t *ast) {
-  FILE *file;
-  char *line = NULL;
-  size_t len = 0;
-  ssize_t read;
-  uint32_t linenum = 0;
+/// Reads operands joined by operators of at least min_prec, all binary
+/// operators are left associative
+static err_t _const_binary(_const_parser_t *p, int min_prec,
+                           _const_t *dest) {
+  err_t err = _const_unary(p, dest);
+  while (err == TASM_OK) {
+    char op;
+    int prec = _const_operator(p, &op);
+    if (prec == 0 || prec < min_prec)
+      break;
 
-  errno = 0;
-  file = fopen(src_fl, "r");
-  if (file == NULL) {
-    log_err("Error opening \"%s\": %s\n", src_fl, strerror(errno));
-    return 1;
+    p->pos += prec == 4 ? 2 : 1;
+    _const_t rhs;
+    err = _const_binary(p, prec + 1, &rhs);
+    if (err == TASM_OK)
+      err = _const_apply(op, dest, &rhs);
   }
 
-  log_inf("Parsing \"%s\"\n", src_fl);
+  return err;
+}
 
-  // Create new tree branch for this file
-  size_t branch_ix = ast->branch_count;
-  ast->branch_count++;
-  if (ast->branch_count == 1) {
-    ast->branches = malloc(sizeof(asm_tree_branch_t));
-  } else {
-    ast->branches =
-        realloc(ast->branches, sizeof(asm_tree_branch_t) * ast->branch_count);
+/// Stores the result of a symbol as its value, a literal which the
+/// directives and expressions using the symbol read like any other
+static void _store_const(asm_tree_t *ast, asm_symbol_t *symbol,
+                         _const_t result) {
+  char text[16];
+  int len;
+  switch (result.kind) {
+  case OPERAND_ADDRESS:
+    len = snprintf(text, sizeof(text), "$%.4x", result.value & 0xffff);
+    break;
+  case OPERAND_VALUE:
+    len = snprintf(text, sizeof(text), "$#%.4x", result.value & 0xffff);
+    break;
+  case OPERAND_CHAR:
+    result.value &= 0xff;
+    text[0] = TASM_CHAR_CHAR_CONT;
+    text[1] = result.value;
+    text[2] = TASM_CHAR_CHAR_CONT;
+    len = 3;
+    break;
+  default:
+    len = snprintf(text, sizeof(text), "%u", result.value);
+    break;
   }
 
-  ast->branches[branch_ix].exp_count = 0;
-  ast->branches[branch_ix].file = src_fl;
+  // Stores keeping the symbols copy the value, see _share_keep_tree
+  symbol->value.str = arena_strndup(&ast->arena, text, len);
+  symbol->value.len = len;
+  symbol->value.flags = TOK_COMPUTED;
+  symbol->kind = result.kind == OPERAND_NONE ? OPERAND_VALUE : result.kind;
+  symbol->operand = result.value & 0xffff;
+}
 
-  err_t err;
-  while ((read = getline(&line, &len, file)) != -1) {
-    linenum++;
-    err = asm_parse_line(ast, line, linenum);
-    if (err != TASM_OK)
-      if (_handle_err(err, src_fl, line, linenum) == 0)
-        goto parse_file_cleanup;
+/// Evaluates the value of a symbol which is a constant expression. The
+/// result replaces the value, so every use of the symbol only copies it,
+/// and so does a failure. If a symbol used by the value is not defined,
+/// missing is set and the value is evaluated again on the next use unless
+/// final is set.
+static err_t _eval_symbol(asm_tree_t *ast, asm_symbol_t *symbol,
+                          uint8_t final, size_t depth, uint8_t *missing) {
+  if (symbol->kind != OPERAND_EXPR)
+    return TASM_OK;
+  if (symbol->operand & CONST_FAILED)
+    return (err_t)(symbol->operand & ~CONST_FAILED);
+
+  // The symbol is used by its own value
+  if (symbol->operand == CONST_EVALUATING || depth >= CONST_MAX_DEPTH)
+    return TASM_INVALID_SYMBOL;
+
+  symbol->operand = CONST_EVALUATING;
+  asm_tok_t value = symbol->value;
+  _const_parser_t p = {.ast = ast,
+                       .pos = value.str,
+                       .end = value.str + value.len,
+                       .depth = depth,
+                       .final = final};
+
+  // A value naming another symbol takes it over whatever it holds
+  size_t name_len = 1;
+  while (name_len < value.len && _is_name_char(value.str[name_len]))
+    name_len++;
+
+  err_t err = TASM_OK;
+  asm_symbol_t *alias = NULL;
+  if (value.str[0] == TASM_CHAR_SYMBOL_USAGE_PREFIX && name_len > 1 &&
+      name_len == value.len) {
+    alias = _get_symbol(ast, intern_find(value.str + 1, value.len - 1));
+    p.missing = alias == NULL;
+    err = alias == NULL ? TASM_INVALID_SYMBOL
+                        : _eval_symbol(ast, alias, final, depth + 1,
+                                       &p.missing);
   }
 
-  size_t exp_count = ast->branches[branch_ix].exp_count;
-  for (size_t i = 0; i < exp_count; i++) {
-    if (ast->branches[branch_ix].asm_exp[i].type != EXP_DIRECTIVE)
-      continue;
-    if (ast->branches[branch_ix].asm_exp[i].directive != DIR_INCLUDE)
-      continue;
+  _const_t result;
+  if (alias == NULL && !p.missing) {
+    err = _const_binary(&p, 1, &result);
+    _const_skip(&p);
+    if (err == TASM_OK && p.pos != p.end)
+      err = TASM_INVALID_PARAMETER_FORMAT;
+  }
 
-    err = _do_dir_include(ast, ast->branches[branch_ix].asm_exp[i].parameters,
-                          ast->branches[branch_ix].asm_exp[i].parameter_count);
+  *missing |= p.missing;
+  if (err != TASM_OK) {
+    symbol->operand = p.missing && !final ? CONST_PENDING : CONST_FAILED | err;
+    return err;
+  }
 
-    if (err != TASM_OK)
-      break;
+  if (alias != NULL) {
+    uint16_t col = symbol->value.col;
+    symbol->value = alias->value;
+    symbol->value.col = col;
+    symbol->kind = alias->kind;
+    symbol->operand = alias->operand;
+  } else {
+    _store_const(ast, symbol, result);
   }
 
-parse_file_cleanup:
-  free(line);
-  fclose(file);
-  return err;
+  return TASM_OK;
 }
 
-err_t asm_resolve_labels(asm_tree_t *ast) {
-  err_t ret = TASM_OK;
+/// Evaluates every symbol whose value is a constant expression once all of
+/// them are known. Symbols are not modified by their uses afterwards.
+static void _eval_symbols(asm_tree_t *ast) {
+  for (size_t i = 0; i < ast->symbol_count; i++) {
+    uint8_t missing = 0;
+    _eval_symbol(ast, &ast->symbols[i], 1, 0, &missing);
+  }
+}
 
-  size_t offset = 0;
-  for (size_t b = 0; b < ast->branch_count; b++) {
-    asm_tree_branch_t *branch = &ast->branches[b];
+/// Describes a symbol whose value can not be evaluated
+static void _eval_detail(char *detail, size_t size, asm_symbol_t *symbol) {
+  snprintf(detail, size, "Value \"%.*s\" of symbol \"%.*s\" is invalid",
+           (int)symbol->value.len, symbol->value.str, (int)symbol->name.len,
+           symbol->name.str);
+}
 
-    for (size_t e = 0; e < branch->exp_count; e++) {
-      asm_exp_t *exp = &branch->asm_exp[e];
-      if (exp->type != EXP_LABEL) {
-        if (exp->type == EXP_DIRECTIVE) {
-          offset += _dir_exp_size(*exp);
-          continue;
-        }
+//-- Assembly Funcs --//
 
-        offset += _get_inst_size(exp->inst);
-        continue;
-      }
+/// A file to be parsed into a branch. Jobs form the include tree of the
+/// assembly, their branches are added to the tree in pre-order.
+typedef struct _parse_job_t {
+  pool_task_t task;
+  /// NULL if the include directive is missing its parameter
+  char *path;
+  /// Section the branch is parsed with, a guess if parsed in parallel
+  directive_t section;
+  asm_tree_branch_t branch;
+  /// Set once the branch is owned by the tree
+  uint8_t merged;
+  /// The include directive which created the job
+  uint32_t line;
+  asm_tok_t where;
+  size_t child_count;
+  struct _parse_job_t *children;
+  pool_t *pool;
+  const asm_opts_t *opts;
+  /// Source of the root file if it is not read through opts
+  const char *buf;
+  size_t buf_size;
+  /// Store of parsed includes, only used if the job is an include
+  asm_share_t *share;
+  uint8_t include;
+  /// Entry of the store the branch was cloned from
+  asm_share_entry_t *entry;
+  /// Job of the file with the include directive, NULL for the root file
+  struct _parse_job_t *parent;
+  /// Lookup of included files for the whole run
+  search_t *search;
+  /// Where the file was found and its interned canonical path
+  const char *file;
+  uint32_t id;
+  /// The file was not parsed since it includes itself or, in include-once
+  /// mode, another job claimed it
+  uint8_t cycle;
+  uint8_t skipped;
+} _parse_job_t;
+
+static void _init_branch(asm_tree_branch_t *branch, const char *src_fl,
+                         directive_t section) {
+  arena_init(&branch->arena);
+  branch->exp_count = 0;
+  branch->exp_capacity = 0;
+  branch->asm_exp = NULL;
+  branch->file = intern_str(intern(src_fl, strlen(src_fl)), NULL);
+  branch->src = NULL;
+  branch->src_size = 0;
+  branch->borrowed = 0;
+  branch->operand_count = 0;
+  branch->operand_capacity = 0;
+  branch->operand_kinds = NULL;
+  branch->operand_values = NULL;
+  branch->operands_borrowed = 0;
+  branch->symbol_count = 0;
+  branch->symbol_capacity = 0;
+  branch->symbols = NULL;
+  branch->entry_section = section;
+  branch->curr_section = section;
+  branch->section_seen = 0;
+  branch->section_dependent = 0;
+  branch->line_count = 0;
+  branch->token_count = 0;
+  branch->lookup_count = 0;
+  branch->cached = 0;
+  branch->err = TASM_OK;
+  branch->err_errno = 0;
+  branch->err_line = 0;
+}
 
-      exp->lbl_position = offset;
+/// Parses the mapped source of a branch line by line
+static err_t _parse_src(asm_tree_branch_t *branch) {
+  const char *src = branch->src;
+  size_t src_size = branch->src_size;
+  uint32_t linenum = 0;
+  size_t pos = 0;
+  while (pos < src_size) {
+    size_t len = lexer_line_len(src + pos, src_size - pos);
+    linenum++;
+    branch->line_count++;
+    err_t err = asm_parse_line(branch, src + pos, len, linenum);
+    if (err != TASM_OK) {
+      branch->err = err;
+      branch->err_line = linenum;
+      branch->err_where = (asm_tok_t){.str = src + pos, .len = len, .col = 1};
+      return err;
     }
+
+    pos += len + 1;
   }
 
-  return ret;
+  return TASM_OK;
 }
 
-err_t asm_replace_symbols(asm_tree_t *ast) {
-  err_t ret = TASM_OK;
+/// Provides the source of a branch: buf if it is not NULL, otherwise the
+/// file read through opts or mapped from disk
+static uint8_t _load_src(const asm_opts_t *opts, asm_tree_branch_t *branch,
+                         const char *buf, size_t buf_size) {
+  if (buf != NULL) {
+    branch->src = buf;
+    branch->src_size = buf_size;
+    branch->borrowed = 1;
+    return 1;
+  }
 
-  asm_tree_branch_t *branch;
-  asm_exp_t *exp;
-  for (size_t b = 0; b < ast->branch_count; b++) {
-    branch = &ast->branches[b];
+  if (opts != NULL && opts->read != NULL) {
+    branch->borrowed = 1;
+    return opts->read(opts->user, branch->file, &branch->src,
+                      &branch->src_size);
+  }
 
-    for (size_t e = 0; e < branch->exp_count; e++) {
-      exp = &branch->asm_exp[e];
+  return lexer_map_file(branch->file, &branch->src, &branch->src_size);
+}
 
-      for (size_t p = 0; p < exp->parameter_count; p++) {
-        if (exp->parameters[p][0] != TASM_CHAR_SYMBOL_USAGE_PREFIX)
-          continue;
+/// Like asm_parse_branch, but the source comes from _load_src. If opts has
+/// a cache directory, the result is taken from the cache if it holds an
+/// entry for the source and fresh results are stored in it.
+static err_t _parse_branch(const asm_opts_t *opts, const char *src_fl,
+                           const char *buf, size_t buf_size,
+                           directive_t section, asm_tree_branch_t *branch) {
+  _init_branch(branch, src_fl, section);
 
-        char *new_param = _get_symbol(ast, exp->parameters[p] + 1);
+  errno = 0;
+  if (!_load_src(opts, branch, buf, buf_size)) {
+    branch->src = NULL;
+    branch->src_size = 0;
+    branch->err = TASM_IO_ERROR;
+    branch->err_errno = errno;
+    return branch->err;
+  }
 
-        if (new_param == NULL) {
-          ret = TASM_INVALID_SYMBOL;
-          goto asm_replace_symbols_exit;
-        }
+  const char *cache_dir = opts != NULL ? opts->cache_dir : NULL;
+  if (cache_dir == NULL)
+    return _parse_src(branch);
 
-        free(exp->parameters[p]);
-        exp->parameters[p] = new_param;
-      }
-    }
+  if (cache_load(cache_dir, branch)) {
+    branch->cached = 1;
+    log_dbg("Loaded \"%s\" from the cache\n", src_fl);
+    return TASM_OK;
   }
 
-asm_replace_symbols_exit:
-  if (ret != TASM_OK)
-    _handle_err(ret, branch->file, "?", exp->line);
-  return ret;
-}
+  err_t err = _parse_src(branch);
+  if (err == TASM_OK)
+    cache_store(cache_dir, branch);
 
-err_t asm_translate_parameters(asm_tree_t *ast, char **params, size_t count,
-                               uint8_t *dest) {
+  return err;
+}
+
+static uint8_t _is_symbols(directive_t section) {
+  return section == DIR_SYMBOLS;
+}
+
+/// Copies a shared branch into dest. The expressions are copied since the
+/// tree modifies them, tokens keep pointing into the shared source and
+/// strings. Symbols are never modified once parsed, so they are shared, and
+/// so are the operands until a symbol is replaced.
+static void _clone_branch(asm_tree_branch_t *dest, asm_tree_branch_t *src,
+                          const char *src_fl) {
+  _init_branch(dest, src_fl, src->entry_section);
+  dest->src = src->src;
+  dest->src_size = src->src_size;
+  dest->borrowed = 1;
+  dest->curr_section = src->curr_section;
+  dest->section_seen = src->section_seen;
+  dest->section_dependent = src->section_dependent;
+  dest->err = src->err;
+  dest->err_errno = src->err_errno;
+  dest->err_line = src->err_line;
+  dest->err_where = src->err_where;
+
+  size_t param_count = 0;
+  for (size_t i = 0; i < src->exp_count; i++)
+    param_count += src->asm_exp[i].parameter_count;
+
+  asm_tok_t *params =
+      arena_alloc(&dest->arena, sizeof(asm_tok_t) * param_count);
+  dest->exp_count = src->exp_count;
+  dest->exp_capacity = src->exp_count;
+  dest->asm_exp = arena_alloc(&dest->arena, sizeof(asm_exp_t) * src->exp_count);
+  for (size_t i = 0; i < src->exp_count; i++) {
+    asm_exp_t *exp = &dest->asm_exp[i];
+    *exp = src->asm_exp[i];
+    if (exp->parameter_count == 0)
+      continue;
+
+    memcpy(params, exp->parameters, sizeof(asm_tok_t) * exp->parameter_count);
+    exp->parameters = params;
+    params += exp->parameter_count;
+  }
+
+  dest->operand_count = src->operand_count;
+  dest->operand_capacity = src->operand_count;
+  dest->operand_kinds = src->operand_kinds;
+  dest->operand_values = src->operand_values;
+  dest->operands_borrowed = 1;
+
+  dest->symbol_count = src->symbol_count;
+  dest->symbol_capacity = src->symbol_count;
+  dest->symbols = src->symbols;
+}
+
+/// Appends ptr to a growable array of pointers
+static void _push_ptr(void ***array, size_t *count, size_t *capacity,
+                      void *ptr) {
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 8;
+    *array = realloc(*array, sizeof(void *) * *capacity);
+  }
+
+  (*array)[(*count)++] = ptr;
+}
+
+/// Key of a file in a store: its canonical path, prefixed with the kind of
+/// section it is parsed in. key_len includes the terminator.
+static char *_share_key(uint32_t id, directive_t section, size_t *key_len) {
+  const char *path = intern_str(id, key_len);
+  (*key_len)++;
+  char *key = malloc(*key_len + 1);
+  key[0] = _is_symbols(section) ? 's' : 't';
+  memcpy(key + 1, path, *key_len);
+  return key;
+}
+
+static uint64_t _mtime_ns(const struct stat *st) {
+  return (uint64_t)st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec;
+}
+
+/// Reads the file at path into entry->data and records its state. Returns
+/// 0 with errno set on failure.
+static uint8_t _share_read(asm_share_entry_t *entry, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return 0;
+  }
+
+  // One spare byte, so an empty file still gets a buffer
+  char *data = malloc(st.st_size + 1);
+  size_t size = 0;
+  while (size < (size_t)st.st_size) {
+    ssize_t n = read(fd, data + size, st.st_size - size);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      int read_errno = errno;
+      free(data);
+      close(fd);
+      errno = read_errno;
+      return 0;
+    }
+    if (n == 0)
+      break;
+    size += n;
+  }
+  close(fd);
+
+  entry->data = data;
+  entry->ino = st.st_ino;
+  entry->size = size;
+  entry->mtime_ns = _mtime_ns(&st);
+  entry->hash = cache_hash(0, data, size);
+  return 1;
+}
+
+/// State of the file of an entry, copied under the lock of the store so
+/// the file can be checked without holding it
+typedef struct _share_stamp_t {
+  uint8_t readable;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime_ns;
+  uint64_t hash;
+} _share_stamp_t;
+
+/// Copies the state of entry, the lock of the store has to be held
+static _share_stamp_t _share_stamp(asm_share_entry_t *entry) {
+  return (_share_stamp_t){.readable = entry->branch.err != TASM_IO_ERROR,
+                          .ino = entry->ino,
+                          .size = entry->size,
+                          .mtime_ns = entry->mtime_ns,
+                          .hash = entry->hash};
+}
+
+/// Updates entry to a stamp which was found to match its file, the lock of
+/// the store has to be held
+static void _share_touch(asm_share_entry_t *entry, _share_stamp_t *stamp) {
+  entry->ino = stamp->ino;
+  entry->mtime_ns = stamp->mtime_ns;
+}
+
+/// Checks whether the file of an entry of a persistent store still matches
+/// its stamp, without the lock of the store. If the file was only touched
+/// the stamp is updated, see _share_touch. If it changed and could be read,
+/// fresh holds its new contents.
+static uint8_t _share_check(_share_stamp_t *stamp, const char *path,
+                            asm_share_entry_t *fresh) {
+  struct stat st;
+  if (!stamp->readable || stat(path, &st) == -1)
+    return 0;
+
+  if (st.st_ino == stamp->ino && (uint64_t)st.st_size == stamp->size &&
+      _mtime_ns(&st) == stamp->mtime_ns)
+    return 1;
+
+  if (!_share_read(fresh, path))
+    return 0;
+
+  if (fresh->size != stamp->size || fresh->hash != stamp->hash)
+    return 0;
+
+  stamp->ino = fresh->ino;
+  stamp->mtime_ns = fresh->mtime_ns;
+  free(fresh->data);
+  fresh->data = NULL;
+  return 1;
+}
+
+static void _free_share_entry(asm_share_entry_t *entry) {
+  asm_free_branch(&entry->branch);
+  free(entry->data);
+  free(entry->key);
+  free(entry);
+}
+
+/// Parses src_fl, whose canonical path is id, through the store. The first
+/// tree to request a file parses it while the others wait for the result.
+/// Persistent stores parse the file again once it changes, the outdated
+/// entry is retired. Returns the entry the branch was cloned from.
+static asm_share_entry_t *_share_parse(asm_share_t *share, const char *src_fl,
+                                       uint32_t id, directive_t section,
+                                       asm_tree_branch_t *branch) {
+  size_t key_len;
+  char *key = _share_key(id, section, &key_len);
+
+  asm_share_entry_t fresh = {0};
+  pthread_mutex_lock(&share->lock);
+  size_t ix;
+  asm_share_entry_t *entry = NULL;
+  while (entry == NULL && strmap_get(&share->map, key, key_len, &ix)) {
+    asm_share_entry_t *found = share->entries[ix];
+    while (!found->ready)
+      pthread_cond_wait(&share->ready_cond, &share->lock);
+
+    // The file is checked without the lock, entries are only freed when
+    // the store is swept
+    uint8_t same = !share->persistent;
+    if (!same) {
+      _share_stamp_t stamp = _share_stamp(found);
+      pthread_mutex_unlock(&share->lock);
+      free(fresh.data);
+      fresh.data = NULL;
+      same = _share_check(&stamp, src_fl, &fresh);
+      pthread_mutex_lock(&share->lock);
+
+      // Another job parsed the file again meanwhile, its entry is checked
+      if (share->entries[ix] != found)
+        continue;
+      if (same)
+        _share_touch(found, &stamp);
+    }
+
+    if (same) {
+      free(key);
+      share->hits++;
+      pthread_mutex_unlock(&share->lock);
+      _clone_branch(branch, &found->branch, src_fl);
+      return found;
+    }
+
+    // The map keeps pointing to the key, so it moves to the new entry
+    found->retired = 1;
+    _push_ptr((void ***)&share->retired, &share->retired_count,
+              &share->retired_capacity, found);
+    share->entries[ix] = calloc(1, sizeof(asm_share_entry_t));
+    share->entries[ix]->key = found->key;
+    found->key = NULL;
+    entry = share->entries[ix];
+    share->refreshes++;
+  }
+
+  if (entry != NULL) {
+    free(key);
+  } else {
+    entry = calloc(1, sizeof(asm_share_entry_t));
+    entry->key = key;
+    strmap_put(&share->map, key, key_len, share->entry_count, NULL);
+    _push_ptr((void ***)&share->entries, &share->entry_count,
+              &share->entry_capacity, entry);
+  }
+  pthread_mutex_unlock(&share->lock);
+
+  if (!share->persistent) {
+    _parse_branch(share->opts, src_fl, NULL, 0, section, &entry->branch);
+  } else if (fresh.data != NULL || _share_read(&fresh, src_fl)) {
+    entry->data = fresh.data;
+    entry->ino = fresh.ino;
+    entry->size = fresh.size;
+    entry->mtime_ns = fresh.mtime_ns;
+    entry->hash = fresh.hash;
+    _parse_branch(share->opts, src_fl, entry->data, entry->size, section,
+                  &entry->branch);
+  } else {
+    _init_branch(&entry->branch, src_fl, section);
+    entry->branch.err = TASM_IO_ERROR;
+    entry->branch.err_errno = errno;
+  }
+
+  pthread_mutex_lock(&share->lock);
+  entry->ready = 1;
+  pthread_cond_broadcast(&share->ready_cond);
+  pthread_mutex_unlock(&share->lock);
+
+  _clone_branch(branch, &entry->branch, src_fl);
+  return entry;
+}
+
+/// Parses the file of a job, includes are taken from the store if there is
+/// one. Persistent stores hold the root files as well.
+static err_t _parse_job_branch(_parse_job_t *job, directive_t section,
+                               asm_tree_branch_t *branch) {
+  if (job->share == NULL || job->buf != NULL ||
+      (!job->include && !job->share->persistent))
+    return _parse_branch(job->opts, job->file, job->buf, job->buf_size,
+                         section, branch);
+
+  job->entry =
+      _share_parse(job->share, job->file, job->id, section, branch);
+  return branch->err;
+}
+
+static void _run_parse_job(void *arg);
+
+/// Parses the file of a job and creates jobs for its includes. In parallel
+/// mode the include jobs are queued right away.
+static void _parse_job_file(_parse_job_t *job) {
+  if (_parse_job_branch(job, job->section, &job->branch) != TASM_OK)
+    return;
+
+  asm_tree_branch_t *branch = &job->branch;
+  for (size_t i = 0; i < branch->exp_count; i++) {
+    if (branch->asm_exp[i].type == EXP_DIRECTIVE &&
+        branch->asm_exp[i].directive == DIR_INCLUDE)
+      job->child_count++;
+  }
+
+  if (job->child_count == 0)
+    return;
+
+  // The include is parsed with the section this file ends in, which is
+  // right unless an earlier include changes it
+  directive_t section =
+      branch->section_seen ? branch->curr_section : job->section;
+
+  job->children = calloc(job->child_count, sizeof(_parse_job_t));
+  size_t c = 0;
+  for (size_t i = 0; i < branch->exp_count; i++) {
+    asm_exp_t *exp = &branch->asm_exp[i];
+    if (exp->type != EXP_DIRECTIVE || exp->directive != DIR_INCLUDE)
+      continue;
+
+    _parse_job_t *child = &job->children[c++];
+    child->section = section;
+    child->pool = job->pool;
+    child->opts = job->opts;
+    child->share = job->share;
+    child->include = 1;
+    child->parent = job;
+    child->search = job->search;
+    child->line = exp->line;
+    child->where = _unknown_tok(exp->col);
+    if (exp->parameter_count < 1)
+      continue;
+
+    child->path = strndup(exp->parameters[0].str, exp->parameters[0].len);
+    if (job->pool != NULL)
+      pool_submit(job->pool, &child->task, _run_parse_job, child);
+  }
+}
+
+/// Returns the closest job including the file of job, NULL if the file
+/// does not include itself
+static _parse_job_t *_include_cycle(_parse_job_t *job) {
+  for (_parse_job_t *p = job->parent; p != NULL; p = p->parent) {
+    if (p->id == job->id)
+      return p;
+  }
+
+  return NULL;
+}
+
+/// Looks up the file of a job and parses it. A file including itself is
+/// not parsed again, neither is a file claimed by another job in
+/// include-once mode.
+static void _run_parse_job(void *arg) {
+  _parse_job_t *job = arg;
+  if (job->include) {
+    const search_file_t *file =
+        search_find(job->search, job->path, strlen(job->path));
+    job->file = file->path;
+    job->id = file->id;
+  }
+
+  if (job->opts->include_once)
+    job->skipped = !search_claim(job->search, job->id);
+  else
+    job->cycle = _include_cycle(job) != NULL;
+
+  if (job->skipped || job->cycle) {
+    _init_branch(&job->branch, job->file, job->section);
+    return;
+  }
+
+  _parse_job_file(job);
+}
+
+/// Waits for a job to finish, serial jobs are run right away
+static void _wait_parse_job(_parse_job_t *job) {
+  if (job->pool != NULL) {
+    pool_wait(job->pool, &job->task);
+    return;
+  }
+
+  if (!job->task.done) {
+    _run_parse_job(job);
+    job->task.done = 1;
+  }
+}
+
+/// Waits for the job and all of its includes, then releases everything
+/// which has not been added to the tree
+static void _free_parse_job(_parse_job_t *job) {
+  if (job->pool != NULL && job->path != NULL)
+    pool_wait(job->pool, &job->task);
+
+  for (size_t i = 0; i < job->child_count; i++)
+    _free_parse_job(&job->children[i]);
+
+  if (job->task.done && !job->merged)
+    asm_free_branch(&job->branch);
+
+  free(job->children);
+  free(job->path);
+}
+
+static err_t _merge_symbols(asm_tree_t *ast, asm_tree_branch_t *branch) {
+  for (size_t i = 0; i < branch->symbol_count; i++) {
+    asm_symbol_t *symbol = &branch->symbols[i];
+
+    size_t prev_ix;
+    if (!idmap_put(&ast->symbol_map, symbol->id, ast->symbol_count,
+                   &prev_ix)) {
+      char detail[256];
+      snprintf(detail, sizeof(detail),
+               "Symbol \"%.*s\" is already defined as \"%.*s\"",
+               (int)symbol->name.len, symbol->name.str,
+               (int)ast->symbols[prev_ix].value.len,
+               ast->symbols[prev_ix].value.str);
+      _handle_err(ast, TASM_DUPLICATE_SYMBOL, branch->file, symbol->line,
+                  symbol->name, detail);
+      return TASM_DUPLICATE_SYMBOL;
+    }
+
+    arena_grow_array(&ast->arena, (void **)&ast->symbols, sizeof(asm_symbol_t),
+                     ast->symbol_count, &ast->symbol_capacity);
+    ast->symbols[ast->symbol_count++] = *symbol;
+  }
+
+  return TASM_OK;
+}
+
+/// Reports the include directive of a job whose file includes itself
+static err_t _report_cycle(asm_tree_t *ast, _parse_job_t *job) {
+  _parse_job_t *first = _include_cycle(job);
+  size_t count = 1;
+  for (_parse_job_t *p = job->parent; p != first; p = p->parent)
+    count++;
+
+  // The chain of includes from the first occurrence of the file to the
+  // directive including it again
+  const char **files = malloc(sizeof(char *) * (count + 1));
+  files[count] = job->file;
+  _parse_job_t *p = job->parent;
+  for (size_t i = count; i > 0; i--, p = p->parent)
+    files[i - 1] = p->file;
+
+  char detail[256];
+  _cycle_detail(detail, sizeof(detail), files, count + 1);
+  free(files);
+
+  _handle_err(ast, TASM_INCLUDE_CYCLE, job->parent->file, job->line,
+              job->where, detail);
+  return TASM_INCLUDE_CYCLE;
+}
+
+/// Adds the branch of a job and then its includes to the tree, in the same
+/// order and with the same diagnostics as parsing everything serially.
+/// merged holds the files added so far in include-once mode.
+static err_t _merge_parse_job(asm_tree_t *ast, _parse_job_t *job,
+                              idmap_t *merged) {
+  _wait_parse_job(job);
+  if (job->cycle)
+    return _report_cycle(ast, job);
+
+  // The first include of a file in tree order is kept, in parallel mode it
+  // may not be the one which claimed the file
+  if (ast->opts.include_once) {
+    if (!idmap_put(merged, job->id, 0, NULL))
+      return TASM_OK;
+
+    if (job->skipped) {
+      asm_free_branch(&job->branch);
+      job->skipped = 0;
+      _parse_job_file(job);
+    }
+  }
+
+  asm_tree_branch_t *branch = &job->branch;
+  if (branch->err == TASM_IO_ERROR) {
+    _report_open_err(ast, branch->file, branch->err_errno);
+    return branch->err;
+  }
+
+  log_inf("Parsing \"%s\"\n", branch->file);
+
+  // The guessed section was wrong and the file has lines outside of any
+  // section, those have to be parsed again
+  if (branch->section_dependent &&
+      _is_symbols(branch->entry_section) != _is_symbols(ast->curr_section)) {
+    asm_free_branch(branch);
+    _parse_job_branch(job, ast->curr_section, branch);
+    ast->stats.reparsed_branches++;
+  }
+
+  ast->stats.branches++;
+  ast->stats.cached_branches += branch->cached;
+  ast->stats.bytes_read += branch->src_size;
+  ast->stats.lines += branch->line_count;
+  ast->stats.tokens += branch->token_count;
+  ast->stats.keyword_lookups += branch->lookup_count;
+
+  arena_grow_array(&ast->arena, (void **)&ast->branches,
+                   sizeof(asm_tree_branch_t), ast->branch_count,
+                   &ast->branch_capacity);
+  ast->branches[ast->branch_count++] = *branch;
+  job->merged = 1;
+
+  err_t err = _merge_symbols(ast, branch);
+  if (err != TASM_OK)
+    return err;
+
+  if (branch->err != TASM_OK) {
+    _handle_err(ast, branch->err, branch->file, branch->err_line,
+                branch->err_where, NULL);
+    return branch->err;
+  }
+
+  if (branch->section_seen)
+    ast->curr_section = branch->curr_section;
+
+  for (size_t i = 0; i < job->child_count; i++) {
+    _parse_job_t *child = &job->children[i];
+    if (child->path == NULL) {
+      err = TASM_DIRECTIVE_MISSING_PARAMETER;
+      _handle_err(ast, err, branch->file, child->line, child->where, NULL);
+      return err;
+    }
+
+    err = _merge_parse_job(ast, child, merged);
+    if (err != TASM_OK)
+      return err;
+  }
+
+  return TASM_OK;
+}
+
+/// Key of the tree of a root file. Includes are looked up relative to the
+/// working directory and in the search directories, and which of them are
+/// kept depends on include-once mode, so all of these are part of the key.
+static char *_share_tree_key(char *src_fl, const asm_opts_t *opts,
+                             size_t *key_len) {
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    return NULL;
+
+  const char *dirs = opts->search_dirs != NULL ? opts->search_dirs : "";
+  size_t cwd_len = strlen(cwd) + 1;
+  size_t src_len = strlen(src_fl) + 1;
+  *key_len = cwd_len + src_len + strlen(dirs) + 2;
+  char *key = malloc(*key_len);
+  memcpy(key, cwd, cwd_len);
+  memcpy(key + cwd_len, src_fl, src_len);
+  key[cwd_len + src_len] = opts->include_once ? 'o' : 'a';
+  strcpy(key + cwd_len + src_len + 1, dirs);
+  return key;
+}
+
+static void _free_share_tree(asm_share_tree_t *tree) {
+  free(tree->key);
+  free(tree->entries);
+  free(tree->files);
+  free(tree->symbols);
+  idmap_free(&tree->symbol_map);
+  arena_free(&tree->values);
+  free(tree);
+}
+
+/// Builds the tree from the one kept for key if none of its files changed.
+/// Returns 0 if the tree has to be parsed.
+static uint8_t _share_reuse_tree(asm_share_t *share, const char *key,
+                                 size_t key_len, asm_tree_t *ast) {
+  pthread_mutex_lock(&share->lock);
+  size_t ix;
+  if (!strmap_get(&share->tree_map, key, key_len, &ix)) {
+    pthread_mutex_unlock(&share->lock);
+    return 0;
+  }
+
+  // Trees without entries were outdated when the store was swept. The
+  // files are checked without the lock, the tree and its entries are only
+  // freed when the store is swept.
+  asm_share_tree_t *tree = share->trees[ix];
+  uint8_t valid = tree->entry_count > 0;
+  _share_stamp_t *stamps = malloc(sizeof(_share_stamp_t) * tree->entry_count);
+  for (size_t i = 0; i < tree->entry_count; i++)
+    stamps[i] = _share_stamp(tree->entries[i]);
+  pthread_mutex_unlock(&share->lock);
+
+  for (size_t i = 0; i < tree->entry_count && valid; i++) {
+    asm_share_entry_t fresh = {0};
+    valid = _share_check(&stamps[i], tree->files[i], &fresh);
+    free(fresh.data);
+  }
+
+  pthread_mutex_lock(&share->lock);
+  for (size_t i = 0; i < tree->entry_count && valid; i++) {
+    valid = !tree->entries[i]->retired;
+    if (valid)
+      _share_touch(tree->entries[i], &stamps[i]);
+  }
+  free(stamps);
+
+  if (!valid) {
+    size_t symbol_count = tree->symbol_count;
+    pthread_mutex_unlock(&share->lock);
+
+    // The tree most likely ends up with about as many symbols again
+    if (symbol_count > ast->symbol_capacity) {
+      ast->symbols = arena_realloc(&ast->arena, ast->symbols,
+                                   sizeof(asm_symbol_t) * ast->symbol_capacity,
+                                   sizeof(asm_symbol_t) * symbol_count);
+      ast->symbol_capacity = symbol_count;
+    }
+    return 0;
+  }
+  share->hits += tree->entry_count;
+  pthread_mutex_unlock(&share->lock);
+
+  // Retired trees and entries stay around until the store is swept
+  for (size_t i = 0; i < tree->entry_count; i++) {
+    asm_tree_branch_t *src = &tree->entries[i]->branch;
+    log_inf("Parsing \"%s\"\n", tree->files[i]);
+    ast->stats.branches++;
+    ast->stats.bytes_read += src->src_size;
+
+    arena_grow_array(&ast->arena, (void **)&ast->branches,
+                     sizeof(asm_tree_branch_t), ast->branch_count,
+                     &ast->branch_capacity);
+    _clone_branch(&ast->branches[ast->branch_count++], src, tree->files[i]);
+  }
+
+  ast->curr_section = tree->curr_section;
+  ast->symbol_count = tree->symbol_count;
+  ast->symbol_capacity = tree->symbol_count;
+  ast->symbols = tree->symbols;
+  ast->symbol_map = tree->symbol_map;
+  ast->symbols_borrowed = 1;
+  return 1;
+}
+
+/// Writes the entries of a job and its includes to entries in tree order,
+/// jobs left out in include-once mode are skipped. Returns 0 if a branch
+/// was not taken from the store.
+static uint8_t _collect_entries(_parse_job_t *job, asm_share_entry_t **entries,
+                                size_t *count) {
+  if (!job->merged)
+    return 1;
+  if (job->entry == NULL)
+    return 0;
+
+  entries[(*count)++] = job->entry;
+  for (size_t i = 0; i < job->child_count; i++) {
+    if (!_collect_entries(&job->children[i], entries, count))
+      return 0;
+  }
+
+  return 1;
+}
+
+/// Keeps the symbols of a freshly parsed tree under key, which is taken
+/// over. The tree borrows them from the store afterwards.
+static void _share_keep_tree(asm_share_t *share, char *key, size_t key_len,
+                             _parse_job_t *root, asm_tree_t *ast) {
+  asm_share_tree_t *tree = calloc(1, sizeof(asm_share_tree_t));
+  arena_init(&tree->values);
+  tree->key = key;
+  tree->key_len = key_len;
+  tree->entries = malloc(sizeof(asm_share_entry_t *) * ast->branch_count);
+  if (!_collect_entries(root, tree->entries, &tree->entry_count) ||
+      tree->entry_count != ast->branch_count) {
+    tree->entry_count = 0;
+    _free_share_tree(tree);
+    return;
+  }
+
+  tree->files = malloc(sizeof(char *) * tree->entry_count);
+  for (size_t i = 0; i < tree->entry_count; i++)
+    tree->files[i] = ast->branches[i].file;
+
+  tree->curr_section = ast->curr_section;
+  tree->symbol_count = ast->symbol_count;
+  tree->symbols = malloc(sizeof(asm_symbol_t) * ast->symbol_count);
+  memcpy(tree->symbols, ast->symbols, sizeof(asm_symbol_t) * ast->symbol_count);
+  for (size_t i = 0; i < tree->symbol_count; i++) {
+    asm_tok_t *value = &tree->symbols[i].value;
+    if (value->flags & TOK_COMPUTED)
+      value->str = arena_strndup(&tree->values, value->str, value->len);
+  }
+  tree->symbol_map = ast->symbol_map;
+  ast->symbols = tree->symbols;
+  ast->symbols_borrowed = 1;
+
+  pthread_mutex_lock(&share->lock);
+  size_t ix;
+  if (strmap_get(&share->tree_map, key, key_len, &ix)) {
+    // The map keeps pointing to the old key
+    asm_share_tree_t *old = share->trees[ix];
+    tree->key = old->key;
+    old->key = key;
+    share->trees[ix] = tree;
+    _push_ptr((void ***)&share->retired_trees, &share->retired_tree_count,
+              &share->retired_tree_capacity, old);
+  } else {
+    strmap_put(&share->tree_map, key, key_len, share->tree_count, NULL);
+    _push_ptr((void ***)&share->trees, &share->tree_count,
+              &share->tree_capacity, tree);
+  }
+  pthread_mutex_unlock(&share->lock);
+}
+
+void asm_init_opts(asm_opts_t *opts) {
+  opts->jobs = 1;
+  opts->cache_dir = NULL;
+  opts->stats = 0;
+  opts->read = NULL;
+  opts->diag = NULL;
+  opts->user = NULL;
+  opts->stream = 0;
+  opts->search_dirs = NULL;
+  opts->include_once = 0;
+  opts->optimize = 0;
+  opts->cycles = 0;
+  opts->run = 0;
+}
+
+void asm_init_tree(asm_tree_t *ast) {
+  arena_init(&ast->arena);
+  asm_init_opts(&ast->opts);
+  ast->pool = NULL;
+  ast->share = NULL;
+  ast->run_share = NULL;
+  ast->curr_section = DIR_INVALID;
+  ast->branch_count = 0;
+  ast->branch_capacity = 0;
+  ast->branches = NULL;
+  ast->symbol_count = 0;
+  ast->symbol_capacity = 0;
+  ast->symbols = NULL;
+  idmap_init(&ast->symbol_map);
+  ast->symbols_borrowed = 0;
+  idmap_init(&ast->label_map);
+  ast->size = 0;
+  memset(&ast->stats, 0, sizeof(asm_stats_t));
+}
+
+void asm_free_tree(asm_tree_t *ast) {
+  for (size_t i = 0; i < ast->branch_count; i++)
+    asm_free_branch(&ast->branches[i]);
+
+  if (ast->pool != NULL) {
+    pool_destroy(ast->pool);
+    free(ast->pool);
+  }
+
+  // The branches are gone, nothing borrows from the store anymore
+  if (ast->run_share != NULL) {
+    asm_share_free(ast->run_share);
+    free(ast->run_share);
+  }
+
+  arena_free(&ast->arena);
+  if (!ast->symbols_borrowed)
+    idmap_free(&ast->symbol_map);
+  idmap_free(&ast->label_map);
+  asm_init_tree(ast);
+}
+
+void asm_free_branch(asm_tree_branch_t *branch) {
+  if (!branch->borrowed)
+    lexer_unmap_file(branch->src, branch->src_size);
+  arena_free(&branch->arena);
+  branch->src = NULL;
+}
+
+err_t asm_parse_symbol(asm_tree_branch_t *branch, asm_tok_t name,
+                       size_t word_count, asm_tok_t *words, uint32_t line) {
+  if (word_count == 0 || words == NULL) {
+    log_wrn("internal: asm_parse_symbol was passed one or more NULL-values\n");
+    return TASM_OK;
+  }
+
+  arena_grow_array(&branch->arena, (void **)&branch->symbols,
+                   sizeof(asm_symbol_t), branch->symbol_count,
+                   &branch->symbol_capacity);
+
+  // A multi-word value is the source text spanning all words. Only string
+  // literals, whose quotes must not end up in the value, force a copy.
+  asm_tok_t value = words[0];
+  uint8_t has_str = 0;
+  for (size_t i = 0; i < word_count; i++)
+    has_str |= words[i].flags & TOK_STRING;
+
+  if (word_count > 1 && !has_str) {
+    value.len = words[word_count - 1].str + words[word_count - 1].len -
+                words[0].str;
+  } else if (word_count > 1) {
+    size_t len = word_count - 1;
+    for (size_t i = 0; i < word_count; i++)
+      len += words[i].len;
+
+    char *buf = arena_alloc(&branch->arena, len);
+    size_t offs = 0;
+    for (size_t i = 0; i < word_count; i++) {
+      memcpy(buf + offs, words[i].str, words[i].len);
+      offs += words[i].len;
+      if (offs < len)
+        buf[offs++] = ' ';
+    }
+
+    value.str = buf;
+    value.len = len;
+  }
+
+  asm_symbol_t *symbol = &branch->symbols[branch->symbol_count++];
+  symbol->name = name;
+  symbol->value = value;
+  symbol->line = line;
+  symbol->id = intern(name.str, name.len);
+  _decode_operand(value, &symbol->kind, &symbol->operand);
+  if (!has_str && _is_const_exp(value)) {
+    symbol->kind = OPERAND_EXPR;
+    symbol->operand = CONST_PENDING;
+  }
+
+  return TASM_OK;
+}
+
+err_t asm_parse_exp(asm_tree_branch_t *branch, asm_tok_t keyword,
+                    size_t param_count, asm_tok_t *params, uint32_t line) {
+  err_t ret = TASM_OK;
+
+  if (keyword.str[0] != TASM_CHAR_DIRECTIVE_PREFIX) {
+    if (!branch->section_seen)
+      branch->section_dependent = 1;
+
+    if (branch->curr_section == DIR_SYMBOLS)
+      return asm_parse_symbol(branch, keyword, param_count, params, line);
+  }
+
+  arena_grow_array(&branch->arena, (void **)&branch->asm_exp,
+                   sizeof(asm_exp_t), branch->exp_count,
+                   &branch->exp_capacity);
+
+  asm_exp_t *exp = &branch->asm_exp[branch->exp_count];
+  exp->line = line;
+  exp->col = keyword.col;
+  exp->parameter_count = param_count;
+  exp->parameters = NULL;
+  if (param_count > 0) {
+    exp->parameters =
+        arena_alloc(&branch->arena, sizeof(asm_tok_t) * param_count);
+    memcpy(exp->parameters, params, sizeof(asm_tok_t) * param_count);
+  }
+
+  exp->type = EXP_INSTRUCTION;
+  exp->inst = INST_INVALID;
+  exp->directive = DIR_INVALID;
+  exp->position = 0;
+  if (keyword.str[0] == TASM_CHAR_DIRECTIVE_PREFIX) {
+    exp->type = EXP_DIRECTIVE;
+    exp->directive = get_dir(keyword.str + 1, keyword.len - 1);
+    branch->lookup_count++;
+
+    switch (exp->directive) {
+    case DIR_SYMBOLS:
+    case DIR_TEXT:
+      branch->curr_section = exp->directive;
+      branch->section_seen = 1;
+      break;
+    default:
+      break;
+    }
+  } else if (keyword.str[keyword.len - 1] == TASM_CHAR_LABEL_POSTFIX) {
+    exp->type = EXP_LABEL;
+    exp->parameter_count = 1;
+    exp->parameters = arena_alloc(&branch->arena, sizeof(asm_tok_t));
+    exp->parameters[0] = keyword;
+    exp->parameters[0].len--;
+  } else {
+    exp->inst = get_inst(keyword.str, keyword.len);
+    branch->lookup_count++;
+  }
+
+  exp->operand = branch->operand_count;
+  if (exp->type == EXP_INSTRUCTION) {
+    _push_operands(branch, exp->parameters, exp->parameter_count);
+  } else if (exp->type == EXP_LABEL) {
+    size_t ix = _reserve_operands(branch, 1);
+    branch->operand_kinds[ix] = OPERAND_LABEL;
+    branch->operand_values[ix] =
+        intern(exp->parameters[0].str, exp->parameters[0].len);
+  }
+  branch->exp_count++;
+
+  return ret;
+}
+
+err_t asm_parse_line(asm_tree_branch_t *branch, const char *line, size_t len,
+                     uint32_t line_num) {
+  err_t ret = TASM_OK;
+
+  lexer_t lex;
+  lexer_init(&lex, line, len);
+
+  asm_tok_t keyword;
+  if (!lexer_next(&lex, &keyword))
+    return TASM_OK;
+
+  // Most lines have very few parameters, only long ones need the heap
+  asm_tok_t stack_params[8];
+  asm_tok_t *parameters = stack_params;
+  size_t parameter_capacity = sizeof(stack_params) / sizeof(asm_tok_t);
+  size_t parameter_count = 0;
+
+  asm_tok_t tok;
+  while (lexer_next(&lex, &tok)) {
+    if (tok.flags & TOK_UNTERMINATED) {
+      ret = TASM_STRING_NOT_CLOSED;
+      goto parse_line_cleanup;
+    }
+
+    if (tok.flags & TOK_ESCAPED)
+      tok = _materialize_str(branch, tok);
+
+    if (parameter_count == parameter_capacity) {
+      parameter_capacity *= 2;
+      if (parameters == stack_params) {
+        parameters = malloc(sizeof(asm_tok_t) * parameter_capacity);
+        memcpy(parameters, stack_params, sizeof(stack_params));
+      } else {
+        parameters =
+            realloc(parameters, sizeof(asm_tok_t) * parameter_capacity);
+      }
+    }
+
+    parameters[parameter_count++] = tok;
+  }
+  branch->token_count += parameter_count + 1;
+
+  ret = asm_parse_exp(branch, keyword, parameter_count, parameters, line_num);
+parse_line_cleanup:
+  if (parameters != stack_params)
+    free(parameters);
+  return ret;
+}
+
+err_t asm_parse_branch(char *src_fl, directive_t section,
+                       asm_tree_branch_t *branch) {
+  return _parse_branch(NULL, src_fl, NULL, 0, section, branch);
+}
+
+/// Parses the root file of the tree, read from buf if it is not NULL
+static err_t _parse_root(char *src_fl, const char *buf, size_t buf_size,
+                         asm_tree_t *ast) {
+  if (ast->opts.jobs > 1 && ast->pool == NULL) {
+    ast->pool = malloc(sizeof(pool_t));
+    pool_init(ast->pool, ast->opts.jobs);
+  }
+
+  // Persistent stores keep the symbols of every root file
+  asm_share_t *share = ast->share;
+  size_t tree_key_len = 0;
+  char *tree_key = NULL;
+  if (buf == NULL && share != NULL && share->persistent)
+    tree_key = _share_tree_key(src_fl, &ast->opts, &tree_key_len);
+  if (tree_key != NULL &&
+      _share_reuse_tree(share, tree_key, tree_key_len, ast)) {
+    free(tree_key);
+    return TASM_OK;
+  }
+
+  // Without a store a file included many times is still parsed only once
+  if (share == NULL) {
+    if (ast->run_share == NULL) {
+      ast->run_share = malloc(sizeof(asm_share_t));
+      asm_share_init(ast->run_share, &ast->opts);
+    }
+    share = ast->run_share;
+  }
+
+  search_t search;
+  search_init(&search, ast->opts.search_dirs, ast->opts.read != NULL);
+
+  _parse_job_t root = {0};
+  root.path = strdup(src_fl);
+  root.buf = buf;
+  root.buf_size = buf_size;
+  root.section = ast->curr_section;
+  root.pool = ast->pool;
+  root.opts = &ast->opts;
+  root.share = share;
+  root.search = &search;
+  root.file = root.path;
+  root.id = buf != NULL ? intern(src_fl, strlen(src_fl))
+                        : search_canonical(&search, src_fl);
+  if (root.pool != NULL)
+    pool_submit(root.pool, &root.task, _run_parse_job, &root);
+
+  idmap_t merged;
+  idmap_init(&merged);
+  err_t err = _merge_parse_job(ast, &root, &merged);
+  // Before the symbols are kept, so trees borrowing them never write to them
+  if (err == TASM_OK)
+    _eval_symbols(ast);
+  if (err == TASM_OK && tree_key != NULL)
+    _share_keep_tree(share, tree_key, tree_key_len, &root, ast);
+  else
+    free(tree_key);
+
+  _free_parse_job(&root);
+  idmap_free(&merged);
+  search_free(&search);
+  return err;
+}
+
+err_t asm_parse_buffer(char *name, const char *src, size_t size,
+                       asm_tree_t *ast) {
+  // An empty buffer must not be mistaken for a file to read
+  return _parse_root(name, src != NULL ? src : "", size, ast);
+}
+
+err_t asm_parse_file(char *src_fl, asm_tree_t *ast) {
+  return _parse_root(src_fl, NULL, 0, ast);
+}
+
+err_t asm_resolve_labels(asm_tree_t *ast) {
+  err_t ret = TASM_OK;
+
+  idmap_free(&ast->label_map);
+
+  size_t offset = 0;
+  asm_tree_branch_t *branch;
+  asm_exp_t *exp;
+  char detail[256];
+  for (size_t b = 0; b < ast->branch_count; b++) {
+    branch = &ast->branches[b];
+
+    for (size_t e = 0; e < branch->exp_count; e++) {
+      exp = &branch->asm_exp[e];
+      exp->position = offset;
+      if (exp->type != EXP_LABEL) {
+        offset += _exp_size(exp);
+        continue;
+      }
+
+      asm_tok_t name = exp->parameters[0];
+      size_t prev_position;
+      if (!idmap_put(&ast->label_map, branch->operand_values[exp->operand],
+                     offset, &prev_position)) {
+        snprintf(detail, sizeof(detail),
+                 "Label \"%.*s\" is already defined at $%.4zx", (int)name.len,
+                 name.str, prev_position);
+        ret = TASM_DUPLICATE_LABEL;
+        goto asm_resolve_labels_exit;
+      }
+    }
+  }
+
+  ast->size = offset;
+
+asm_resolve_labels_exit:
+  if (ret != TASM_OK)
+    _handle_err(ast, ret, branch->file, exp->line, exp->parameters[0],
+                detail);
+  return ret;
+}
+
+err_t asm_replace_symbols(asm_tree_t *ast) {
+  err_t ret = TASM_OK;
+  char detail[256];
+  char *detail_ptr = NULL;
+
+  asm_tree_branch_t *branch;
+  asm_exp_t *exp;
+  asm_tok_t *param;
+  for (size_t b = 0; b < ast->branch_count; b++) {
+    branch = &ast->branches[b];
+
+    for (size_t e = 0; e < branch->exp_count; e++) {
+      exp = &branch->asm_exp[e];
+
+      for (size_t p = 0; p < exp->parameter_count; p++) {
+        param = &exp->parameters[p];
+        if ((param->flags & TOK_STRING) ||
+            param->str[0] != TASM_CHAR_SYMBOL_USAGE_PREFIX)
+          continue;
+
+        // Operands of instructions carry the interned name already
+        uint8_t inst = exp->type == EXP_INSTRUCTION;
+        ast->stats.symbol_lookups++;
+        asm_symbol_t *symbol =
+            inst ? _get_symbol(ast, branch->operand_values[exp->operand + p])
+                 : _find_symbol(ast, *param);
+        if (symbol == NULL) {
+          ret = TASM_INVALID_SYMBOL;
+          goto asm_replace_symbols_exit;
+        }
+
+        uint8_t missing = 0;
+        ret = _eval_symbol(ast, symbol, 1, 0, &missing);
+        if (ret != TASM_OK) {
+          _eval_detail(detail, sizeof(detail), symbol);
+          detail_ptr = detail;
+          goto asm_replace_symbols_exit;
+        }
+
+        // Keep the column of the usage for diagnostics
+        uint16_t col = param->col;
+        *param = symbol->value;
+        param->col = col;
+        if (inst) {
+          _own_operands(branch);
+          branch->operand_kinds[exp->operand + p] = symbol->kind;
+          branch->operand_values[exp->operand + p] = _symbol_operand(symbol);
+        }
+      }
+    }
+  }
+
+asm_replace_symbols_exit:
+  if (ret != TASM_OK)
+    _handle_err(ast, ret, branch->file, exp->line, *param, detail_ptr);
+  return ret;
+}
+
+/// Encodes count operands of an instruction, starting at first, into dest
+/// and counts the label lookups in label_lookups. The parameters are only
+/// used for symbol usages which were not replaced.
+static err_t _translate_operands(asm_tree_t *ast, asm_tok_t *params,
+                                 const uint8_t *kinds, const uint32_t *values,
+                                 size_t first, size_t count, uint8_t *dest,
+                                 size_t *label_lookups) {
+  for (size_t p = 0; p < count; p++) {
+    uint32_t value = values[first + p];
+    switch (kinds[first + p]) {
+    case OPERAND_REGISTER:
+      _mod_inst_register(dest, value);
+      break;
+    case OPERAND_CHAR:
+      dest[1] = value;
+      break;
+    case OPERAND_SYMBOL:
+      // Looked up as a label, prefix included
+      value = intern_find(params[p].str, params[p].len);
+      // fallthrough
+    case OPERAND_LABEL:
+      label_lookups[0]++;
+      err_t ret = _get_label_addr(ast, value, &value);
+      if (ret != TASM_OK)
+        return ret;
+      // fallthrough
+    case OPERAND_VALUE:
+      _mod_inst_address(dest);
+      // fallthrough
+    case OPERAND_ADDRESS:
+      dest[1] = (value & 0xff00) >> 8;
+      dest[2] = value & 0xff;
+      break;
+    case OPERAND_INVALID:
+      return (err_t)value;
+    case OPERAND_EMPTY:
+      log_wrn("internal: asm_translate_parameters received an empty "
+              "param!\n");
+      break;
+    default:
+      break;
+    }
+  }
+
+  return TASM_OK;
+}
+
+err_t asm_translate_parameters(asm_tree_t *ast, asm_tok_t *params,
+                               size_t count, uint8_t *dest) {
+  size_t label_lookups = 0;
+  for (size_t p = 0; p < count; p++) {
+    uint8_t kind;
+    uint32_t value;
+    _decode_operand(params[p], &kind, &value);
+    value = _intern_operand(params[p], kind, value);
+    err_t ret = _translate_operands(ast, &params[p], &kind, &value, 0, 1,
+                                    dest, &label_lookups);
+    if (ret != TASM_OK)
+      return ret;
+  }
+
+  return TASM_OK;
+}
+
+/// Value of a .byte/.bytes/.padding operand
+static uint8_t _dir_value(asm_tok_t tok) {
+  if (tok.len == 0)
+    return 0;
+
+  if ((tok.flags & TOK_STRING) || tok.str[0] == TASM_CHAR_CHAR_CONT)
+    return tok.len > 1 && !(tok.flags & TOK_STRING) ? tok.str[1] : tok.str[0];
+
+  unsigned long value;
+  if (tok.str[0] == TASM_CHAR_ADDRESS_PREFIX) {
+    size_t offset = tok.len > 1 && tok.str[1] == TASM_CHAR_VALUE_PREFIX ? 2 : 1;
+    value = _parse_literal(tok.str + offset, tok.len - offset);
+  } else {
+    _parse_num(tok.str, tok.len, 0, &value);
+  }
+
+  return value & 0xff;
+}
+
+/// Writes the data of a directive to out, which has room for exactly
+/// _dir_exp_size bytes
+static err_t _encode_dir(asm_exp_t *exp, uint8_t *out) {
+  size_t size = _dir_exp_size(*exp);
+  asm_tok_t *params = exp->parameters;
+
+  switch (exp->directive) {
+  case DIR_NULLPAD:
+    memset(out, 0, size);
+    break;
+  case DIR_PADDING:
+    if (exp->parameter_count < 2)
+      return TASM_DIRECTIVE_MISSING_PARAMETER;
+
+    memset(out, _dir_value(params[1]), size);
+    break;
+  case DIR_BYTE:
+    if (exp->parameter_count < 1)
+      return TASM_DIRECTIVE_MISSING_PARAMETER;
+
+    out[0] = _dir_value(params[0]);
+    break;
+  case DIR_BYTES: {
+    // Strings contribute all of their characters, missing values are 0
+    size_t wi = 0;
+    for (size_t p = 1; p < exp->parameter_count && wi < size; p++) {
+      if (params[p].flags & TOK_STRING) {
+        for (size_t c = 0; c < params[p].len && wi < size; c++)
+          out[wi++] = params[p].str[c];
+        continue;
+      }
+
+      out[wi++] = _dir_value(params[p]);
+    }
+    memset(out + wi, 0, size - wi);
+    break;
+  }
+  default:
+    break;
+  }
+
+  return TASM_OK;
+}
+
+/// Writes a directive to out like _encode_dir, without holding all of its
+/// data in memory
+static err_t _write_dir(asm_exp_t *exp, writer_t *out) {
+  size_t size = _dir_exp_size(*exp);
+  asm_tok_t *params = exp->parameters;
+
+  switch (exp->directive) {
+  case DIR_NULLPAD:
+    writer_fill(out, 0, size);
+    break;
+  case DIR_PADDING:
+    if (exp->parameter_count < 2)
+      return TASM_DIRECTIVE_MISSING_PARAMETER;
+
+    writer_fill(out, _dir_value(params[1]), size);
+    break;
+  case DIR_BYTES: {
+    size_t wi = 0;
+    for (size_t p = 1; p < exp->parameter_count && wi < size; p++) {
+      if (params[p].flags & TOK_STRING) {
+        size_t n = params[p].len < size - wi ? params[p].len : size - wi;
+        writer_write(out, params[p].str, n);
+        wi += n;
+        continue;
+      }
+
+      uint8_t value = _dir_value(params[p]);
+      writer_write(out, &value, 1);
+      wi++;
+    }
+    writer_fill(out, 0, size - wi);
+    break;
+  }
+  default:
+    break;
+  }
+
+  return TASM_OK;
+}
+
+/// Encodes exp to out, the operands of an instruction are taken from kinds
+/// and values at exp->operand
+static err_t _encode_exp(asm_tree_t *ast, asm_exp_t *exp,
+                         const uint8_t *kinds, const uint32_t *values,
+                         uint8_t *out, size_t *label_lookups) {
+  switch (exp->type) {
+  case EXP_DIRECTIVE:
+    return _encode_dir(exp, out);
+  case EXP_INSTRUCTION:
+    if (exp->inst == INST_INVALID)
+      return TASM_INVALID_INSTRUCTION;
+
+    if (exp->parameter_count != _get_inst_param_count(exp->inst))
+      return TASM_INVALID_PARAMETER;
+
+    memset(out, 0, _get_inst_size(exp->inst));
+    out[0] = exp->inst;
+    return _translate_operands(ast, exp->parameters, kinds, values,
+                               exp->operand, exp->parameter_count, out,
+                               label_lookups);
+  default:
+    return TASM_OK;
+  }
+}
+
+/// Directives larger than this are written by asm_encode_to without being
+/// encoded into its window
+#define ENCODE_FILL_MIN (64 * 1024)
+/// Output asm_encode_to encodes at once, holds at least one expression
+#define ENCODE_WINDOW_SIZE (1024 * 1024)
+
+/// A contiguous range of expressions, in source order, encoded by one task
+typedef struct _encode_job_t {
+  pool_task_t task;
+  asm_tree_t *ast;
+  /// Output from position base on
+  uint8_t *dest;
+  size_t base;
+  size_t branch;
+  size_t exp;
+  size_t count;
+  size_t label_lookups;
+  /// First error within the range
+  err_t err;
+  size_t err_branch;
+  size_t err_exp;
+} _encode_job_t;
+
+static void _run_encode_job(void *arg) {
+  _encode_job_t *job = arg;
+  size_t b = job->branch;
+  size_t e = job->exp;
+
+  for (size_t n = 0; n < job->count; n++) {
+    while (e >= job->ast->branches[b].exp_count) {
+      b++;
+      e = 0;
+    }
+
+    asm_tree_branch_t *branch = &job->ast->branches[b];
+    asm_exp_t *exp = &branch->asm_exp[e];
+    err_t err = _encode_exp(job->ast, exp, branch->operand_kinds,
+                            branch->operand_values,
+                            job->dest + exp->position - job->base,
+                            &job->label_lookups);
+    if (err != TASM_OK) {
+      job->err = err;
+      job->err_branch = b;
+      job->err_exp = e;
+      return;
+    }
+
+    e++;
+  }
+}
+
+/// Encodes total expressions starting at expression e of branch b into dest,
+/// which holds the output from position base on
+static err_t _encode_range(asm_tree_t *ast, uint8_t *dest, size_t base,
+                           size_t b, size_t e, size_t total) {
+  err_t ret = TASM_OK;
+
+  // Every expression has its final position, so they are encoded straight
+  // into the image in independent ranges. Each byte is written exactly once.
+
+  size_t job_count = 1;
+  if (ast->opts.jobs > 1 && total > 0) {
+    if (ast->pool == NULL) {
+      ast->pool = malloc(sizeof(pool_t));
+      pool_init(ast->pool, ast->opts.jobs);
+    }
+
+    // A few ranges per thread to even out expensive expressions
+    job_count = ast->opts.jobs * 4;
+    if (job_count > total)
+      job_count = total;
+  }
+
+  _encode_job_t *jobs = calloc(job_count, sizeof(_encode_job_t));
+  size_t first_branch = b;
+  size_t first_exp = e;
+  for (size_t j = 0; j < job_count; j++) {
+    _encode_job_t *job = &jobs[j];
+    job->ast = ast;
+    job->dest = dest;
+    job->base = base;
+    job->branch = b;
+    job->exp = e;
+    job->count = total / job_count + (j < total % job_count);
+
+    // Find the start of the next range
+    size_t remaining = job->count;
+    while (remaining > 0) {
+      size_t available = ast->branches[b].exp_count - e;
+      if (available > remaining) {
+        e += remaining;
+        break;
+      }
+
+      remaining -= available;
+      b++;
+      e = 0;
+    }
+
+    if (job_count > 1)
+      pool_submit(ast->pool, &job->task, _run_encode_job, job);
+    else
+      _run_encode_job(job);
+  }
+
+  // Ranges are in source order, so the first failing range holds the first
+  // error of the whole tree
+  _encode_job_t *failed = NULL;
+  for (size_t j = 0; j < job_count; j++) {
+    if (job_count > 1)
+      pool_wait(ast->pool, &jobs[j].task);
+    ast->stats.label_lookups += jobs[j].label_lookups;
+    if (failed == NULL && jobs[j].err != TASM_OK)
+      failed = &jobs[j];
+  }
+
+  if (failed != NULL) {
+    ret = failed->err;
+    asm_tree_branch_t *branch = &ast->branches[failed->err_branch];
+    asm_exp_t *exp = &branch->asm_exp[failed->err_exp];
+    _handle_err(ast, ret, branch->file, exp->line, _unknown_tok(exp->col),
+                NULL);
+  }
+  free(jobs);
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_TRC
+  if (ret == TASM_OK && log_enabled(LOG_LEVEL_TRC)) {
+    flockfile(stdout);
+    b = first_branch;
+    e = first_exp;
+    for (size_t n = 0; n < total; n++, e++) {
+      while (e >= ast->branches[b].exp_count) {
+        b++;
+        e = 0;
+      }
+
+      asm_exp_t *exp = &ast->branches[b].asm_exp[e];
+      if (exp->type != EXP_INSTRUCTION)
+        continue;
+
+      for (size_t s = 0; s < _get_inst_size(exp->inst); s++)
+        printf("0x%.2x, ", dest[exp->position - base + s]);
+      printf("\n");
+    }
+    funlockfile(stdout);
+  }
+#else
+  (void)first_branch;
+  (void)first_exp;
+#endif
+
+  return ret;
+}
+
+err_t asm_encode_into(asm_tree_t *ast, uint8_t *dest) {
+  size_t total = 0;
+  for (size_t b = 0; b < ast->branch_count; b++)
+    total += ast->branches[b].exp_count;
+
+  return _encode_range(ast, dest, 0, 0, 0, total);
+}
+
+/// Encodes count expressions starting at expression e of branch b into the
+/// window, which starts at position base, and writes the window up to end
+static err_t _write_range(asm_tree_t *ast, uint8_t *window, size_t base,
+                          size_t b, size_t e, size_t count, size_t end,
+                          writer_t *out) {
+  err_t ret = _encode_range(ast, window, base, b, e, count);
+  if (ret == TASM_OK)
+    writer_write(out, window, end - base);
+  return ret;
+}
+
+err_t asm_encode_to(asm_tree_t *ast, writer_t *out) {
   err_t ret = TASM_OK;
+  uint8_t *window = malloc(ENCODE_WINDOW_SIZE);
+
+  // Expressions are collected until the window is full and then encoded at
+  // once. Large fills go to the writer directly.
+  size_t base = 0;
+  size_t first_branch = 0;
+  size_t first_exp = 0;
+  size_t count = 0;
+  for (size_t b = 0; b < ast->branch_count && ret == TASM_OK; b++) {
+    asm_tree_branch_t *branch = &ast->branches[b];
+
+    for (size_t e = 0; e < branch->exp_count && ret == TASM_OK; e++) {
+      asm_exp_t *exp = &branch->asm_exp[e];
+      size_t size = _exp_size(exp);
+      uint8_t fill = exp->type == EXP_DIRECTIVE && size > ENCODE_FILL_MIN;
+      if (fill || exp->position + size - base > ENCODE_WINDOW_SIZE) {
+        ret = _write_range(ast, window, base, first_branch, first_exp, count,
+                           exp->position, out);
+        base = exp->position;
+        first_branch = b;
+        first_exp = e;
+        count = 0;
+      }
+
+      if (ret == TASM_OK && fill) {
+        ret = _write_dir(exp, out);
+        if (ret != TASM_OK)
+          _handle_err(ast, ret, branch->file, exp->line,
+                      _unknown_tok(exp->col), NULL);
+        base += size;
+        first_exp++;
+        continue;
+      }
+
+      count++;
+    }
+  }
+
+  if (ret == TASM_OK)
+    ret = _write_range(ast, window, base, first_branch, first_exp, count,
+                       ast->size, out);
+
+  free(window);
+  return ret;
+}
+
+err_t asm_encode_tree(asm_tree_t *ast, uint8_t **dest_ptr, size_t *size) {
+  *dest_ptr = malloc(ast->size);
+  size[0] = ast->size;
+  return asm_encode_into(ast, *dest_ptr);
+}
+
+/// Resolves the labels and symbols of a parsed tree
+static err_t _resolve_tree(asm_tree_t *ast) {
+  double start = _now_ms();
+  if (ast->opts.optimize) {
+    log_inf("Optimizing...\n");
+    asm_optimize(ast);
+    log_inf("Removed %zu instructions, %zu bytes\n", ast->stats.removed_insts,
+            ast->stats.removed_bytes);
+  }
+
+  log_inf("Resolving label positions...\n");
+  err_t ret = asm_resolve_labels(ast);
+  ast->stats.resolve_ms = _now_ms() - start;
+  ast->stats.labels = ast->label_map.count;
+  if (ret != TASM_OK)
+    return ret;
+
+  log_inf("Precalculated Size: 0x%zx bytes\n", ast->size);
+
+  log_inf("Replacing Symbol usages...\n");
+  start = _now_ms();
+  ret = asm_replace_symbols(ast);
+  ast->stats.replace_ms = _now_ms() - start;
+  return ret;
+}
+
+err_t asm_translate_tree(asm_tree_t *ast, uint8_t **dest_ptr, size_t *size) {
+  *dest_ptr = NULL;
+  size[0] = 0;
+
+  err_t ret = _resolve_tree(ast);
+  if (ret != TASM_OK)
+    return ret;
+
+  log_inf("Translating tree...\n");
+  double start = _now_ms();
+  ret = asm_encode_tree(ast, dest_ptr, size);
+  ast->stats.encode_ms = _now_ms() - start;
+  return ret;
+}
+
+/// Writes str as a JSON string literal
+static void _print_json_str(FILE *f, const char *str) {
+  fputc('"', f);
+  for (; *str != 0; str++) {
+    if (*str == '"' || *str == '\\')
+      fprintf(f, "\\%c", *str);
+    else if ((uint8_t)*str < 0x20)
+      fprintf(f, "\\u%.4x", *str);
+    else
+      fputc(*str, f);
+  }
+  fputc('"', f);
+}
+
+/// Logs the statistics of a run and writes them as a single line of JSON to
+/// stderr, where it is not mixed up with the log
+static void _print_stats(asm_stats_t *stats, char *src_fl, err_t err) {
+  log_inf("Statistics:\n");
+  log_inf("  Time (ms): parse %.2f, resolve %.2f, replace %.2f, encode %.2f, "
+          "write %.2f, total %.2f\n",
+          stats->parse_ms, stats->resolve_ms, stats->replace_ms,
+          stats->encode_ms, stats->write_ms, stats->total_ms);
+  log_inf("  Parsed %zu files (%zu cached, %zu reparsed), %zu bytes, "
+          "%zu lines, %zu tokens\n",
+          stats->branches, stats->cached_branches, stats->reparsed_branches,
+          stats->bytes_read, stats->lines, stats->tokens);
+  log_inf("  %zu symbols, %zu labels, %zu fixups\n", stats->symbols,
+          stats->labels, stats->fixups);
+  log_inf("  Optimized out %zu instructions, %zu bytes\n",
+          stats->removed_insts, stats->removed_bytes);
+  log_inf("  Lookups: %zu keywords, %zu symbols, %zu labels\n",
+          stats->keyword_lookups, stats->symbol_lookups,
+          stats->label_lookups);
+  log_inf("  Emitted %zu bytes, peak RSS %zu KiB\n", stats->bytes_emitted,
+          stats->peak_rss_kb);
+
+  flockfile(stderr);
+  fprintf(stderr, "{\"file\": ");
+  _print_json_str(stderr, src_fl);
+  fprintf(stderr,
+          ", \"ok\": %s, \"parse_ms\": %.3f, \"resolve_ms\": %.3f, "
+          "\"replace_ms\": %.3f, \"encode_ms\": %.3f, \"write_ms\": %.3f, "
+          "\"total_ms\": %.3f, \"bytes_read\": %zu, \"lines\": %zu, "
+          "\"tokens\": %zu, \"branches\": %zu, \"cached_branches\": %zu, "
+          "\"reparsed_branches\": %zu, \"symbols\": %zu, \"labels\": %zu, "
+          "\"keyword_lookups\": %zu, \"symbol_lookups\": %zu, "
+          "\"label_lookups\": %zu, \"fixups\": %zu, \"removed_insts\": %zu, "
+          "\"removed_bytes\": %zu, \"bytes_emitted\": %zu, "
+          "\"peak_rss_kb\": %zu}\n",
+          err == TASM_OK ? "true" : "false", stats->parse_ms,
+          stats->resolve_ms, stats->replace_ms, stats->encode_ms,
+          stats->write_ms, stats->total_ms, stats->bytes_read, stats->lines,
+          stats->tokens, stats->branches, stats->cached_branches,
+          stats->reparsed_branches, stats->symbols, stats->labels,
+          stats->keyword_lookups, stats->symbol_lookups, stats->label_lookups,
+          stats->fixups, stats->removed_insts, stats->removed_bytes,
+          stats->bytes_emitted, stats->peak_rss_kb);
+  funlockfile(stderr);
+}
+
+//-- Optimization --//
+
+/// Registers tracked by the optimizer, reg_t values below this
+#define PEEP_REGISTERS (REG_H + 1)
+
+/// An operand as it is encoded, symbol usages are looked through to the
+/// operand they are replaced with. The kind is OPERAND_NONE if it is not
+/// known before symbols are replaced.
+typedef struct _peep_operand_t {
+  uint8_t kind;
+  uint32_t value;
+} _peep_operand_t;
+
+/// What is known about the machine right before an instruction. Everything
+/// is forgotten at labels, which can be reached from anywhere.
+typedef struct _peep_state_t {
+  /// Immediate value or label address each register was loaded with
+  uint8_t loaded[PEEP_REGISTERS];
+  _peep_operand_t values[PEEP_REGISTERS];
+  /// The previous instruction is a nop
+  uint8_t after_nop;
+} _peep_state_t;
+
+static _peep_operand_t _peep_operand(asm_tree_t *ast,
+                                     asm_tree_branch_t *branch,
+                                     asm_exp_t *exp, size_t p) {
+  _peep_operand_t op = {.kind = branch->operand_kinds[exp->operand + p],
+                        .value = branch->operand_values[exp->operand + p]};
+  if (op.kind == OPERAND_SYMBOL) {
+    asm_symbol_t *symbol = _get_symbol(ast, op.value);
+    op.kind = symbol != NULL ? symbol->kind : OPERAND_NONE;
+    op.value = symbol != NULL ? _symbol_operand(symbol) : 0;
+  }
+
+  switch (op.kind) {
+  case OPERAND_REGISTER:
+    if (op.value >= PEEP_REGISTERS)
+      op.kind = OPERAND_NONE;
+    return op;
+  case OPERAND_VALUE:
+  case OPERAND_ADDRESS:
+  case OPERAND_LABEL:
+    return op;
+  default:
+    return (_peep_operand_t){.kind = OPERAND_NONE};
+  }
+}
+
+/// Returns 1 if the label id is defined between exp and the next
+/// expression which is not a label, which may be in a later branch
+static uint8_t _peep_labels_next(asm_tree_t *ast, size_t b, size_t e,
+                                 uint32_t id) {
+  for (e++; b < ast->branch_count; b++, e = 0) {
+    asm_tree_branch_t *branch = &ast->branches[b];
+    for (; e < branch->exp_count; e++) {
+      asm_exp_t *exp = &branch->asm_exp[e];
+      if (exp->type != EXP_LABEL)
+        return 0;
+      if (branch->operand_values[exp->operand] == id)
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+/// Returns 1 if exp can be left out given state and updates state to what
+/// is known after exp. b and e are the position of exp in the tree.
+static uint8_t _peep_redundant(asm_tree_t *ast, size_t b, size_t e,
+                               _peep_state_t *state) {
+  asm_tree_branch_t *branch = &ast->branches[b];
+  asm_exp_t *exp = &branch->asm_exp[e];
+  uint8_t after_nop = state->after_nop;
+  state->after_nop = 0;
+  if (exp->type != EXP_INSTRUCTION || exp->inst == INST_INVALID ||
+      exp->parameter_count != _get_inst_param_count(exp->inst)) {
+    memset(state, 0, sizeof(_peep_state_t));
+    return 0;
+  }
+
+  _peep_operand_t reg = {.kind = OPERAND_NONE};
+  _peep_operand_t op = {.kind = OPERAND_NONE};
+  if (exp->parameter_count > 0)
+    op = _peep_operand(ast, branch, exp, exp->parameter_count - 1);
+  if (exp->parameter_count == 2)
+    reg = _peep_operand(ast, branch, exp, 0);
+
+  switch (exp->inst) {
+  case INST_NOP:
+    state->after_nop = 1;
+    return after_nop;
+  case INST_LD: {
+    if (reg.kind != OPERAND_REGISTER)
+      break;
+
+    // Loading what the register already holds
+    uint8_t *loaded = &state->loaded[reg.value];
+    _peep_operand_t *value = &state->values[reg.value];
+    if ((op.kind == OPERAND_VALUE || op.kind == OPERAND_LABEL) && *loaded &&
+        value->kind == op.kind && value->value == op.value)
+      return 1;
+
+    *loaded = op.kind == OPERAND_VALUE || op.kind == OPERAND_LABEL;
+    *value = op;
+    return 0;
+  }
+  case INST_ST:
+    // Loading back what was stored is not the same, st writes both bytes
+    // of the accumulator while ld reads one, and the reserved stores
+    // select devices
+  case INST_CMP:
+  case INST_DIN:
+  case INST_EIN:
+    return 0;
+  case INST_BRN:
+    // Conditional branches share the opcode, either way they end up at
+    // the next instruction
+    if (op.kind == OPERAND_LABEL && _peep_labels_next(ast, b, e, op.value))
+      return 1;
+    break;
+  default:
+    break;
+  }
+
+  memset(state, 0, sizeof(_peep_state_t));
+  return 0;
+}
+
+void asm_optimize(asm_tree_t *ast) {
+  _peep_state_t state = {0};
+  for (size_t b = 0; b < ast->branch_count; b++) {
+    asm_tree_branch_t *branch = &ast->branches[b];
+
+    // Expressions are compacted in place, the brn rule looks ahead at the
+    // labels following it, which are never removed
+    size_t kept = 0;
+    for (size_t e = 0; e < branch->exp_count; e++) {
+      asm_exp_t *exp = &branch->asm_exp[e];
+      if (_peep_redundant(ast, b, e, &state)) {
+        ast->stats.removed_insts++;
+        ast->stats.removed_bytes += _get_inst_size(exp->inst);
+        continue;
+      }
+
+      branch->asm_exp[kept++] = *exp;
+    }
+
+    branch->exp_count = kept;
+  }
+}
+
+//-- Cycle Estimates --//
+
+/// A straight run of code starting at a label, or at the start of the
+/// output for the code before the first label
+typedef struct _cost_block_t {
+  /// Label token, empty for the start
+  asm_tok_t name;
+  size_t position;
+  size_t inst_count;
+  /// Cycles of the instructions of the block alone
+  size_t cycles;
+  /// Blocks control may continue in and blocks called, in edges
+  size_t first_edge;
+  size_t edge_count;
+  /// Worst case cycles from the start of the block until control returns
+  /// or leaves the program, called blocks included
+  size_t path;
+  uint8_t state;
+  /// A branch leads back to the block, its path counts the loop once
+  uint8_t loop;
+  /// The block calls itself, directly or through other blocks
+  uint8_t recursive;
+} _cost_block_t;
+
+typedef struct _cost_edge_t {
+  size_t block;
+  uint8_t call;
+} _cost_edge_t;
+
+/// States of a block while walking the graph
+#define COST_UNVISITED 0
+#define COST_VISITING 1
+#define COST_DONE 2
+
+typedef struct _cost_graph_t {
+  size_t block_count;
+  size_t block_capacity;
+  _cost_block_t *blocks;
+  size_t edge_count;
+  size_t edge_capacity;
+  _cost_edge_t *edges;
+  /// Maps interned label names to their block
+  idmap_t labels;
+} _cost_graph_t;
+
+/// Block being walked and what its edges add up to so far
+typedef struct _cost_frame_t {
+  size_t block;
+  size_t edge;
+  size_t calls;
+  size_t next;
+} _cost_frame_t;
+
+/// Name of an instruction, the branches sharing an opcode are all brn to
+/// the cpu
+static const char *_inst_name(inst_t inst) {
+  for (size_t i = 0; i < INST_COUNT; i++)
+    if (inst_descriptors[i].inst == inst)
+      return inst_descriptors[i].name;
+
+  return "?";
+}
+
+static size_t _inst_cycles(inst_t inst) {
+  inst_descriptor_t *desc = _get_inst_descriptor(inst);
+  return desc != NULL ? desc->cycles : 0;
+}
+
+static void _cost_add_block(_cost_graph_t *graph, asm_tok_t name,
+                            size_t position) {
+  if (graph->block_count == graph->block_capacity) {
+    graph->block_capacity =
+        graph->block_capacity ? graph->block_capacity * 2 : 16;
+    graph->blocks = realloc(graph->blocks, sizeof(_cost_block_t) *
+                                               graph->block_capacity);
+  }
+
+  graph->blocks[graph->block_count++] =
+      (_cost_block_t){.name = name, .position = position};
+}
+
+/// Adds an edge from block to target. Edges have to be added block by
+/// block, in order.
+static void _cost_add_edge(_cost_graph_t *graph, size_t block, size_t target,
+                           uint8_t call) {
+  if (graph->edge_count == graph->edge_capacity) {
+    graph->edge_capacity = graph->edge_capacity ? graph->edge_capacity * 2 : 16;
+    graph->edges =
+        realloc(graph->edges, sizeof(_cost_edge_t) * graph->edge_capacity);
+  }
+
+  if (graph->blocks[block].edge_count == 0)
+    graph->blocks[block].first_edge = graph->edge_count;
+  graph->edges[graph->edge_count++] =
+      (_cost_edge_t){.block = target, .call = call};
+  graph->blocks[block].edge_count++;
+}
+
+/// Splits a resolved tree into blocks at its labels. Control falls through
+/// into the next block unless the block ends by returning. A brn is
+/// assumed to fall through as well, whether it is conditional is only
+/// decided by the branching mode at run time.
+static void _cost_build(_cost_graph_t *graph, asm_tree_t *ast) {
+  idmap_init(&graph->labels);
+  _cost_add_block(graph, (asm_tok_t){.str = "", .len = 0}, 0);
+  for (size_t b = 0; b < ast->branch_count; b++) {
+    asm_tree_branch_t *branch = &ast->branches[b];
+    for (size_t e = 0; e < branch->exp_count; e++) {
+      asm_exp_t *exp = &branch->asm_exp[e];
+      if (exp->type != EXP_LABEL)
+        continue;
+
+      _cost_add_block(graph, exp->parameters[0], exp->position);
+      idmap_put(&graph->labels, branch->operand_values[exp->operand],
+                graph->block_count - 1, NULL);
+    }
+  }
+
+  size_t block = 0;
+  uint8_t returned = 0;
+  for (size_t b = 0; b < ast->branch_count; b++) {
+    asm_tree_branch_t *branch = &ast->branches[b];
+    for (size_t e = 0; e < branch->exp_count; e++) {
+      asm_exp_t *exp = &branch->asm_exp[e];
+      if (exp->type == EXP_LABEL) {
+        if (!returned)
+          _cost_add_edge(graph, block, block + 1, 0);
+        block++;
+        returned = 0;
+        continue;
+      }
+
+      if (exp->type != EXP_INSTRUCTION)
+        continue;
+
+      _cost_block_t *cur = &graph->blocks[block];
+      cur->inst_count++;
+      cur->cycles += _inst_cycles(exp->inst);
+      returned = exp->inst == INST_RTS || exp->inst == INST_RTI;
+
+      size_t target;
+      uint8_t call = exp->inst == INST_CAL;
+      if ((exp->inst != INST_BRN && !call) || exp->parameter_count != 1 ||
+          branch->operand_kinds[exp->operand] != OPERAND_LABEL ||
+          !idmap_get(&graph->labels, branch->operand_values[exp->operand],
+                     &target))
+        continue;
+
+      _cost_add_edge(graph, block, target, call);
+    }
+  }
+}
+
+/// Adds the path of an edge which was followed to frame
+static void _cost_follow(_cost_frame_t *frame, const _cost_edge_t *edge,
+                         size_t path) {
+  if (edge->call)
+    frame->calls += path;
+  else if (path > frame->next)
+    frame->next = path;
+}
+
+/// Computes the path of every block reachable from root. Branches back to
+/// a block being walked close a loop and calls of such a block recurse,
+/// both add nothing to the path.
+static void _cost_walk(_cost_graph_t *graph, size_t root) {
+  if (graph->blocks[root].state != COST_UNVISITED)
+    return;
+
+  size_t depth = 0;
+  size_t capacity = 16;
+  _cost_frame_t *stack = malloc(sizeof(_cost_frame_t) * capacity);
+  stack[depth++] = (_cost_frame_t){.block = root};
+  graph->blocks[root].state = COST_VISITING;
+  while (depth > 0) {
+    _cost_frame_t *frame = &stack[depth - 1];
+    _cost_block_t *block = &graph->blocks[frame->block];
+    if (frame->edge < block->edge_count) {
+      _cost_edge_t *edge = &graph->edges[block->first_edge + frame->edge++];
+      _cost_block_t *target = &graph->blocks[edge->block];
+      if (target->state == COST_DONE) {
+        _cost_follow(frame, edge, target->path);
+        continue;
+      }
+
+      if (target->state == COST_VISITING) {
+        if (edge->call)
+          target->recursive = 1;
+        else
+          target->loop = 1;
+        continue;
+      }
+
+      if (depth == capacity) {
+        capacity *= 2;
+        stack = realloc(stack, sizeof(_cost_frame_t) * capacity);
+      }
+
+      target->state = COST_VISITING;
+      stack[depth++] = (_cost_frame_t){.block = edge->block};
+      continue;
+    }
+
+    block->path = block->cycles + frame->calls + frame->next;
+    block->state = COST_DONE;
+    depth--;
+    if (depth > 0) {
+      _cost_frame_t *parent = &stack[depth - 1];
+      _cost_block_t *from = &graph->blocks[parent->block];
+      _cost_follow(parent, &graph->edges[from->first_edge + parent->edge - 1],
+                   block->path);
+    }
+  }
+
+  free(stack);
+}
+
+/// Prints a listing of every instruction with its estimated cycles to out,
+/// followed by the blocks at every label and what they add up to
+static void _print_cycles(asm_tree_t *ast, const char *src_fl, FILE *out) {
+  _cost_graph_t graph = {0};
+  _cost_build(&graph, ast);
+  for (size_t i = 0; i < graph.block_count; i++)
+    _cost_walk(&graph, i);
+
+  flockfile(out);
+  fprintf(out, "; Estimated cycles of \"%s\", paths take the longest way "
+               "through every branch\n",
+          src_fl);
+  for (size_t b = 0; b < ast->branch_count; b++) {
+    asm_tree_branch_t *branch = &ast->branches[b];
+    for (size_t e = 0; e < branch->exp_count; e++) {
+      asm_exp_t *exp = &branch->asm_exp[e];
+      if (exp->type == EXP_LABEL) {
+        fprintf(out, "%.*s:\n", (int)exp->parameters[0].len,
+                exp->parameters[0].str);
+        continue;
+      }
+
+      if (exp->type != EXP_INSTRUCTION)
+        continue;
+
+      fprintf(out, "  $%.4zx %4zu  %s", exp->position,
+              _inst_cycles(exp->inst), _inst_name(exp->inst));
+      for (size_t p = 0; p < exp->parameter_count; p++)
+        fprintf(out, "%s%.*s", p == 0 ? " " : ", ",
+                (int)exp->parameters[p].len, exp->parameters[p].str);
+      fprintf(out, "  ; %s:%u\n", branch->file, exp->line);
+    }
+  }
+
+  fprintf(out, "\n; %-30s %-7s %6s %8s %8s\n", "Label", "Address", "Insts",
+          "Cycles", "Path");
+  for (size_t i = 0; i < graph.block_count; i++) {
+    _cost_block_t *block = &graph.blocks[i];
+    if (i == 0 && block->inst_count == 0)
+      continue;
+
+    if (i == 0)
+      fprintf(out, "; %-30s", "(start)");
+    else
+      fprintf(out, "; %-30.*s", (int)block->name.len, block->name.str);
+    fprintf(out, " $%.4zx   %6zu %8zu %8zu", block->position, block->inst_count,
+            block->cycles, block->path);
+    if (block->loop)
+      fprintf(out, "  loop");
+    if (block->recursive)
+      fprintf(out, "  recursive");
+
+    for (size_t c = 0; c < block->edge_count; c++) {
+      _cost_edge_t *edge = &graph.edges[block->first_edge + c];
+      if (!edge->call)
+        continue;
+
+      asm_tok_t name = graph.blocks[edge->block].name;
+      fprintf(out, "  cal %.*s", (int)name.len, name.str);
+    }
+    fputc('\n', out);
+  }
+  funlockfile(out);
+
+  free(graph.blocks);
+  free(graph.edges);
+  idmap_free(&graph.labels);
+}
+
+//-- Execution --//
+
+/// An assertion and where it was made, for reporting it
+typedef struct _run_assert_t {
+  const char *file;
+  asm_exp_t *exp;
+} _run_assert_t;
+
+typedef struct _run_ctx_t {
+  asm_tree_t *ast;
+  engine_t *cpu;
+  engine_assert_t *asserts;
+  _run_assert_t *sources;
+  size_t failures;
+} _run_ctx_t;
+
+/// Decodes a parameter of .assert, labels are replaced by their address
+static err_t _assert_operand(asm_tree_t *ast, asm_tok_t tok, uint8_t *kind,
+                             uint32_t *value) {
+  _decode_operand(tok, kind, value);
+  switch (*kind) {
+  case OPERAND_LABEL:
+    *kind = OPERAND_ADDRESS;
+    return _get_label_addr(ast, intern_find(tok.str, tok.len), value);
+  case OPERAND_REGISTER:
+  case OPERAND_ADDRESS:
+  case OPERAND_VALUE:
+  case OPERAND_CHAR:
+    return TASM_OK;
+  case OPERAND_INVALID:
+    return (err_t)*value;
+  default:
+    return TASM_INVALID_PARAMETER;
+  }
+}
+
+static void _run_fail(void *user, size_t index, uint16_t actual) {
+  _run_ctx_t *ctx = user;
+  engine_assert_t *a = &ctx->asserts[index];
+  _run_assert_t *src = &ctx->sources[index];
+
+  char detail[256];
+  if (a->reg != REG_INVALID)
+    snprintf(detail, sizeof(detail),
+             "%c is $%.4x, expected $%.4x after %zu instructions",
+             "acdefgh"[a->reg], actual, a->expected,
+             ctx->cpu->steps);
+  else
+    snprintf(detail, sizeof(detail),
+             "$%.4x is $%.2x, expected $%.2x after %zu instructions",
+             a->address, actual, a->expected, ctx->cpu->steps);
+  _handle_err(ctx->ast, TASM_ASSERTION_FAILED, src->file, src->exp->line,
+              src->exp->parameters[0], detail);
+  ctx->failures++;
+}
+
+/// Runs the image of a resolved tree and checks its .assert directives.
+/// image holds the first size bytes of the image, as much as the engine
+/// can address.
+static err_t _run_tree(asm_tree_t *ast, const char *src_fl,
+                       const uint8_t *image, size_t size) {
+  err_t err = TASM_OK;
+  engine_t cpu;
+  engine_init(&cpu);
+  _run_ctx_t ctx = {.ast = ast, .cpu = &cpu};
+  size_t count = 0;
+  size_t capacity = 0;
+
+  // Branches are in the order of the image, so are the assertions
+  asm_tree_branch_t *branch;
+  asm_exp_t *exp;
+  for (size_t b = 0; b < ast->branch_count; b++) {
+    branch = &ast->branches[b];
+    for (size_t e = 0; e < branch->exp_count; e++) {
+      exp = &branch->asm_exp[e];
+      if (exp->type != EXP_DIRECTIVE || exp->directive != DIR_ASSERT)
+        continue;
+
+      if (exp->parameter_count < 2) {
+        _handle_err(ast, TASM_DIRECTIVE_MISSING_PARAMETER, branch->file,
+                    exp->line, _unknown_tok(exp->col), NULL);
+        err = TASM_DIRECTIVE_MISSING_PARAMETER;
+        goto run_tree_exit;
+      }
+
+      if (count == capacity) {
+        capacity = capacity == 0 ? 16 : capacity * 2;
+        ctx.asserts = realloc(ctx.asserts, sizeof(engine_assert_t) * capacity);
+        ctx.sources = realloc(ctx.sources, sizeof(_run_assert_t) * capacity);
+      }
+
+      engine_assert_t *a = &ctx.asserts[count];
+      a->position = exp->position;
+      a->reg = REG_INVALID;
+      a->address = 0;
+
+      uint8_t kind;
+      uint32_t value;
+      size_t p = 0;
+      err = _assert_operand(ast, exp->parameters[p], &kind, &value);
+      if (err == TASM_OK && kind == OPERAND_REGISTER)
+        a->reg = value;
+      else if (err == TASM_OK && kind == OPERAND_ADDRESS)
+        a->address = value;
+      else if (err == TASM_OK)
+        err = TASM_INVALID_PARAMETER;
+
+      if (err == TASM_OK) {
+        p = 1;
+        err = _assert_operand(ast, exp->parameters[p], &kind, &value);
+        if (err == TASM_OK && kind == OPERAND_REGISTER)
+          err = TASM_INVALID_PARAMETER;
+        a->expected = value;
+      }
+
+      if (err != TASM_OK) {
+        _handle_err(ast, err, branch->file, exp->line, exp->parameters[p],
+                    NULL);
+        goto run_tree_exit;
+      }
+
+      ctx.sources[count].file = branch->file;
+      ctx.sources[count].exp = exp;
+      count++;
+    }
+  }
+
+  engine_status_t status =
+      engine_run(&cpu, image, size, ctx.asserts, count, _run_fail, &ctx);
+  log_inf("Ran %zu instructions (%zu cycles), checked %zu assertions\n",
+          cpu.steps, cpu.cycles, count);
+  if (status != ENGINE_HALTED) {
+    char detail[256];
+    snprintf(detail, sizeof(detail), "%s at $%.4zx after %zu instructions",
+             engine_status_name(status), cpu.pc, cpu.steps);
+    _handle_err(ast, TASM_EXECUTION_FAILED, src_fl, 0, _unknown_tok(0),
+                detail);
+    err = TASM_EXECUTION_FAILED;
+  } else if (ctx.failures > 0) {
+    err = TASM_ASSERTION_FAILED;
+  }
+
+run_tree_exit:
+  free(ctx.asserts);
+  free(ctx.sources);
+  engine_free(&cpu);
+  return err;
+}
+
+//-- Streaming --//
+
+/// A file to be streamed. Files are streamed in the same order as their
+/// branches are added to a tree: a file, then each of its includes.
+typedef struct _stream_include_t {
+  /// NULL if the include directive is missing its parameter
+  char *path;
+  /// File and position of the include directive, NULL for the root file
+  const char *parent;
+  uint32_t line;
+  uint16_t col;
+  /// Number of files including this one
+  size_t depth;
+} _stream_include_t;
+
+/// An expression using a symbol or label which was not defined yet when it
+/// was read. A placeholder is written and the expression is encoded again
+/// once all of the source has been read.
+typedef struct _stream_fixup_t {
+  /// Copy of the expression and its operands, the parameters and their
+  /// strings belong to the arena of the stream's tree
+  asm_exp_t exp;
+  uint8_t *kinds;
+  uint32_t *values;
+  const char *file;
+  /// Placeholder in the output
+  size_t position;
+  size_t size;
+} _stream_fixup_t;
+
+typedef struct _stream_t {
+  /// Holds the options, symbols, labels and statistics, it has no branches
+  asm_tree_t ast;
+  writer_t out;
+  /// Size of the output written so far
+  size_t offset;
+  /// Files left to stream, the next one is at the end
+  size_t include_count;
+  size_t include_capacity;
+  _stream_include_t *includes;
+  search_t search;
+  /// Canonical path and name of the file streamed at each depth, the ones
+  /// below the current depth include the current file
+  size_t depth;
+  size_t chain_capacity;
+  uint32_t *chain_ids;
+  const char **chain_files;
+  size_t fixup_count;
+  size_t fixup_capacity;
+  _stream_fixup_t *fixups;
+} _stream_t;
+
+static void _stream_push_include(_stream_t *st, char *path,
+                                 const char *parent, uint32_t line,
+                                 uint16_t col, size_t depth) {
+  if (st->include_count == st->include_capacity) {
+    st->include_capacity = st->include_capacity ? st->include_capacity * 2 : 8;
+    st->includes = realloc(st->includes, sizeof(_stream_include_t) *
+                                             st->include_capacity);
+  }
 
-  for (size_t p = 0; p < count; p++) {
-    if (params[p] == NULL) {
-      log_wrn("internal: asm_translate_parameters received a null-pointer "
-              "param!\n");
+  st->includes[st->include_count++] =
+      (_stream_include_t){.path = path, .parent = parent, .line = line,
+                          .col = col, .depth = depth};
+}
+
+/// Writes the parameters of exp to dest with symbol usages replaced like
+/// asm_replace_symbols does. The operands of an instruction, taken from
+/// kinds and values at exp->operand, are written to dest_kinds and
+/// dest_values. Returns 0 if a symbol is not defined (yet), missing then
+/// points at its usage and the rest of dest is not written. Symbols whose
+/// value can not be evaluated count as missing unless final is set.
+static uint8_t _stream_resolve(asm_tree_t *ast, asm_exp_t *exp,
+                               const uint8_t *kinds, const uint32_t *values,
+                               asm_tok_t *dest, uint8_t *dest_kinds,
+                               uint32_t *dest_values, asm_tok_t **missing,
+                               uint8_t final) {
+  uint8_t inst = exp->type == EXP_INSTRUCTION;
+  for (size_t p = 0; p < exp->parameter_count; p++) {
+    asm_tok_t *param = &exp->parameters[p];
+    dest[p] = *param;
+    if (inst) {
+      dest_kinds[p] = kinds[exp->operand + p];
+      dest_values[p] = values[exp->operand + p];
+    }
+
+    if ((param->flags & TOK_STRING) ||
+        param->str[0] != TASM_CHAR_SYMBOL_USAGE_PREFIX)
       continue;
+
+    ast->stats.symbol_lookups++;
+    asm_symbol_t *symbol = inst ? _get_symbol(ast, values[exp->operand + p])
+                                : _find_symbol(ast, *param);
+    uint8_t undefined = 0;
+    if (symbol != NULL &&
+        _eval_symbol(ast, symbol, final, 0, &undefined) != TASM_OK)
+      symbol = NULL;
+    if (symbol == NULL) {
+      *missing = param;
+      return 0;
+    }
+
+    dest[p] = symbol->value;
+    dest[p].col = param->col;
+    if (inst) {
+      dest_kinds[p] = symbol->kind;
+      dest_values[p] = _symbol_operand(symbol);
+    }
+  }
+
+  return 1;
+}
+
+/// Records exp as a fixup at the current end of the output. The source of
+/// the line goes away, so the parameters and operands are copied.
+static void _stream_defer(_stream_t *st, asm_tree_branch_t *branch,
+                          asm_exp_t *exp, const char *file, size_t size) {
+  if (st->fixup_count == st->fixup_capacity) {
+    st->fixup_capacity = st->fixup_capacity ? st->fixup_capacity * 2 : 8;
+    st->fixups =
+        realloc(st->fixups, sizeof(_stream_fixup_t) * st->fixup_capacity);
+  }
+
+  arena_t *arena = &st->ast.arena;
+  _stream_fixup_t *fixup = &st->fixups[st->fixup_count++];
+  fixup->exp = *exp;
+  fixup->exp.position = 0;
+  fixup->exp.parameters =
+      arena_alloc(arena, sizeof(asm_tok_t) * exp->parameter_count);
+  for (size_t p = 0; p < exp->parameter_count; p++) {
+    asm_tok_t *param = &fixup->exp.parameters[p];
+    *param = exp->parameters[p];
+    param->str = arena_strndup(arena, param->str, param->len);
+  }
+
+  fixup->exp.operand = 0;
+  fixup->kinds = NULL;
+  fixup->values = NULL;
+  if (exp->type == EXP_INSTRUCTION) {
+    fixup->kinds = arena_alloc(arena, exp->parameter_count);
+    fixup->values = arena_alloc(arena, sizeof(uint32_t) * exp->parameter_count);
+    memcpy(fixup->kinds, branch->operand_kinds + exp->operand,
+           exp->parameter_count);
+    memcpy(fixup->values, branch->operand_values + exp->operand,
+           sizeof(uint32_t) * exp->parameter_count);
+  }
+
+  fixup->file = file;
+  fixup->position = st->offset;
+  fixup->size = size;
+  st->ast.stats.fixups++;
+}
+
+static err_t _stream_label(_stream_t *st, asm_tree_branch_t *branch,
+                           asm_exp_t *exp, const char *file) {
+  asm_tree_t *ast = &st->ast;
+  asm_tok_t name = exp->parameters[0];
+
+  size_t prev_position;
+  if (!idmap_put(&ast->label_map, branch->operand_values[exp->operand],
+                 st->offset, &prev_position)) {
+    char detail[256];
+    snprintf(detail, sizeof(detail),
+             "Label \"%.*s\" is already defined at $%.4zx", (int)name.len,
+             name.str, prev_position);
+    _handle_err(ast, TASM_DUPLICATE_LABEL, file, exp->line, name, detail);
+    return TASM_DUPLICATE_LABEL;
+  }
+
+  return TASM_OK;
+}
+
+/// Encodes a single expression straight to the output. Expressions which
+/// use a symbol or label that is not known yet get a placeholder.
+static err_t _stream_exp(_stream_t *st, asm_tree_branch_t *branch,
+                         asm_exp_t *exp, const char *file) {
+  asm_tree_t *ast = &st->ast;
+  if (exp->type == EXP_LABEL)
+    return _stream_label(st, branch, exp, file);
+
+  if (exp->type == EXP_DIRECTIVE && exp->directive == DIR_INCLUDE) {
+    char *path = NULL;
+    if (exp->parameter_count > 0)
+      path = strndup(exp->parameters[0].str, exp->parameters[0].len);
+    _stream_push_include(st, path, file, exp->line, exp->col, st->depth + 1);
+    return TASM_OK;
+  }
+
+  size_t count = exp->parameter_count;
+  asm_tok_t *params = arena_alloc(&branch->arena, sizeof(asm_tok_t) * count);
+  uint8_t *kinds = arena_alloc(&branch->arena, count);
+  uint32_t *values = arena_alloc(&branch->arena, sizeof(uint32_t) * count);
+  asm_tok_t *missing = NULL;
+  uint8_t resolved =
+      _stream_resolve(ast, exp, branch->operand_kinds, branch->operand_values,
+                      params, kinds, values, &missing, 0);
+
+  asm_exp_t copy = *exp;
+  copy.parameters = params;
+  copy.position = 0;
+  copy.operand = 0;
+
+  size_t size;
+  if (exp->type == EXP_DIRECTIVE) {
+    // The size has to be known right away
+    if (!resolved && exp->directive != DIR_BYTE &&
+        missing == &exp->parameters[0]) {
+      char detail[256];
+      snprintf(detail, sizeof(detail),
+               "Symbol \"%.*s\" has to be defined before it is used as a "
+               "size when streaming",
+               (int)missing->len - 1, missing->str + 1);
+      _handle_err(ast, TASM_INVALID_SYMBOL, file, exp->line, *missing,
+                  detail);
+      return TASM_INVALID_SYMBOL;
+    }
+
+    size = _dir_exp_size(copy);
+  } else {
+    size = _get_inst_size(exp->inst);
+  }
+
+  // Large fills are never held in memory
+  if (exp->type == EXP_DIRECTIVE && size > ENCODE_FILL_MIN) {
+    err_t err = TASM_OK;
+    if (resolved) {
+      err = _write_dir(&copy, &st->out);
+    } else {
+      _stream_defer(st, branch, exp, file, size);
+      writer_fill(&st->out, 0, size);
+    }
+
+    if (err != TASM_OK) {
+      _handle_err(ast, err, file, exp->line, _unknown_tok(exp->col), NULL);
+      return err;
     }
 
-    switch (params[p][0]) {
-    case TASM_CHAR_CHAR_CONT:
-      if (strlen(params[p]) != 3)
-        return TASM_INVALID_PARAMETER_FORMAT;
+    st->offset += size;
+    return TASM_OK;
+  }
+
+  uint8_t small[64];
+  uint8_t *buf = size <= sizeof(small) ? small : malloc(size);
+  err_t err = TASM_OK;
+  if (resolved)
+    err = _encode_exp(ast, &copy, kinds, values, buf,
+                      &ast->stats.label_lookups);
+
+  // Labels further down are patched in once they are known
+  if (!resolved ||
+      (err == TASM_INVALID_LABEL && exp->type == EXP_INSTRUCTION)) {
+    _stream_defer(st, branch, exp, file, size);
+    memset(buf, 0, size);
+    err = TASM_OK;
+  }
+
+  if (err == TASM_OK) {
+    writer_write(&st->out, buf, size);
+    st->offset += size;
+  } else {
+    _handle_err(ast, err, file, exp->line, _unknown_tok(exp->col), NULL);
+  }
+
+  if (buf != small)
+    free(buf);
+  return err;
+}
+
+/// Moves the symbols of a streamed line into the tree. They outlive the
+/// source of the line, so their names point to the intern table and their
+/// values are copied.
+static err_t _stream_symbols(asm_tree_t *ast, asm_tree_branch_t *branch) {
+  for (size_t i = 0; i < branch->symbol_count; i++) {
+    asm_symbol_t *symbol = &branch->symbols[i];
+    symbol->name.str = intern_str(symbol->id, NULL);
+    symbol->value.str =
+        arena_strndup(&ast->arena, symbol->value.str, symbol->value.len);
+  }
+
+  return _merge_symbols(ast, branch);
+}
+
+/// Drops the expressions and symbols of a branch which is streamed line by
+/// line, its source stays
+static void _stream_reset_branch(asm_tree_branch_t *branch) {
+  arena_reset(&branch->arena);
+  branch->exp_count = 0;
+  branch->exp_capacity = 0;
+  branch->asm_exp = NULL;
+  branch->operand_count = 0;
+  branch->operand_capacity = 0;
+  branch->operand_kinds = NULL;
+  branch->operand_values = NULL;
+  branch->symbol_count = 0;
+  branch->symbol_capacity = 0;
+  branch->symbols = NULL;
+}
+
+/// Streams a single file, its includes are queued to be streamed next
+static err_t _stream_file(_stream_t *st, _stream_include_t *inc) {
+  asm_tree_t *ast = &st->ast;
+  if (inc->path == NULL) {
+    _handle_err(ast, TASM_DIRECTIVE_MISSING_PARAMETER, inc->parent,
+                inc->line, _unknown_tok(inc->col), NULL);
+    return TASM_DIRECTIVE_MISSING_PARAMETER;
+  }
+
+  if (inc->depth >= st->chain_capacity) {
+    st->chain_capacity = inc->depth * 2 + 8;
+    st->chain_ids =
+        realloc(st->chain_ids, sizeof(uint32_t) * st->chain_capacity);
+    st->chain_files =
+        realloc(st->chain_files, sizeof(char *) * st->chain_capacity);
+  }
+
+  // The root file is taken as it is, includes are looked up
+  const char *path = inc->path;
+  uint32_t id;
+  if (inc->parent != NULL) {
+    const search_file_t *found =
+        search_find(&st->search, inc->path, strlen(inc->path));
+    path = found->path;
+    id = found->id;
+  } else {
+    id = search_canonical(&st->search, path);
+  }
+
+  if (ast->opts.include_once && !search_claim(&st->search, id))
+    return TASM_OK;
+
+  for (size_t i = 0; i < inc->depth && !ast->opts.include_once; i++) {
+    if (st->chain_ids[i] != id)
+      continue;
+
+    st->chain_files[inc->depth] = path;
+    char detail[256];
+    _cycle_detail(detail, sizeof(detail), st->chain_files + i,
+                  inc->depth - i + 1);
+    _handle_err(ast, TASM_INCLUDE_CYCLE, inc->parent, inc->line,
+                _unknown_tok(inc->col), detail);
+    return TASM_INCLUDE_CYCLE;
+  }
+
+  // Fixups and diagnostics of included files refer to the interned name
+  asm_tree_branch_t branch;
+  _init_branch(&branch, path, ast->curr_section);
+  const char *file = branch.file;
+  st->depth = inc->depth;
+  st->chain_ids[inc->depth] = id;
+  st->chain_files[inc->depth] = file;
+
+  errno = 0;
+  if (!_load_src(&ast->opts, &branch, NULL, 0)) {
+    _report_open_err(ast, file, errno);
+    branch.src = NULL;
+    branch.src_size = 0;
+    asm_free_branch(&branch);
+    return TASM_IO_ERROR;
+  }
+
+  log_inf("Parsing \"%s\"\n", file);
 
-      dest[1] = params[p][1];
+  err_t err = TASM_OK;
+  size_t first_include = st->include_count;
+  const char *src = branch.src;
+  uint32_t linenum = 0;
+  size_t pos = 0;
+  while (pos < branch.src_size) {
+    size_t len = lexer_line_len(src + pos, branch.src_size - pos);
+    linenum++;
+    branch.line_count++;
+    err = asm_parse_line(&branch, src + pos, len, linenum);
+    if (err != TASM_OK) {
+      asm_tok_t where = {.str = src + pos, .len = len, .col = 1};
+      _handle_err(ast, err, file, linenum, where, NULL);
       break;
-    case TASM_CHAR_ADDRESS_PREFIX:
-      if (strlen(params[p]) < 2)
-        return TASM_INVALID_PARAMETER_FORMAT;
-
-      size_t offset = 1;
-      if (params[p][1] == TASM_CHAR_VALUE_PREFIX)
-        offset++;
-
-      size_t len = strlen(params[p] + offset);
-      unsigned long value = 0;
-
-      char lchar = params[p][strlen(params[p] - 1)];
-      switch (lchar) {
-      case TASM_CHAR_DECIMAL_POSTFIX: {
-        char *cpy = strdup(params[p] + offset);
-        cpy[len - 1] = 0;
-        value = strtoul(params[p] + offset, NULL, 10);
-        free(cpy);
-        break;
-      }
-      case TASM_CHAR_BINARY_POSTFIX: {
-        char *cpy = strdup(params[p] + offset);
-        cpy[len - 1] = 0;
-        value = strtoul(params[p] + offset, NULL, 2);
-        free(cpy);
-        break;
-      }
-      default:
-        value = strtoul(params[p] + offset, NULL, 16);
-      }
+    }
 
-      if (params[p][1] == TASM_CHAR_VALUE_PREFIX)
-        _mod_inst_address(dest);
-      dest[1] = (value & 0xff00) >> 8;
-      dest[2] = value & 0xff;
+    if (branch.symbol_count > 0)
+      err = _stream_symbols(ast, &branch);
+    if (err == TASM_OK && branch.exp_count > 0)
+      err = _stream_exp(st, &branch, &branch.asm_exp[0], file);
+    if (err != TASM_OK)
       break;
-    case 'a':
-    case 'c':
-    case 'd':
-    case 'e':
-    case 'f':
-    case 'g':
-    case 'h':
-      if (strlen(params[p]) == 1) {
-        reg_t reg = _get_register(params[p][0]);
-        if (reg == REG_INVALID)
-          return TASM_INVALID_REGISTER;
-        _mod_inst_register(dest, reg);
-        break;
+
+    _stream_reset_branch(&branch);
+    pos += len + 1;
+  }
+
+  ast->stats.branches++;
+  ast->stats.bytes_read += branch.src_size;
+  ast->stats.lines += branch.line_count;
+  ast->stats.tokens += branch.token_count;
+  ast->stats.keyword_lookups += branch.lookup_count;
+  if (branch.section_seen)
+    ast->curr_section = branch.curr_section;
+  asm_free_branch(&branch);
+
+  // The first include has to be streamed next
+  _stream_include_t *includes = st->includes + first_include;
+  size_t count = st->include_count - first_include;
+  for (size_t i = 0; i < count / 2; i++) {
+    _stream_include_t tmp = includes[i];
+    includes[i] = includes[count - 1 - i];
+    includes[count - 1 - i] = tmp;
+  }
+
+  return err;
+}
+
+/// Encodes the fixups now that all symbols and labels are known and writes
+/// them over their placeholders
+static err_t _stream_patch(_stream_t *st) {
+  asm_tree_t *ast = &st->ast;
+  err_t err = TASM_OK;
+
+  size_t param_capacity = 0;
+  asm_tok_t *params = NULL;
+  uint8_t *kinds = NULL;
+  uint32_t *values = NULL;
+  uint8_t small[64];
+  for (size_t i = 0; i < st->fixup_count && err == TASM_OK; i++) {
+    _stream_fixup_t *fixup = &st->fixups[i];
+    asm_exp_t exp = fixup->exp;
+    if (exp.parameter_count > param_capacity) {
+      param_capacity = exp.parameter_count;
+      params = realloc(params, sizeof(asm_tok_t) * param_capacity);
+      kinds = realloc(kinds, param_capacity);
+      values = realloc(values, sizeof(uint32_t) * param_capacity);
+    }
+
+    asm_tok_t *missing;
+    if (!_stream_resolve(ast, &fixup->exp, fixup->kinds, fixup->values,
+                         params, kinds, values, &missing, 1)) {
+      // The symbol is defined if its value is what can not be evaluated
+      char detail[256];
+      uint8_t undefined = 0;
+      asm_symbol_t *symbol = _find_symbol(ast, *missing);
+      err = TASM_INVALID_SYMBOL;
+      if (symbol != NULL) {
+        err = _eval_symbol(ast, symbol, 1, 0, &undefined);
+        _eval_detail(detail, sizeof(detail), symbol);
       }
-      break;
-    default:;
-      uint16_t label_address;
-      err_t ret = _get_label_addr(ast, params[p], &label_address);
-      if (ret != TASM_OK)
-        return ret;
 
-      _mod_inst_address(dest);
-      dest[1] = (value & 0xff00) >> 8;
-      dest[2] = value % 0xff;
+      _handle_err(ast, err, fixup->file, exp.line, *missing,
+                  symbol != NULL ? detail : NULL);
       break;
     }
+
+    exp.parameters = params;
+    writer_seek(&st->out, fixup->position);
+    if (exp.type == EXP_DIRECTIVE && fixup->size > ENCODE_FILL_MIN) {
+      err = _write_dir(&exp, &st->out);
+      if (err != TASM_OK)
+        _handle_err(ast, err, fixup->file, exp.line, _unknown_tok(exp.col),
+                    NULL);
+      continue;
+    }
+
+    uint8_t *buf = fixup->size <= sizeof(small) ? small : malloc(fixup->size);
+    err = _encode_exp(ast, &exp, kinds, values, buf,
+                      &ast->stats.label_lookups);
+    if (err == TASM_OK) {
+      writer_write(&st->out, buf, fixup->size);
+    } else {
+      _handle_err(ast, err, fixup->file, exp.line, _unknown_tok(exp.col),
+                  NULL);
+    }
+
+    if (buf != small)
+      free(buf);
   }
 
-  return ret;
+  free(params);
+  free(kinds);
+  free(values);
+  return err;
 }
 
-err_t asm_translate_tree(asm_tree_t *ast, uint8_t **dest_ptr, size_t *size) {
-  err_t ret = TASM_OK;
+/// Assembles src_fl into out_fl in a single pass, see asm_opts_t.stream.
+/// The statistics of the run are written to stats.
+static err_t _stream_write_file(char *src_fl, char *out_fl, char *format,
+                                asm_opts_t *opts, asm_stats_t *stats) {
+  (void)format;
+  log_inf("Assembling \"%s\" in a single pass\n", src_fl);
+
+  _stream_t st = {0};
+  asm_init_tree(&st.ast);
+  st.ast.opts = *opts;
+  search_init(&st.search, opts->search_dirs, opts->read != NULL);
+
+  double start = _now_ms();
+  err_t err = TASM_OK;
+  uint8_t opened = writer_open(&st.out, out_fl);
+  if (!opened) {
+    log_err("Error opening \"%s\": %s\n", out_fl, strerror(errno));
+    err = TASM_IO_ERROR;
+    goto stream_write_file_cleanup;
+  }
 
-  size_t calcd_size = _precalc_size(ast);
-  log_inf("Precalculated Size: 0x%x bytes\n", calcd_size);
+  _stream_push_include(&st, strdup(src_fl), NULL, 0, 0, 0);
+  while (err == TASM_OK && st.include_count > 0) {
+    _stream_include_t inc = st.includes[--st.include_count];
+    err = _stream_file(&st, &inc);
+    free(inc.path);
+  }
+  st.ast.stats.parse_ms = _now_ms() - start;
+  st.ast.stats.symbols = st.ast.symbol_count;
+  st.ast.stats.labels = st.ast.label_map.count;
+  if (err != TASM_OK)
+    goto stream_write_file_cleanup;
+
+  log_inf("Patching %zu forward references\n", st.fixup_count);
+  double patch_start = _now_ms();
+  err = _stream_patch(&st);
+  st.ast.stats.resolve_ms = _now_ms() - patch_start;
+  st.ast.stats.bytes_emitted = st.offset;
+
+stream_write_file_cleanup:
+  for (size_t i = 0; i < st.include_count; i++)
+    free(st.includes[i].path);
+  free(st.includes);
+  free(st.fixups);
+  free(st.chain_ids);
+  free(st.chain_files);
+  search_free(&st.search);
+
+  if (opened) {
+    if (!writer_close(&st.out) && err == TASM_OK) {
+      log_err("Error writing \"%s\": %s\n", out_fl, strerror(errno));
+      err = TASM_IO_ERROR;
+    }
 
-  log_inf("Resolving label positions...\n");
-  ret = asm_resolve_labels(ast);
-  if (ret != TASM_OK)
-    return ret;
+    // A partial image must not be mistaken for a result
+    if (err != TASM_OK && st.out.regular)
+      remove(out_fl);
+  }
 
-  *dest_ptr = malloc(calcd_size);
-  size[0] = calcd_size;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  st.ast.stats.peak_rss_kb = usage.ru_maxrss;
+  st.ast.stats.total_ms = _now_ms() - start;
+  if (st.ast.opts.stats)
+    _print_stats(&st.ast.stats, src_fl, err);
+  *stats = st.ast.stats;
+  asm_free_tree(&st.ast);
 
-  log_inf("Replacing Symbol usages...\n");
-  ret = asm_replace_symbols(ast);
-  if (ret != TASM_OK)
-    return ret;
+  log_inf("Done!\n");
+  return err;
+}
 
-  log_inf("Translating tree...\n");
+//-- Objects --//
+
+/// Adds the export of a label named by an .export directive
+static err_t _export_label(asm_tree_t *ast, tef_object_t *obj,
+                           idmap_t *exported, asm_tree_branch_t *branch,
+                           asm_exp_t *exp, asm_tok_t name) {
+  uint32_t id = intern_find(name.str, name.len);
+  size_t position;
+  if (id == INTERN_NONE || !idmap_get(&ast->label_map, id, &position)) {
+    char detail[256];
+    snprintf(detail, sizeof(detail), "Exported label \"%.*s\" is not defined",
+             (int)name.len, name.str);
+    _handle_err(ast, TASM_INVALID_LABEL, branch->file, exp->line, name,
+                detail);
+    return TASM_INVALID_LABEL;
+  }
 
-  size_t wi = 0;
-  asm_tree_branch_t *branch;
-  asm_exp_t *exp;
-  for (size_t b = 0; b < ast->branch_count; b++) {
-    branch = &ast->branches[b];
+  if (idmap_put(exported, id, 0, NULL))
+    tef_add_symbol(obj, name.str, name.len, 0, position);
+  return TASM_OK;
+}
 
-    for (size_t e = 0; e < branch->exp_count; e++) {
-      exp = &branch->asm_exp[e];
-      if (exp->type != EXP_INSTRUCTION)
-        continue;
+/// Fills obj with the section, symbols and relocations of a resolved tree.
+/// Labels which are used but not defined become imports, they are added to
+/// the labels of the tree at 0 so the tree can be encoded.
+static err_t _collect_object(asm_tree_t *ast, tef_object_t *obj) {
+  if (ast->size > UINT32_MAX) {
+    log_err("Objects can hold at most 4 GiB\n");
+    return TASM_INVALID_OBJECT;
+  }
 
-      if (exp->parameter_count != _get_inst_param_count(exp->inst)) {
-        ret = TASM_INVALID_PARAMETER;
-        goto asm_translate_tree_exit;
-      }
+  err_t err = TASM_OK;
+  tef_add_section(obj, "text", ast->size);
 
-      size_t cur_size = _get_inst_size(exp->inst);
-      uint8_t *translated = malloc(cur_size);
-      translated[0] = exp->inst;
-      ret = asm_translate_parameters(ast, exp->parameters, exp->parameter_count,
-                                     translated);
+  idmap_t exported;
+  idmap_t imported;
+  idmap_init(&exported);
+  idmap_init(&imported);
+  for (size_t b = 0; b < ast->branch_count && err == TASM_OK; b++) {
+    asm_tree_branch_t *branch = &ast->branches[b];
 
-      if (ret != TASM_OK) {
-        free(translated);
-        goto asm_translate_tree_exit;
+    for (size_t e = 0; e < branch->exp_count && err == TASM_OK; e++) {
+      asm_exp_t *exp = &branch->asm_exp[e];
+      if (exp->type == EXP_DIRECTIVE && exp->directive == DIR_EXPORT) {
+        for (size_t p = 0; p < exp->parameter_count && err == TASM_OK; p++)
+          err = _export_label(ast, obj, &exported, branch, exp,
+                              exp->parameters[p]);
+        continue;
       }
 
-#ifndef DEBUG_UTILS_MUTE
-      //printf("$%.4zx ", wi);
-      for (size_t s = 0; s < cur_size; s++)
-        printf("0x%.2x, ", translated[s]);
-      printf("\n");
-#endif
+      if (exp->type != EXP_INSTRUCTION)
+        continue;
+
+      for (size_t p = 0; p < exp->parameter_count; p++) {
+        if (branch->operand_kinds[exp->operand + p] != OPERAND_LABEL)
+          continue;
+
+        // Labels named by a symbol are only interned if they are defined
+        if (branch->operand_values[exp->operand + p] == INTERN_NONE) {
+          _own_operands(branch);
+          branch->operand_values[exp->operand + p] =
+              intern(exp->parameters[p].str, exp->parameters[p].len);
+        }
+        uint32_t id = branch->operand_values[exp->operand + p];
+
+        // Operands always take up the two bytes after the opcode
+        size_t ix;
+        if (idmap_get(&ast->label_map, id, &ix)) {
+          tef_add_reloc(obj, 0, exp->position + 1, TEF_RELOC_SECTION, 0);
+          continue;
+        }
 
-      memcpy(*dest_ptr + wi, translated, cur_size);
-      free(translated);
-      wi += cur_size;
+        if (!idmap_get(&imported, id, &ix)) {
+          size_t len;
+          const char *name = intern_str(id, &len);
+          ix = tef_add_symbol(obj, name, len, TEF_UNDEFINED, 0);
+          idmap_put(&imported, id, ix, NULL);
+        }
+        tef_add_reloc(obj, 0, exp->position + 1, TEF_RELOC_SYMBOL, ix);
+      }
     }
   }
 
-asm_translate_tree_exit:
-  if (ret != TASM_OK) {
-    _handle_err(ret, branch->file, "?", exp->line);
+  for (size_t i = 0; i < obj->symbol_count && err == TASM_OK; i++) {
+    tef_symbol_t *symbol = &obj->symbols[i];
+    if (symbol->section == TEF_UNDEFINED)
+      idmap_put(&ast->label_map, intern(symbol->name, symbol->len), 0, NULL);
   }
-  return ret;
+
+  idmap_free(&exported);
+  idmap_free(&imported);
+  return err;
 }
 
-err_t asm_write_file(char *src_fl, char *out_fl, char *format) {
+/// Assembles src_fl into out_fl using the includes of share, which may be
+/// NULL. The statistics of the run are written to stats.
+static err_t _write_file(char *src_fl, char *out_fl, char *format,
+                         asm_opts_t *opts, asm_share_t *share,
+                         asm_stats_t *stats) {
+  uint8_t object = format != NULL && strcmp(format, TASM_OUT_TEF) == 0;
+  if (!object && format != NULL && strcmp(format, TASM_OUT_ROM) != 0) {
+    log_err("Unknown output format \"%s\"\n", format);
+    memset(stats, 0, sizeof(asm_stats_t));
+    return TASM_INVALID_PARAMETER;
+  }
+
+  if (opts != NULL && opts->stream && !object)
+    return _stream_write_file(src_fl, out_fl, format, opts, stats);
+
   log_inf("Assembling \"%s\"\n", src_fl);
   log_inf("Step 1: Parsing Sources\n");
   asm_tree_t ast;
-  ast.branch_count = 0;
-  ast.symbol_count = 0;
-  ast.curr_section = DIR_INVALID;
-
+  asm_init_tree(&ast);
+  if (opts != NULL)
+    ast.opts = *opts;
+  ast.share = share;
+  tef_object_t obj;
+  tef_init(&obj);
+  // Start of the image kept for running it
+  uint8_t *head = NULL;
+  size_t head_size = 0;
+
+  double start = _now_ms();
   err_t err = asm_parse_file(src_fl, &ast);
+  ast.stats.parse_ms = _now_ms() - start;
+  ast.stats.symbols = ast.symbol_count;
   if (err != TASM_OK)
-    goto asm_write_file_cleanup;
+    goto write_file_cleanup;
 
   log_inf("Step 2: Translating Parsed Sources\n");
+  err = _resolve_tree(&ast);
+  if (err == TASM_OK && object)
+    err = _collect_object(&ast, &obj);
+  if (err != TASM_OK)
+    goto write_file_cleanup;
 
-  size_t size;
-  uint8_t *bin;
-  err = asm_translate_tree(&ast, &bin, &size);
-  if (err != TASM_OK) {
-    if (size > 0)
-      free(bin);
-    goto asm_write_file_cleanup;
+  if (ast.opts.cycles)
+    _print_cycles(&ast, src_fl, stdout);
+
+  log_inf("Step 3: Writing %zu bytes to \"%s\"\n", ast.size, out_fl);
+
+  // The image is encoded piecewise straight to the file, it is never held
+  // in memory as a whole
+  double write_start = _now_ms();
+  writer_t out;
+  if (!writer_open(&out, out_fl)) {
+    log_err("Error opening \"%s\": %s\n", out_fl, strerror(errno));
+    err = TASM_IO_ERROR;
+    goto write_file_cleanup;
+  }
+
+  if (object) {
+    tef_write_header(&obj, &out);
+  } else if (ast.opts.run) {
+    head_size = ast.size < ENGINE_DEVICE_SIZE ? ast.size : ENGINE_DEVICE_SIZE;
+    head = malloc(head_size);
+    writer_capture(&out, head, head_size);
+  }
+  err = asm_encode_to(&ast, &out);
+  ast.stats.encode_ms = _now_ms() - write_start;
+  if (!writer_close(&out) && err == TASM_OK) {
+    log_err("Error writing \"%s\": %s\n", out_fl, strerror(errno));
+    err = TASM_IO_ERROR;
   }
 
-  log_inf("Step 3: Writing %d bytes to \"%s\"\n", size, out_fl);
+  // A partial image must not be mistaken for a result
+  if (err != TASM_OK && out.regular)
+    remove(out_fl);
+  ast.stats.write_ms = _now_ms() - write_start - ast.stats.encode_ms;
+  ast.stats.bytes_emitted = out.size;
 
-  FILE *out = fopen(out_fl, "w");
-  fwrite(bin, size, 1, out);
-  fclose(out);
-  free(bin);
+  if (err == TASM_OK && ast.opts.run && !object)
+    err = _run_tree(&ast, src_fl, head, head_size);
 
   log_inf("Cleaning up...\n");
-asm_write_file_cleanup:
-  debug_print_ast(ast);
-  for (int i = 0; i < ast.branch_count; i++) {
-    for (int j = 0; j < ast.branches[i].exp_count; j++) {
-      size_t param_count = ast.branches[i].asm_exp[j].parameter_count;
-      for (int k = 0; k < param_count; k++) {
-        free(ast.branches[i].asm_exp[j].parameters[k]);
-      }
+write_file_cleanup:
+  debug_print_ast(&ast);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  ast.stats.peak_rss_kb = usage.ru_maxrss;
+  ast.stats.total_ms = _now_ms() - start;
+  if (ast.opts.stats)
+    _print_stats(&ast.stats, src_fl, err);
+  *stats = ast.stats;
+  asm_free_tree(&ast);
+  tef_free(&obj);
+  free(head);
 
-      free(ast.branches[i].asm_exp[j].parameters);
-    }
+  log_inf("Done!\n");
+  return err;
+}
+
+err_t asm_assemble(char *name, const char *src, size_t src_size,
+                   asm_opts_t *opts, uint8_t **dest, size_t *size) {
+  // Nothing is logged once diagnostics have somewhere else to go
+  uint8_t muted = log_mute(opts != NULL && opts->diag != NULL ? LOG_MUTE_ALL
+                                                               : LOG_MUTE_INFO);
+  asm_tree_t ast;
+  asm_init_tree(&ast);
+  if (opts != NULL)
+    ast.opts = *opts;
 
-    free(ast.branches[i].asm_exp);
+  err_t err = asm_parse_buffer(name, src, src_size, &ast);
+  if (err != TASM_OK)
+    goto assemble_cleanup;
+
+  if (ast.opts.optimize)
+    asm_optimize(&ast);
+
+  err = asm_resolve_labels(&ast);
+  if (err != TASM_OK)
+    goto assemble_cleanup;
+
+  err = asm_replace_symbols(&ast);
+  if (err != TASM_OK)
+    goto assemble_cleanup;
+
+  if (*dest != NULL && *size < ast.size) {
+    *size = ast.size;
+    err = TASM_BUFFER_TOO_SMALL;
+    goto assemble_cleanup;
   }
 
-  for (int i = 0; i < ast.symbol_count; i++) {
-    free(ast.symbols[i].name);
-    free(ast.symbols[i].value);
+  uint8_t *out = *dest != NULL ? *dest : malloc(ast.size);
+  err = asm_encode_into(&ast, out);
+  if (err != TASM_OK) {
+    if (out != *dest)
+      free(out);
+    goto assemble_cleanup;
   }
-  if (ast.symbol_count > 0)
-    free(ast.symbols);
-  free(ast.branches);
 
-  log_inf("Done!\n");
+  *dest = out;
+  *size = ast.size;
+
+assemble_cleanup:
+  asm_free_tree(&ast);
+  log_mute(muted);
   return err;
 }
 
+err_t asm_write_file(char *src_fl, char *out_fl, char *format,
+                     asm_opts_t *opts) {
+  asm_stats_t stats;
+  return _write_file(src_fl, out_fl, format, opts, NULL, &stats);
+}
+
+void asm_share_init(asm_share_t *share, const asm_opts_t *opts) {
+  pthread_mutex_init(&share->lock, NULL);
+  pthread_cond_init(&share->ready_cond, NULL);
+  share->opts = opts;
+  share->persistent = 0;
+  share->entry_count = 0;
+  share->entry_capacity = 0;
+  share->entries = NULL;
+  strmap_init(&share->map);
+  share->retired_count = 0;
+  share->retired_capacity = 0;
+  share->retired = NULL;
+  share->tree_count = 0;
+  share->tree_capacity = 0;
+  share->trees = NULL;
+  strmap_init(&share->tree_map);
+  share->retired_tree_count = 0;
+  share->retired_tree_capacity = 0;
+  share->retired_trees = NULL;
+  share->hits = 0;
+  share->refreshes = 0;
+}
+
+void asm_share_free(asm_share_t *share) {
+  asm_share_sweep(share);
+  for (size_t i = 0; i < share->entry_count; i++)
+    _free_share_entry(share->entries[i]);
+
+  for (size_t i = 0; i < share->tree_count; i++)
+    _free_share_tree(share->trees[i]);
+
+  free(share->entries);
+  free(share->retired);
+  free(share->trees);
+  free(share->retired_trees);
+  strmap_free(&share->map);
+  strmap_free(&share->tree_map);
+  pthread_cond_destroy(&share->ready_cond);
+  pthread_mutex_destroy(&share->lock);
+}
+
+void asm_share_sweep(asm_share_t *share) {
+  pthread_mutex_lock(&share->lock);
+
+  // Trees pointing to retired entries are replaced by empty ones, which
+  // only keep the key and the size of the tree
+  for (size_t t = 0; t < share->tree_count && share->retired_count > 0; t++) {
+    asm_share_tree_t *tree = share->trees[t];
+    for (size_t i = 0; i < tree->entry_count; i++) {
+      if (!tree->entries[i]->retired)
+        continue;
+
+      asm_share_tree_t *empty = calloc(1, sizeof(asm_share_tree_t));
+      empty->key = tree->key;
+      empty->key_len = tree->key_len;
+      empty->symbol_count = tree->symbol_count;
+      tree->key = NULL;
+      share->trees[t] = empty;
+      _free_share_tree(tree);
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < share->retired_tree_count; i++)
+    _free_share_tree(share->retired_trees[i]);
+  share->retired_tree_count = 0;
+
+  for (size_t i = 0; i < share->retired_count; i++)
+    _free_share_entry(share->retired[i]);
+  share->retired_count = 0;
+  pthread_mutex_unlock(&share->lock);
+}
+
+err_t asm_write_job(asm_batch_job_t *job, asm_opts_t *opts,
+                    asm_share_t *share) {
+  job->err = _write_file(job->in, job->out, job->format, opts, share,
+                         &job->stats);
+  return job->err;
+}
+
+typedef struct _batch_task_t {
+  pool_task_t task;
+  asm_batch_job_t *job;
+  asm_opts_t *opts;
+  asm_share_t *share;
+} _batch_task_t;
+
+static void _run_batch_task(void *arg) {
+  _batch_task_t *task = arg;
+  asm_batch_job_t *job = task->job;
+
+  // Only the status of the job is reported, warnings and errors still show
+  // up with their location
+  uint8_t muted = log_mute(LOG_MUTE_INFO);
+  asm_write_job(job, task->opts, task->share);
+  log_mute(muted);
+}
+
+err_t asm_write_batch(asm_batch_job_t *jobs, size_t count, asm_opts_t *opts,
+                      asm_share_t *share) {
+  // The jobs run in parallel, each of them assembles on a single thread
+  asm_opts_t job_opts;
+  asm_init_opts(&job_opts);
+  if (opts != NULL)
+    job_opts = *opts;
+  size_t thread_count = job_opts.jobs;
+  job_opts.jobs = 1;
+
+  log_inf("Assembling %zu files\n", count);
+  asm_share_t batch_share;
+  if (share == NULL) {
+    asm_share_init(&batch_share, &job_opts);
+    share = &batch_share;
+  }
+
+  pool_t pool;
+  if (thread_count > 1)
+    pool_init(&pool, thread_count);
+
+  _batch_task_t *tasks = calloc(count, sizeof(_batch_task_t));
+  for (size_t i = 0; i < count; i++) {
+    tasks[i].job = &jobs[i];
+    tasks[i].opts = &job_opts;
+    tasks[i].share = share;
+    if (thread_count > 1)
+      pool_submit(&pool, &tasks[i].task, _run_batch_task, &tasks[i]);
+    else
+      _run_batch_task(&tasks[i]);
+  }
+
+  err_t ret = TASM_OK;
+  size_t failed = 0;
+  for (size_t i = 0; i < count; i++) {
+    asm_batch_job_t *job = &jobs[i];
+    if (thread_count > 1)
+      pool_wait(&pool, &tasks[i].task);
+
+    if (job->err != TASM_OK) {
+      log_err("%s: %s\n", job->in, asm_errname(job->err));
+      if (ret == TASM_OK)
+        ret = job->err;
+      failed++;
+      continue;
+    }
+
+    log_inf("%s -> %s: %zu bytes in %.2f ms\n", job->in, job->out,
+            job->stats.bytes_emitted, job->stats.total_ms);
+  }
+
+  if (thread_count > 1)
+    pool_destroy(&pool);
+
+  log_inf("Assembled %zu of %zu files, %zu include files shared\n",
+          count - failed, count, share->entry_count);
+  free(tasks);
+  if (share == &batch_share)
+    asm_share_free(&batch_share);
+  return ret;
+}
+
 //-- Utilities --//
 
+/// Folds an ASCII letter to lowercase, leaving other characters untouched
+static inline char _fold(char c) {
+  return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+/// Compares len characters of str case-insensitively against the lowercase
+/// table name
+static uint8_t _keyword_eq(const char *str, const char *name, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (_fold(str[i]) != name[i])
+      return 0;
+  }
+
+  return name[len] == 0;
+}
+
 struct directive_elem_t {
   char *name;
   directive_t directive;
 };
 
-const uint32_t DIRECTIVE_COUNT = 7;
+#define DIRECTIVE_COUNT 9
 static struct directive_elem_t directives[DIRECTIVE_COUNT] = {
     {.name = "inc", .directive = DIR_INCLUDE},
     {.name = "nullpadding", .directive = DIR_NULLPAD},
@@ -731,69 +4253,129 @@ static struct directive_elem_t directives[DIRECTIVE_COUNT] = {
     {.name = "padding", .directive = DIR_PADDING},
     {.name = "text", .directive = DIR_TEXT},
     {.name = "symbols", .directive = DIR_SYMBOLS},
+    {.name = "export", .directive = DIR_EXPORT},
+    {.name = "assert", .directive = DIR_ASSERT},
 };
 
-directive_t get_dir(char *str) {
-  if (str == NULL)
+directive_t get_dir(const char *str, size_t len) {
+  if (str == NULL || len == 0)
     return DIR_INVALID;
-  char *lower = str_lower(str);
 
-  directive_t dir = DIR_INVALID;
-  for (int i = 0; i < DIRECTIVE_COUNT; i++) {
-    if (strcmp(directives[i].name, str) == 0) {
-      dir = directives[i].directive;
-      break;
-    }
+  // Length and first character select the only possible candidate, which
+  // is then verified against the table
+  int ix = -1;
+  switch (len) {
+  case 3:
+    ix = 0;
+    break;
+  case 4:
+    ix = _fold(str[0]) == 'b' ? 2 : 5;
+    break;
+  case 5:
+    ix = 3;
+    break;
+  case 6:
+    ix = _fold(str[0]) == 'a' ? 8 : 7;
+    break;
+  case 7:
+    ix = _fold(str[0]) == 'p' ? 4 : 6;
+    break;
+  case 11:
+    ix = 1;
+    break;
+  default:
+    return DIR_INVALID;
   }
 
-  free(lower);
-  return dir;
-}
+  if (!_keyword_eq(str, directives[ix].name, len))
+    return DIR_INVALID;
 
-struct inst_elem_t {
-  char *name;
-  inst_t inst;
-};
+  return directives[ix].directive;
+}
 
 inst_descriptor_t inst_descriptors[INST_COUNT] = {
-    {.name = "ld", .inst = INST_LD, .size = 3, .param_count = 2},
-    {.name = "st", .inst = INST_ST, .size = 3, .param_count = 2},
-    {.name = "brn", .inst = INST_BRN, .size = 3, .param_count = 1},
-    {.name = "beq", .inst = INST_BEQ, .size = 3, .param_count = 1},
-    {.name = "bne", .inst = INST_BNE, .size = 3, .param_count = 1},
-    {.name = "cmp", .inst = INST_CMP, .size = 3, .param_count = 1},
-    {.name = "cal", .inst = INST_CAL, .size = 3, .param_count = 1},
-    {.name = "rts", .inst = INST_RTS, .size = 1, .param_count = 0},
-    {.name = "rti", .inst = INST_RTI, .size = 1, .param_count = 0},
-    {.name = "int", .inst = INST_INT, .size = 1, .param_count = 0},
-    {.name = "din", .inst = INST_DIN, .size = 1, .param_count = 0},
-    {.name = "ein", .inst = INST_EIN, .size = 1, .param_count = 0},
-    {.name = "or", .inst = INST_OR, .size = 4, .param_count = 2},
-    {.name = "and", .inst = INST_AND, .size = 4, .param_count = 2},
-    {.name = "inc", .inst = INST_INC, .size = 4, .param_count = 2},
-    {.name = "dec", .inst = INST_DEC, .size = 4, .param_count = 2},
-    {.name = "add", .inst = INST_ADD, .size = 4, .param_count = 2},
-    {.name = "sub", .inst = INST_SUB, .size = 4, .param_count = 2},
-    {.name = "shr", .inst = INST_SHR, .size = 4, .param_count = 2},
-    {.name = "shl", .inst = INST_SHL, .size = 4, .param_count = 2},
-    {.name = "nop", .inst = INST_NOP, .size = 1, .param_count = 0},
+    {.name = "ld", .inst = INST_LD, .size = 3, .param_count = 2, .cycles = 4},
+    {.name = "st", .inst = INST_ST, .size = 3, .param_count = 2, .cycles = 4},
+    {.name = "brn", .inst = INST_BRN, .size = 3, .param_count = 1, .cycles = 4},
+    {.name = "beq", .inst = INST_BEQ, .size = 3, .param_count = 1, .cycles = 4},
+    {.name = "bne", .inst = INST_BNE, .size = 3, .param_count = 1, .cycles = 4},
+    {.name = "cmp", .inst = INST_CMP, .size = 3, .param_count = 1, .cycles = 4},
+    {.name = "cal", .inst = INST_CAL, .size = 3, .param_count = 1, .cycles = 6},
+    {.name = "rts", .inst = INST_RTS, .size = 1, .param_count = 0, .cycles = 4},
+    {.name = "rti", .inst = INST_RTI, .size = 1, .param_count = 0, .cycles = 5},
+    {.name = "int", .inst = INST_INT, .size = 1, .param_count = 0, .cycles = 6},
+    {.name = "din", .inst = INST_DIN, .size = 1, .param_count = 0, .cycles = 1},
+    {.name = "ein", .inst = INST_EIN, .size = 1, .param_count = 0, .cycles = 1},
+    {.name = "or", .inst = INST_OR, .size = 4, .param_count = 2, .cycles = 5},
+    {.name = "and", .inst = INST_AND, .size = 4, .param_count = 2, .cycles = 5},
+    {.name = "inc", .inst = INST_INC, .size = 4, .param_count = 2, .cycles = 5},
+    {.name = "dec", .inst = INST_DEC, .size = 4, .param_count = 2, .cycles = 5},
+    {.name = "add", .inst = INST_ADD, .size = 4, .param_count = 2, .cycles = 5},
+    {.name = "sub", .inst = INST_SUB, .size = 4, .param_count = 2, .cycles = 5},
+    {.name = "shr", .inst = INST_SHR, .size = 4, .param_count = 2, .cycles = 5},
+    {.name = "shl", .inst = INST_SHL, .size = 4, .param_count = 2, .cycles = 5},
+    {.name = "nop", .inst = INST_NOP, .size = 1, .param_count = 0, .cycles = 1},
 };
 
-inst_t get_inst(char *str) {
-  if (str == NULL)
+/// Packs a mnemonic of up to three characters into a switchable key
+#define MNEMONIC_KEY(a, b, c)                                                  \
+  ((uint32_t)(uint8_t)(a) | (uint32_t)(uint8_t)(b) << 8 |                      \
+   (uint32_t)(uint8_t)(c) << 16)
+
+inst_t get_inst(const char *str, size_t len) {
+  if (str == NULL || len < 2 || len > 3)
     return INST_INVALID;
-  char *lower = str_lower(str);
 
-  inst_t inst = INST_INVALID;
-  for (int i = 0; i < INST_COUNT; i++) {
-    if (strcmp(inst_descriptors[i].name, lower) == 0) {
-      inst = inst_descriptors[i].inst;
-      break;
-    }
+  // Every mnemonic fits into the key, so matching it is an exact compare.
+  // Keep this in sync with inst_descriptors.
+  uint32_t key = MNEMONIC_KEY(_fold(str[0]), _fold(str[1]),
+                              len == 3 ? _fold(str[2]) : 0);
+  switch (key) {
+  case MNEMONIC_KEY('l', 'd', 0):
+    return INST_LD;
+  case MNEMONIC_KEY('s', 't', 0):
+    return INST_ST;
+  case MNEMONIC_KEY('b', 'r', 'n'):
+    return INST_BRN;
+  case MNEMONIC_KEY('b', 'e', 'q'):
+    return INST_BEQ;
+  case MNEMONIC_KEY('b', 'n', 'e'):
+    return INST_BNE;
+  case MNEMONIC_KEY('c', 'm', 'p'):
+    return INST_CMP;
+  case MNEMONIC_KEY('c', 'a', 'l'):
+    return INST_CAL;
+  case MNEMONIC_KEY('r', 't', 's'):
+    return INST_RTS;
+  case MNEMONIC_KEY('r', 't', 'i'):
+    return INST_RTI;
+  case MNEMONIC_KEY('i', 'n', 't'):
+    return INST_INT;
+  case MNEMONIC_KEY('d', 'i', 'n'):
+    return INST_DIN;
+  case MNEMONIC_KEY('e', 'i', 'n'):
+    return INST_EIN;
+  case MNEMONIC_KEY('o', 'r', 0):
+    return INST_OR;
+  case MNEMONIC_KEY('a', 'n', 'd'):
+    return INST_AND;
+  case MNEMONIC_KEY('i', 'n', 'c'):
+    return INST_INC;
+  case MNEMONIC_KEY('d', 'e', 'c'):
+    return INST_DEC;
+  case MNEMONIC_KEY('a', 'd', 'd'):
+    return INST_ADD;
+  case MNEMONIC_KEY('s', 'u', 'b'):
+    return INST_SUB;
+  case MNEMONIC_KEY('s', 'h', 'r'):
+    return INST_SHR;
+  case MNEMONIC_KEY('s', 'h', 'l'):
+    return INST_SHL;
+  case MNEMONIC_KEY('n', 'o', 'p'):
+    return INST_NOP;
+  default:
+    return INST_INVALID;
   }
-
-  free(lower);
-  return inst;
 }
 
 char *asm_errname(err_t err) {
@@ -822,6 +4404,22 @@ char *asm_errname(err_t err) {
     return "Invalid Symbol / Could Not Resolve";
   case TASM_INVALID_LABEL:
     return "Invalid Label";
+  case TASM_DUPLICATE_SYMBOL:
+    return "Duplicate Symbol Definition";
+  case TASM_DUPLICATE_LABEL:
+    return "Duplicate Label Definition";
+  case TASM_IO_ERROR:
+    return "Could not read file";
+  case TASM_BUFFER_TOO_SMALL:
+    return "Output buffer too small";
+  case TASM_INVALID_OBJECT:
+    return "Invalid object file";
+  case TASM_INCLUDE_CYCLE:
+    return "File includes itself";
+  case TASM_ASSERTION_FAILED:
+    return "Assertion failed";
+  case TASM_EXECUTION_FAILED:
+    return "Execution failed";
   default:
     return "Unknown Error";
   }
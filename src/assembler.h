@@ -7,9 +7,18 @@
 #ifndef ASSEMBLER_H
 #define ASSEMBLER_H
 
+#include <arena.h>
+#include <idmap.h>
+#include <lexer.h>
+#include <pool.h>
+#include <strmap.h>
+#include <writer.h>
+
 #include <stddef.h>
 #include <stdint.h>
 
+#define TASM_VERSION "0.1.0"
+
 #define TASM_OUT_ROM "rom"
 #define TASM_OUT_TEF "tef"
 
@@ -26,6 +35,14 @@ typedef enum err_t {
   TASM_INVALID_REGISTER,
   TASM_INVALID_SYMBOL,
   TASM_INVALID_LABEL,
+  TASM_DUPLICATE_SYMBOL,
+  TASM_DUPLICATE_LABEL,
+  TASM_IO_ERROR,
+  TASM_BUFFER_TOO_SMALL,
+  TASM_INVALID_OBJECT,
+  TASM_INCLUDE_CYCLE,
+  TASM_ASSERTION_FAILED,
+  TASM_EXECUTION_FAILED,
 } err_t;
 
 //-- Assembly Keywords / Tokens / Values --//
@@ -52,6 +69,8 @@ typedef enum directive_t {
   DIR_PADDING,
   DIR_TEXT,
   DIR_SYMBOLS,
+  DIR_EXPORT,
+  DIR_ASSERT,
 } directive_t;
 
 typedef enum inst_t {
@@ -94,6 +113,9 @@ typedef struct inst_descriptor_t {
   inst_t inst;
   size_t size;
   size_t param_count;
+  /// Estimated cycles the cpu takes to execute the instruction, fetching
+  /// it included, called subroutines not
+  size_t cycles;
   char *name;
 } inst_descriptor_t;
 
@@ -109,70 +131,436 @@ typedef enum exp_type_t {
   EXP_LABEL = 2,
 } exp_type_t;
 
+/// What a parameter means as an operand of an instruction. Parameters are
+/// decoded once while parsing, encoding only looks at the decoded form.
+typedef enum operand_kind_t {
+  OPERAND_NONE = 0,
+  /// Empty string, skipped with a warning
+  OPERAND_EMPTY,
+  /// The value is a reg_t
+  OPERAND_REGISTER,
+  /// Immediate value ($#)
+  OPERAND_VALUE,
+  /// Address ($)
+  OPERAND_ADDRESS,
+  /// Character literal, the value is the character
+  OPERAND_CHAR,
+  /// Label, the value is the interned name
+  OPERAND_LABEL,
+  /// Symbol usage replaced by asm_replace_symbols, the value is the
+  /// interned name without the prefix
+  OPERAND_SYMBOL,
+  /// Longer word starting with a register name, which is not encoded
+  OPERAND_IGNORED,
+  /// Symbol value which is a constant expression or names another symbol,
+  /// replaced by its result once all symbols are known
+  OPERAND_EXPR,
+  /// Malformed parameter, the value is the err_t
+  OPERAND_INVALID,
+} operand_kind_t;
+
 typedef struct asm_symbol_t {
-  char *name;
-  char *value;
+  asm_tok_t name;
+  asm_tok_t value;
+  uint32_t line;
+  /// Interned name
+  uint32_t id;
+  /// The value decoded as an operand, names of labels and symbols are not
+  /// interned. Constant expressions hold their evaluation state until they
+  /// are replaced by their result.
+  uint32_t operand;
+  uint8_t kind;
 } asm_symbol_t;
 
 /// An expression (line) of theft assembly
 typedef struct asm_exp_t {
   uint32_t line;
+  uint16_t col;
   exp_type_t type;
   inst_t inst;
   directive_t directive;
+  /// Index of the first operand of an instruction in its branch. The name
+  /// of a label is its only operand.
+  uint32_t operand;
   size_t parameter_count;
-  size_t lbl_position;
-  char **parameters;
+  /// Offset of the expression in the output, set by asm_resolve_labels
+  size_t position;
+  asm_tok_t *parameters;
 } asm_exp_t;
 
-/// A branch (file) of a assembly
+/// A branch (file) of a assembly. Branches are parsed independently of each
+/// other and own all of their memory.
 typedef struct asm_tree_branch_t {
+  /// Owns the expressions, parameters, symbols and copied strings
+  arena_t arena;
   size_t exp_count;
+  size_t exp_capacity;
   asm_exp_t *asm_exp;
-  char *file;
+  /// Interned name of the file
+  const char *file;
+  /// Mapping of the source file, tokens of this branch point into it
+  const char *src;
+  size_t src_size;
+  /// The source is not owned by the branch. It belongs to an asm_share_t
+  /// or was provided by the caller.
+  uint8_t borrowed;
+  /// Parameters of the instructions decoded as operands, kept apart from
+  /// the tokens so encoding walks two flat arrays
+  size_t operand_count;
+  size_t operand_capacity;
+  uint8_t *operand_kinds;
+  uint32_t *operand_values;
+  /// The operands belong to the branch this one was cloned from
+  uint8_t operands_borrowed;
+  /// Symbols defined in this file in order of definition
+  size_t symbol_count;
+  size_t symbol_capacity;
+  asm_symbol_t *symbols;
+  /// Section the file was parsed with and the section the parser is in
+  directive_t entry_section;
+  directive_t curr_section;
+  uint8_t section_seen;
+  /// Set if a line was parsed before the first section directive, so the
+  /// result depends on entry_section
+  uint8_t section_dependent;
+  /// Work done parsing the branch, zero if it was loaded from the cache
+  size_t line_count;
+  size_t token_count;
+  size_t lookup_count;
+  uint8_t cached;
+  /// Parse error, reported when the branch is added to the tree
+  err_t err;
+  int err_errno;
+  uint32_t err_line;
+  asm_tok_t err_where;
 } asm_tree_branch_t;
 
+/// A diagnostic of a failed assembly
+typedef struct asm_diag_t {
+  err_t err;
+  const char *file;
+  uint32_t line;
+  uint16_t col;
+  /// Source text the diagnostic refers to, not terminated
+  const char *where;
+  size_t where_len;
+  /// Further explanation, NULL if there is none
+  const char *detail;
+} asm_diag_t;
+
+/// Provides the contents of the file at path. The buffer has to stay valid
+/// until the assembly is done. Returns 0 with errno set if the file can not
+/// be read.
+typedef uint8_t (*asm_read_fn)(void *user, const char *path, const char **src,
+                               size_t *size);
+
+/// Receives a diagnostic, which is only valid during the call
+typedef void (*asm_diag_fn)(void *user, const asm_diag_t *diag);
+
+/// Options of an assembly run
+typedef struct asm_opts_t {
+  /// Number of worker threads, 1 does everything on the calling thread
+  size_t jobs;
+  /// Directory holding parsed files across runs, NULL disables the cache
+  const char *cache_dir;
+  /// Print the statistics of the run once it is done
+  uint8_t stats;
+  /// Reads source files instead of mapping them, NULL to use the disk
+  asm_read_fn read;
+  /// Receives diagnostics instead of the log, NULL to log them
+  asm_diag_fn diag;
+  /// Passed to read and diag
+  void *user;
+  /// Assemble files in a single pass, encoding every line as soon as it is
+  /// read instead of building a tree. Symbols and labels used before their
+  /// definition are patched into the output at the end. Only used when
+  /// writing ROMs, share and cache_dir are ignored.
+  uint8_t stream;
+  /// Directories searched for included files which are not found relative
+  /// to the working directory, separated by ':'. NULL to search nowhere
+  /// else. Not used for files provided through read.
+  const char *search_dirs;
+  /// Include every file only once, later includes of a file are left out.
+  /// Otherwise a file including itself is an error.
+  uint8_t include_once;
+  /// Remove redundant instructions before labels are resolved, see
+  /// asm_optimize. Not used when streaming.
+  uint8_t optimize;
+  /// Print the estimated cycles of every instruction and label to stdout
+  /// once labels are resolved. Not used when streaming.
+  uint8_t cycles;
+  /// Run ROMs once they are written and check their .assert directives, see
+  /// engine.h. Not used when streaming or for objects.
+  uint8_t run;
+} asm_opts_t;
+
+/// Counters of an assembly run. They are always collected, the phases of
+/// asm_write_file only fill in the parts they run.
+typedef struct asm_stats_t {
+  /// Wall time per phase in milliseconds
+  double parse_ms;
+  double resolve_ms;
+  double replace_ms;
+  double encode_ms;
+  double write_ms;
+  double total_ms;
+  /// Source processed, cached branches are not lexed
+  size_t bytes_read;
+  size_t lines;
+  size_t tokens;
+  size_t branches;
+  size_t cached_branches;
+  /// Branches parsed again because their section was guessed wrong
+  size_t reparsed_branches;
+  size_t symbols;
+  size_t labels;
+  /// Mnemonic and directive lookups while parsing
+  size_t keyword_lookups;
+  size_t symbol_lookups;
+  size_t label_lookups;
+  /// Expressions patched at the end of a streaming run
+  size_t fixups;
+  /// Instructions and bytes left out by asm_optimize
+  size_t removed_insts;
+  size_t removed_bytes;
+  size_t bytes_emitted;
+  /// Peak resident set size of the process in KiB
+  size_t peak_rss_kb;
+} asm_stats_t;
+
+/// A parsed include file held by an asm_share_t
+typedef struct asm_share_entry_t {
+  /// Resolved path, prefixed with the section kind the file is parsed in
+  char *key;
+  /// Set once branch is parsed, it is never modified afterwards
+  uint8_t ready;
+  /// Set once a newer entry replaced this one
+  uint8_t retired;
+  asm_tree_branch_t branch;
+  /// Copy of the file read by persistent stores, which must not map files
+  /// that can be truncated while they are in use
+  char *data;
+  /// State of the file when it was read, only kept by persistent stores
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime_ns;
+  uint64_t hash;
+} asm_share_entry_t;
+
+/// Merged symbols of a root file parsed through a persistent store. They
+/// are reused as long as none of the files of the tree changed.
+typedef struct asm_share_tree_t {
+  /// Working directory and root file, includes are relative to the former
+  char *key;
+  size_t key_len;
+  /// Entries of the branches in tree order and the interned names they were
+  /// used by
+  size_t entry_count;
+  asm_share_entry_t **entries;
+  const char **files;
+  directive_t curr_section;
+  size_t symbol_count;
+  asm_symbol_t *symbols;
+  idmap_t symbol_map;
+  /// Values of the symbols which were computed, see TOK_COMPUTED
+  arena_t values;
+} asm_share_tree_t;
+
+/// Include files parsed once and shared by the trees of a batch. Trees get
+/// their own copy of the expressions, which they modify, while the source
+/// and the strings stay with the store.
+typedef struct asm_share_t {
+  pthread_mutex_t lock;
+  /// Broadcast whenever an entry becomes ready
+  pthread_cond_t ready_cond;
+  const asm_opts_t *opts;
+  /// The store outlives single assemblies. Entries are checked against
+  /// their file before every use and root files are kept as well.
+  uint8_t persistent;
+  size_t entry_count;
+  size_t entry_capacity;
+  asm_share_entry_t **entries;
+  /// Maps entry keys to their index in entries
+  strmap_t map;
+  /// Outdated entries, trees may still point into them until
+  /// asm_share_sweep is called
+  size_t retired_count;
+  size_t retired_capacity;
+  asm_share_entry_t **retired;
+  /// Trees of persistent stores by their key, outdated ones are kept until
+  /// asm_share_sweep like entries
+  size_t tree_count;
+  size_t tree_capacity;
+  asm_share_tree_t **trees;
+  strmap_t tree_map;
+  size_t retired_tree_count;
+  size_t retired_tree_capacity;
+  asm_share_tree_t **retired_trees;
+  /// Uses of an entry and entries parsed again since the store was created
+  size_t hits;
+  size_t refreshes;
+} asm_share_t;
+
+/// A single assembly of a batch
+typedef struct asm_batch_job_t {
+  char *in;
+  char *out;
+  char *format;
+  /// Outcome, set by asm_write_batch
+  err_t err;
+  asm_stats_t stats;
+} asm_batch_job_t;
+
 /// The tree of the assembly. Here branch 0 represents
 /// the entry file
 typedef struct asm_tree_t {
+  /// Owns the branch and symbol arrays
+  arena_t arena;
+  asm_opts_t opts;
+  /// Worker threads, created on demand if opts.jobs > 1
+  pool_t *pool;
+  /// Store of parsed includes shared with other trees, NULL if there is none
+  asm_share_t *share;
+  /// Store of a tree without share, so a file included many times is only
+  /// parsed once. Its branches borrow from it until the tree is freed.
+  asm_share_t *run_share;
+  /// Section at the end of the most recently added branch
   directive_t curr_section;
   size_t branch_count;
+  size_t branch_capacity;
   asm_tree_branch_t *branches;
+  /// Symbols of all branches
   size_t symbol_count;
+  size_t symbol_capacity;
   asm_symbol_t *symbols;
+  /// Maps interned symbol names to their index in symbols
+  idmap_t symbol_map;
+  /// symbols and symbol_map belong to the store
+  uint8_t symbols_borrowed;
+  /// Maps interned label names to their address, built by
+  /// asm_resolve_labels
+  idmap_t label_map;
+  /// Size of the output, set by asm_resolve_labels
+  size_t size;
+  asm_stats_t stats;
 } asm_tree_t;
 
 //-- Functions --//
 
 //- Assembling Functions -//
 
-err_t asm_parse_exp(asm_tree_t *ast, char *keyword, size_t param_count,
-                    char **params, uint32_t line);
+/// Sets opts to the defaults: one job, no cache, files read from disk and
+/// diagnostics logged
+void asm_init_opts(asm_opts_t *opts);
+
+void asm_init_tree(asm_tree_t *ast);
+
+void asm_free_tree(asm_tree_t *ast);
+
+void asm_free_branch(asm_tree_branch_t *branch);
 
-err_t asm_parse_line(asm_tree_t *ast, char *line, uint32_t line_num);
+err_t asm_parse_symbol(asm_tree_branch_t *branch, asm_tok_t name,
+                       size_t word_count, asm_tok_t *words, uint32_t line);
 
+err_t asm_parse_exp(asm_tree_branch_t *branch, asm_tok_t keyword,
+                    size_t param_count, asm_tok_t *params, uint32_t line);
+
+/// Parses a single line of source text, the line does not need to be
+/// terminated and must stay mapped for the lifetime of the branch.
+err_t asm_parse_line(asm_tree_branch_t *branch, const char *line, size_t len,
+                     uint32_t line_num);
+
+/// Parses a single file into branch, starting in the given section. Its
+/// includes are not followed. Errors are also recorded in the branch.
+err_t asm_parse_branch(char *src_fl, directive_t section,
+                       asm_tree_branch_t *branch);
+
+/// Parses the source in src and everything it includes into the tree. name
+/// is used in diagnostics, src has to stay valid as long as the tree.
+err_t asm_parse_buffer(char *name, const char *src, size_t size,
+                       asm_tree_t *ast);
+
+/// Parses a file and everything it includes into the tree. With
+/// opts.jobs > 1 included files are parsed concurrently, the resulting
+/// tree is the same as when parsing serially.
 err_t asm_parse_file(char *src_fl, asm_tree_t *ast);
 
+/// Leaves out instructions of a parsed tree which do not change what the
+/// program does: a nop right after another, a branch to the next
+/// instruction, and loads of the immediate value or label a register
+/// already holds. Nothing is assumed across labels. Has to run before
+/// asm_resolve_labels.
+void asm_optimize(asm_tree_t *ast);
+
 err_t asm_resolve_labels(asm_tree_t *ast);
 
 err_t asm_replace_symbols(asm_tree_t *ast);
 
-err_t asm_translate_parameters(asm_tree_t *ast, char **params, size_t count,
-                               uint8_t *dest);
+err_t asm_translate_parameters(asm_tree_t *ast, asm_tok_t *params,
+                               size_t count, uint8_t *dest);
 
+/// Encodes a tree whose labels and symbols have already been resolved into
+/// a newly allocated image
+err_t asm_encode_tree(asm_tree_t *ast, uint8_t **dest_ptr, size_t *size);
+
+/// Encodes a resolved tree into dest, which has to hold ast->size bytes
+err_t asm_encode_into(asm_tree_t *ast, uint8_t *dest);
+
+/// Encodes a resolved tree to out a window at a time, so the memory used
+/// does not depend on the size of the image. Large .padding and
+/// .nullpadding directives are filled in by the writer directly.
+err_t asm_encode_to(asm_tree_t *ast, writer_t *out);
+
+/// Resolves labels and symbols of the tree and encodes it
 err_t asm_translate_tree(asm_tree_t *ast, uint8_t **dest_ptr, size_t *size);
 
-err_t asm_write_file(char *src_fl, char *out_fl, char *format);
+/// Creates an empty store, its includes are parsed with opts
+void asm_share_init(asm_share_t *share, const asm_opts_t *opts);
+
+void asm_share_free(asm_share_t *share);
+
+/// Frees the retired entries of a persistent store. No tree built from the
+/// store may be alive.
+void asm_share_sweep(asm_share_t *share);
+
+/// Assembles a single job like asm_write_file, taking files from share
+err_t asm_write_job(asm_batch_job_t *job, asm_opts_t *opts,
+                    asm_share_t *share);
+
+/// Assembles all jobs, opts.jobs of them at a time. Includes are parsed
+/// only once for the whole batch, or taken from share if it is not NULL.
+/// Every job gets its own status, the first error is returned.
+err_t asm_write_batch(asm_batch_job_t *jobs, size_t count, asm_opts_t *opts,
+                      asm_share_t *share);
+
+/// Assembles the source in src without touching the disk or the log
+/// (unless opts asks for it). Includes are read through opts->read and
+/// diagnostics go to opts->diag. opts may be NULL to use the defaults.
+///
+/// If *dest is NULL the image is returned in a new buffer, which has to be
+/// freed by the caller. Otherwise the image is written to *dest, which holds
+/// *size bytes. If it is too small TASM_BUFFER_TOO_SMALL is returned and
+/// *size is set to the required size. On success *size is the image size.
+///
+/// Calls share no state apart from the intern table, any number of threads
+/// can assemble at once. The table grows with the distinct names of labels,
+/// symbols and files of all calls.
+err_t asm_assemble(char *name, const char *src, size_t src_size,
+                   asm_opts_t *opts, uint8_t **dest, size_t *size);
+
+/// Assembles src_fl into out_fl. opts may be NULL to use the defaults.
+err_t asm_write_file(char *src_fl, char *out_fl, char *format,
+                     asm_opts_t *opts);
 
 //- Utility Functions -//
 
 /// Maps a string representation of a directive to its enum
-/// representation
-directive_t get_dir(char *str);
+/// representation. Case-insensitive, str does not need to be terminated.
+directive_t get_dir(const char *str, size_t len);
 
 /// Maps a string representation of an instruction to its enum
-/// representation
-inst_t get_inst(char *str);
+/// representation. Case-insensitive, str does not need to be terminated.
+inst_t get_inst(const char *str, size_t len);
 
 /// Get the error name of the given err_t
 char *asm_errname(err_t err);
@@ -0,0 +1,496 @@
+// t(heft)asm ; cache.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <cache.h>
+
+#include <intern.h>
+#include <log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC 0x43424654u /* "TFBC" */
+#define CACHE_HASH_SEED 0xcbf29ce484222325ull
+
+/// Layout of an entry: the header, followed by the expression, symbol and
+/// token tables, the values and kinds of the operands of the tokens and
+/// finally the strings which are not part of the source. All fields are
+/// fixed size and the structs contain no padding. Interned ids only live as
+/// long as the process, names of labels and symbols are interned again from
+/// their tokens when loading.
+typedef struct _cache_header_t {
+  uint32_t magic;
+  uint32_t format;
+  char version[16];
+  uint64_t src_hash;
+  uint64_t src_size;
+  /// Hash of everything following the header
+  uint64_t body_hash;
+  uint32_t exp_count;
+  uint32_t symbol_count;
+  uint32_t token_count;
+  uint32_t string_size;
+  int32_t curr_section;
+  uint8_t entry_symbols;
+  uint8_t section_seen;
+  uint8_t section_dependent;
+  uint8_t reserved;
+} _cache_header_t;
+
+typedef struct _cache_exp_t {
+  uint32_t line;
+  uint32_t parameter_count;
+  /// Index of the first parameter in the token table
+  uint32_t parameters;
+  int32_t directive;
+  uint16_t col;
+  uint8_t type;
+  uint8_t inst;
+} _cache_exp_t;
+
+typedef struct _cache_symbol_t {
+  uint32_t line;
+  uint32_t name;
+  uint32_t value;
+} _cache_symbol_t;
+
+typedef struct _cache_tok_t {
+  /// Offset into the source, or into the strings if in_strings is set
+  uint32_t offset;
+  uint32_t len;
+  uint16_t col;
+  uint8_t flags;
+  uint8_t in_strings;
+} _cache_tok_t;
+
+/// Working state while serializing a branch
+typedef struct _cache_writer_t {
+  asm_tree_branch_t *branch;
+  _cache_tok_t *toks;
+  /// Operand of every token, OPERAND_NONE if it is no instruction operand
+  /// or label name
+  uint16_t *values;
+  uint8_t *kinds;
+  size_t tok_count;
+  char *strings;
+  size_t string_size;
+  size_t string_capacity;
+} _cache_writer_t;
+
+uint64_t cache_hash(uint64_t hash, const void *data, size_t size) {
+  // Mixes in a word at a time, a byte-wise hash would take about as long as
+  // parsing the file in the first place
+  const uint8_t *bytes = data;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 32;
+  }
+
+  for (; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    hash ^= hash >> 32;
+  }
+
+  return hash;
+}
+
+static uint64_t _hash_src(asm_tree_branch_t *branch) {
+  return cache_hash(CACHE_HASH_SEED, branch->src, branch->src_size);
+}
+
+/// Path of the entry for a source with the given hash
+static char *_entry_path(const char *dir, uint64_t src_hash,
+                         uint8_t entry_symbols) {
+  uint64_t key = cache_hash(src_hash, TASM_VERSION, sizeof(TASM_VERSION));
+  uint32_t format = CACHE_FORMAT_VERSION;
+  key = cache_hash(key, &format, sizeof(format));
+  key = cache_hash(key, &entry_symbols, sizeof(entry_symbols));
+
+  size_t len = strlen(dir) + 18 + sizeof(CACHE_FILE_EXTENSION);
+  char *path = malloc(len);
+  snprintf(path, len, "%s/%016" PRIx64 CACHE_FILE_EXTENSION, dir, key);
+  return path;
+}
+
+static void _fill_header(_cache_header_t *header, asm_tree_branch_t *branch,
+                         uint64_t src_hash) {
+  memset(header, 0, sizeof(_cache_header_t));
+  header->magic = CACHE_MAGIC;
+  header->format = CACHE_FORMAT_VERSION;
+  strncpy(header->version, TASM_VERSION, sizeof(header->version) - 1);
+  header->src_hash = src_hash;
+  header->src_size = branch->src_size;
+  header->entry_symbols = branch->entry_section == DIR_SYMBOLS;
+}
+
+//-- Loading --//
+
+static uint8_t _read_entry(const char *path, char **dest, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(_cache_header_t)) {
+    close(fd);
+    return 0;
+  }
+
+  char *buf = malloc(st.st_size);
+  size_t done = 0;
+  while (done < (size_t)st.st_size) {
+    ssize_t n = read(fd, buf + done, st.st_size - done);
+    if (n <= 0) {
+      free(buf);
+      close(fd);
+      return 0;
+    }
+
+    done += n;
+  }
+
+  close(fd);
+  *dest = buf;
+  *size = done;
+  return 1;
+}
+
+/// Hash of the tables and strings following the header. The hash is not
+/// incremental, so loading and storing have to hash the same pieces.
+static uint64_t _body_hash(_cache_header_t *header, const void *tables,
+                           const void *toks, const void *values,
+                           const void *kinds, const void *strings) {
+  size_t table_size = sizeof(_cache_exp_t) * header->exp_count +
+                      sizeof(_cache_symbol_t) * header->symbol_count;
+  uint64_t hash = cache_hash(CACHE_HASH_SEED, tables, table_size);
+  hash = cache_hash(hash, toks, sizeof(_cache_tok_t) * header->token_count);
+  hash = cache_hash(hash, values, sizeof(uint16_t) * header->token_count);
+  hash = cache_hash(hash, kinds, header->token_count);
+  return cache_hash(hash, strings, header->string_size);
+}
+
+static uint8_t _valid_tok(_cache_tok_t *tok, size_t src_size,
+                          size_t string_size) {
+  size_t limit = tok->in_strings ? string_size : src_size;
+  return tok->offset <= limit && tok->len <= limit - tok->offset;
+}
+
+/// Checks every table of the entry, nothing of it is trusted
+static uint8_t _validate(_cache_header_t *header, size_t size,
+                         asm_tree_branch_t *branch) {
+  uint64_t expected = sizeof(_cache_header_t) +
+                      (uint64_t)header->exp_count * sizeof(_cache_exp_t) +
+                      (uint64_t)header->symbol_count * sizeof(_cache_symbol_t) +
+                      (uint64_t)header->token_count * sizeof(_cache_tok_t) +
+                      (uint64_t)header->token_count * sizeof(uint16_t) +
+                      header->token_count + header->string_size;
+  if (expected != size)
+    return 0;
+
+  _cache_exp_t *exps = (_cache_exp_t *)(header + 1);
+  _cache_symbol_t *symbols = (_cache_symbol_t *)(exps + header->exp_count);
+  _cache_tok_t *toks = (_cache_tok_t *)(symbols + header->symbol_count);
+  uint16_t *values = (uint16_t *)(toks + header->token_count);
+  uint8_t *kinds = (uint8_t *)(values + header->token_count);
+  if (_body_hash(header, exps, toks, values, kinds,
+                 kinds + header->token_count) != header->body_hash)
+    return 0;
+
+  for (uint32_t i = 0; i < header->exp_count; i++) {
+    _cache_exp_t *exp = &exps[i];
+    if (exp->type > EXP_LABEL || exp->directive < DIR_INVALID ||
+        exp->directive > DIR_ASSERT ||
+        exp->parameters > header->token_count ||
+        exp->parameter_count > header->token_count - exp->parameters)
+      return 0;
+  }
+
+  for (uint32_t i = 0; i < header->symbol_count; i++) {
+    if (symbols[i].name >= header->token_count ||
+        symbols[i].value >= header->token_count)
+      return 0;
+  }
+
+  for (uint32_t i = 0; i < header->token_count; i++) {
+    // Symbol names are interned without their prefix
+    if (!_valid_tok(&toks[i], branch->src_size, header->string_size) ||
+        kinds[i] > OPERAND_INVALID ||
+        (kinds[i] == OPERAND_SYMBOL && toks[i].len == 0))
+      return 0;
+  }
+
+  return 1;
+}
+
+static asm_tok_t _load_tok(_cache_tok_t *tok, const char *src,
+                           const char *strings) {
+  return (asm_tok_t){.str = (tok->in_strings ? strings : src) + tok->offset,
+                     .len = tok->len,
+                     .col = tok->col,
+                     .flags = tok->flags};
+}
+
+uint8_t cache_load(const char *dir, asm_tree_branch_t *branch) {
+  uint64_t src_hash = _hash_src(branch);
+  char *path =
+      _entry_path(dir, src_hash, branch->entry_section == DIR_SYMBOLS);
+
+  char *buf;
+  size_t size;
+  uint8_t ret = _read_entry(path, &buf, &size);
+  free(path);
+  if (!ret)
+    return 0;
+
+  _cache_header_t expected;
+  _fill_header(&expected, branch, src_hash);
+
+  _cache_header_t *header = (_cache_header_t *)buf;
+  ret = header->magic == expected.magic && header->format == expected.format &&
+        memcmp(header->version, expected.version, sizeof(expected.version)) ==
+            0 &&
+        header->src_hash == src_hash && header->src_size == branch->src_size &&
+        header->entry_symbols == expected.entry_symbols &&
+        _validate(header, size, branch);
+  if (!ret) {
+    log_dbg("Ignoring stale cache entry for \"%s\"\n", branch->file);
+    goto cache_load_exit;
+  }
+
+  _cache_exp_t *exps = (_cache_exp_t *)(header + 1);
+  _cache_symbol_t *symbols = (_cache_symbol_t *)(exps + header->exp_count);
+  _cache_tok_t *toks = (_cache_tok_t *)(symbols + header->symbol_count);
+  uint16_t *values = (uint16_t *)(toks + header->token_count);
+  uint8_t *kinds = (uint8_t *)(values + header->token_count);
+  const char *strings = (const char *)(kinds + header->token_count);
+
+  char *own_strings = arena_alloc(&branch->arena, header->string_size);
+  memcpy(own_strings, strings, header->string_size);
+
+  // Parameters of all expressions share one array
+  asm_tok_t *params =
+      arena_alloc(&branch->arena, sizeof(asm_tok_t) * header->token_count);
+  for (uint32_t i = 0; i < header->token_count; i++)
+    params[i] = _load_tok(&toks[i], branch->src, own_strings);
+
+  // Operands are stored for every token, so they share its index
+  branch->operand_count = header->token_count;
+  branch->operand_capacity = header->token_count;
+  branch->operand_kinds = arena_alloc(&branch->arena, header->token_count);
+  branch->operand_values =
+      arena_alloc(&branch->arena, sizeof(uint32_t) * header->token_count);
+  memcpy(branch->operand_kinds, kinds, header->token_count);
+  for (uint32_t i = 0; i < header->token_count; i++)
+    branch->operand_values[i] = values[i];
+
+  branch->exp_count = header->exp_count;
+  branch->exp_capacity = header->exp_count;
+  branch->asm_exp =
+      arena_alloc(&branch->arena, sizeof(asm_exp_t) * header->exp_count);
+  for (uint32_t i = 0; i < header->exp_count; i++) {
+    asm_exp_t *exp = &branch->asm_exp[i];
+    exp->line = exps[i].line;
+    exp->col = exps[i].col;
+    exp->type = exps[i].type;
+    exp->inst = exps[i].inst;
+    exp->directive = exps[i].directive;
+    exp->parameter_count = exps[i].parameter_count;
+    exp->position = 0;
+    exp->parameters =
+        exp->parameter_count > 0 ? params + exps[i].parameters : NULL;
+    exp->operand = exps[i].parameters;
+
+    // Names of labels and symbols are interned like asm_parse_exp does
+    for (uint32_t p = 0; p < exp->parameter_count; p++) {
+      uint32_t ix = exp->operand + p;
+      asm_tok_t tok = exp->parameters[p];
+      if (kinds[ix] == OPERAND_LABEL)
+        branch->operand_values[ix] = intern(tok.str, tok.len);
+      else if (kinds[ix] == OPERAND_SYMBOL)
+        branch->operand_values[ix] = intern(tok.str + 1, tok.len - 1);
+    }
+  }
+
+  branch->symbol_count = header->symbol_count;
+  branch->symbol_capacity = header->symbol_count;
+  branch->symbols =
+      arena_alloc(&branch->arena, sizeof(asm_symbol_t) * header->symbol_count);
+  for (uint32_t i = 0; i < header->symbol_count; i++) {
+    branch->symbols[i].name = params[symbols[i].name];
+    branch->symbols[i].value = params[symbols[i].value];
+    branch->symbols[i].line = symbols[i].line;
+    branch->symbols[i].id =
+        intern(branch->symbols[i].name.str, branch->symbols[i].name.len);
+    branch->symbols[i].kind = kinds[symbols[i].value];
+    branch->symbols[i].operand = values[symbols[i].value];
+  }
+
+  branch->curr_section = header->curr_section;
+  branch->section_seen = header->section_seen;
+  branch->section_dependent = header->section_dependent;
+
+cache_load_exit:
+  free(buf);
+  return ret;
+}
+
+//-- Storing --//
+
+static uint32_t _store_tok(_cache_writer_t *writer, asm_tok_t tok,
+                           uint8_t kind, uint32_t value) {
+  asm_tree_branch_t *branch = writer->branch;
+  uint8_t named = kind == OPERAND_LABEL || kind == OPERAND_SYMBOL;
+  writer->kinds[writer->tok_count] = kind;
+  writer->values[writer->tok_count] = named ? 0 : value;
+  _cache_tok_t *out = &writer->toks[writer->tok_count];
+  out->len = tok.len;
+  out->col = tok.col;
+  out->flags = tok.flags;
+  out->in_strings = 0;
+
+  // Tokens converted or joined by the parser live in the arena
+  const char *src = branch->src;
+  if (src != NULL && tok.str >= src && tok.str <= src + branch->src_size &&
+      tok.len <= (size_t)(src + branch->src_size - tok.str)) {
+    out->offset = tok.str - src;
+    return writer->tok_count++;
+  }
+
+  if (writer->string_size + tok.len > writer->string_capacity) {
+    writer->string_capacity = (writer->string_size + tok.len) * 2;
+    writer->strings = realloc(writer->strings, writer->string_capacity);
+  }
+
+  memcpy(writer->strings + writer->string_size, tok.str, tok.len);
+  out->offset = writer->string_size;
+  out->in_strings = 1;
+  writer->string_size += tok.len;
+  return writer->tok_count++;
+}
+
+/// Writes all of size bytes, returns 0 on failure
+static uint8_t _write_all(int fd, const void *data, size_t size) {
+  const char *bytes = data;
+  while (size > 0) {
+    ssize_t n = write(fd, bytes, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+
+    bytes += n;
+    size -= n;
+  }
+
+  return 1;
+}
+
+void cache_store(const char *dir, asm_tree_branch_t *branch) {
+  if (branch->err != TASM_OK || branch->src_size > UINT32_MAX)
+    return;
+
+  size_t tok_count = branch->symbol_count * 2;
+  for (size_t i = 0; i < branch->exp_count; i++)
+    tok_count += branch->asm_exp[i].parameter_count;
+
+  _cache_writer_t writer = {0};
+  writer.branch = branch;
+  writer.toks = malloc(sizeof(_cache_tok_t) * (tok_count + 1));
+  writer.values = malloc(sizeof(uint16_t) * (tok_count + 1));
+  writer.kinds = malloc(tok_count + 1);
+
+  size_t body_size = sizeof(_cache_exp_t) * branch->exp_count +
+                     sizeof(_cache_symbol_t) * branch->symbol_count;
+  char *body = malloc(body_size + 1);
+  _cache_exp_t *exps = (_cache_exp_t *)body;
+  _cache_symbol_t *symbols = (_cache_symbol_t *)(exps + branch->exp_count);
+
+  for (size_t i = 0; i < branch->exp_count; i++) {
+    asm_exp_t *exp = &branch->asm_exp[i];
+    exps[i] = (_cache_exp_t){.line = exp->line,
+                             .parameter_count = exp->parameter_count,
+                             .parameters = writer.tok_count,
+                             .directive = exp->directive,
+                             .col = exp->col,
+                             .type = exp->type,
+                             .inst = exp->inst};
+    uint8_t operands = exp->type != EXP_DIRECTIVE;
+    for (size_t p = 0; p < exp->parameter_count; p++) {
+      size_t ix = exp->operand + p;
+      _store_tok(&writer, exp->parameters[p],
+                 operands ? branch->operand_kinds[ix] : OPERAND_NONE,
+                 operands ? branch->operand_values[ix] : 0);
+    }
+  }
+
+  for (size_t i = 0; i < branch->symbol_count; i++) {
+    asm_symbol_t *symbol = &branch->symbols[i];
+    symbols[i].line = symbol->line;
+    symbols[i].name = _store_tok(&writer, symbol->name, OPERAND_NONE, 0);
+    symbols[i].value =
+        _store_tok(&writer, symbol->value, symbol->kind, symbol->operand);
+  }
+
+  uint64_t src_hash = _hash_src(branch);
+  _cache_header_t header;
+  _fill_header(&header, branch, src_hash);
+  header.exp_count = branch->exp_count;
+  header.symbol_count = branch->symbol_count;
+  header.token_count = writer.tok_count;
+  header.string_size = writer.string_size;
+  header.curr_section = branch->curr_section;
+  header.section_seen = branch->section_seen;
+  header.section_dependent = branch->section_dependent;
+
+  header.body_hash = _body_hash(&header, body, writer.toks, writer.values,
+                                writer.kinds, writer.strings);
+
+  // Entries are written to a temporary file first, so concurrent runs
+  // never see a partial entry
+  char *path = _entry_path(dir, src_hash, header.entry_symbols);
+  size_t tmp_len = strlen(dir) + 16;
+  char *tmp_path = malloc(tmp_len);
+  snprintf(tmp_path, tmp_len, "%s/.tbc-XXXXXX", dir);
+
+  mkdir(dir, 0777);
+  int fd = mkstemp(tmp_path);
+  uint8_t ok = fd >= 0;
+  int err = errno;
+  if (ok) {
+    ok = _write_all(fd, &header, sizeof(header)) &&
+         _write_all(fd, body, body_size) &&
+         _write_all(fd, writer.toks,
+                    sizeof(_cache_tok_t) * writer.tok_count) &&
+         _write_all(fd, writer.values, sizeof(uint16_t) * writer.tok_count) &&
+         _write_all(fd, writer.kinds, writer.tok_count) &&
+         _write_all(fd, writer.strings, writer.string_size);
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp_path, path) == 0;
+    err = errno;
+    if (!ok)
+      unlink(tmp_path);
+  }
+
+  if (!ok)
+    log_wrn("Could not write cache entry for \"%s\": %s\n", branch->file,
+            strerror(err));
+
+  free(tmp_path);
+  free(path);
+  free(body);
+  free(writer.toks);
+  free(writer.values);
+  free(writer.kinds);
+  free(writer.strings);
+}
@@ -0,0 +1,35 @@
+// t(heft)asm ; cache.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// On-disk cache of parsed branches. Entries are keyed by a hash of the
+/// source contents, the assembler version and the section the file is
+/// parsed with. Tokens which are slices of the source are stored as
+/// offsets, so an entry only holds the structure of the parse.
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <assembler.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Bumped whenever the layout of an entry or the parse result changes
+#define CACHE_FORMAT_VERSION 6
+#define CACHE_FILE_EXTENSION ".tbc"
+
+/// Non-cryptographic 64-bit hash of size bytes of data, continuing from hash
+uint64_t cache_hash(uint64_t hash, const void *data, size_t size);
+
+/// Fills branch from the cache entry for its source, which has to be mapped
+/// already. Returns 0 if there is no usable entry, in which case the branch
+/// is left empty. Corrupt and stale entries are treated as missing.
+uint8_t cache_load(const char *dir, asm_tree_branch_t *branch);
+
+/// Writes the entry for a successfully parsed branch. Failures only cost
+/// the next run a parse, so they are reported as warnings.
+void cache_store(const char *dir, asm_tree_branch_t *branch);
+
+#endif
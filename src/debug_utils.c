@@ -4,24 +4,30 @@
 
 #include <stdio.h>
 
-void debug_print_ast(asm_tree_t ast) {
-#ifndef DEBUG_UTILS_MUTE
-  printf("symbols: %zu\nbranches: %zu\n{\n", ast.symbol_count,
-         ast.branch_count);
-  for (size_t s = 0; s < ast.symbol_count; s++) {
+#if LOG_MAX_LEVEL >= LOG_LEVEL_TRC
+void debug_print_ast(asm_tree_t *ast) {
+  if (!log_enabled(LOG_LEVEL_TRC))
+    return;
+
+  flockfile(stdout);
+  printf("symbols: %zu\nbranches: %zu\n{\n", ast->symbol_count,
+         ast->branch_count);
+  for (size_t s = 0; s < ast->symbol_count; s++) {
     printf("  symbol {\n");
-    printf("    name: %s;\n", ast.symbols[s].name);
-    printf("    value: %s;\n", ast.symbols[s].value);
+    printf("    name: %.*s;\n", (int)ast->symbols[s].name.len,
+           ast->symbols[s].name.str);
+    printf("    value: %.*s;\n", (int)ast->symbols[s].value.len,
+           ast->symbols[s].value.str);
     printf("  }\n");
   }
 
   printf("  base {\n");
 
-  for (size_t s = 0; s < ast.branch_count; s++) {
+  for (size_t s = 0; s < ast->branch_count; s++) {
     printf("    branch {\n");
-    printf("      file: %s;\n", ast.branches[s].file);
-    for (size_t e = 0; e < ast.branches[s].exp_count; e++) {
-      asm_exp_t exp = ast.branches[s].asm_exp[e];
+    printf("      file: %s;\n", ast->branches[s].file);
+    for (size_t e = 0; e < ast->branches[s].exp_count; e++) {
+      asm_exp_t exp = ast->branches[s].asm_exp[e];
       printf("      expr {\n");
       printf("        line: %u;\n", exp.line);
       printf("        type: %d;\n", exp.type);
@@ -29,7 +35,8 @@ void debug_print_ast(asm_tree_t ast) {
       printf("        dire: %d;\n", exp.directive);
       for (size_t p = 0; p < exp.parameter_count; p++) {
         printf("        param {\n");
-        printf("          value: %s;\n", exp.parameters[p]);
+        printf("          value: %.*s;\n", (int)exp.parameters[p].len,
+               exp.parameters[p].str);
         printf("        }\n");
       }
       printf("      }\n");
@@ -38,5 +45,6 @@ void debug_print_ast(asm_tree_t ast) {
 
   printf("  }\n");
   printf("}\n");
-#endif
+  funlockfile(stdout);
 }
+#endif
@@ -1,10 +1,14 @@
 #ifndef DEBUG_UTILS_H
 #define DEBUG_UTILS_H
 
-#define DEBUG_UTILS_MUTE
-
 #include <assembler.h>
+#include <log.h>
 
-void debug_print_ast(asm_tree_t ast);
+#if LOG_MAX_LEVEL >= LOG_LEVEL_TRC
+/// Dumps the symbols and expressions of the tree at trace level
+void debug_print_ast(asm_tree_t *ast);
+#else
+#define debug_print_ast(ast) ((void)0)
+#endif
 
 #endif
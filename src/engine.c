@@ -0,0 +1,506 @@
+// t(heft)asm ; engine.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+#include <engine.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Where an instruction keeps its register and the flag telling an
+/// immediate operand from an address, found by encoding it
+typedef struct _engine_decoder_t {
+  inst_descriptor_t *desc;
+  uint8_t has_reg;
+  uint8_t reg_byte;
+  uint8_t reg_shift;
+  uint8_t has_imm;
+  uint8_t imm_byte;
+  uint8_t imm_mask;
+} _engine_decoder_t;
+
+/// An instruction decoded at a position of the image
+typedef struct _engine_op_t {
+  /// Runs first, checks the assertions at the position if there are any
+  /// and continues with exec
+  const void *entry;
+  const void *exec;
+  /// Position of the next instruction, clamped to the end of the image
+  size_t next;
+  uint16_t operand;
+  uint8_t reg;
+  uint8_t imm;
+  uint8_t cycles;
+  size_t first_assert;
+  size_t assert_count;
+} _engine_op_t;
+
+static _engine_decoder_t _decoders[INST_COUNT];
+/// Decoder of every first byte, NULL if no instruction starts with it
+static _engine_decoder_t *_decode[256];
+static pthread_once_t _decode_once = PTHREAD_ONCE_INIT;
+
+//-- Static Utilities --//
+
+static asm_tok_t _tok(const char *str) {
+  return (asm_tok_t){.str = str, .len = strlen(str), .col = 0, .flags = 0};
+}
+
+/// Encodes desc with the register named reg and an immediate value or an
+/// address as operand, the same way the assembler does
+static void _encode(asm_tree_t *ast, inst_descriptor_t *desc, const char *reg,
+                    uint8_t imm, uint8_t *out) {
+  asm_tok_t params[2];
+  size_t count = 0;
+  if (desc->param_count == 2)
+    params[count++] = _tok(reg);
+  if (desc->param_count >= 1)
+    params[count++] = _tok(imm ? "$#0000" : "$0000");
+
+  memset(out, 0, 4);
+  out[0] = desc->inst;
+  asm_translate_parameters(ast, params, count, out);
+}
+
+/// Finds the byte and lowest bit in which a and b differ, returns 0 if
+/// they are the same
+static uint8_t _diff(const uint8_t *a, const uint8_t *b, uint8_t *byte,
+                     uint8_t *shift) {
+  for (uint8_t i = 0; i < 4; i++) {
+    uint8_t diff = a[i] ^ b[i];
+    if (diff == 0)
+      continue;
+
+    *byte = i;
+    *shift = 0;
+    while (!(diff & (1 << *shift)))
+      (*shift)++;
+    return 1;
+  }
+
+  return 0;
+}
+
+/// Builds the decoders from inst_descriptors and the encoder, so both
+/// always agree on the format of an instruction
+static void _init_decode(void) {
+  static const char *regs[ENGINE_REGISTER_COUNT] = {"a", "c", "d", "e",
+                                                    "f", "g", "h"};
+  asm_tree_t ast;
+  asm_init_tree(&ast);
+  for (size_t i = 0; i < INST_COUNT; i++) {
+    _engine_decoder_t *dec = &_decoders[i];
+    dec->desc = &inst_descriptors[i];
+
+    uint8_t base[4];
+    uint8_t other[4];
+    _encode(&ast, dec->desc, regs[REG_ACC], 0, base);
+    _encode(&ast, dec->desc, regs[REG_C], 0, other);
+    dec->has_reg = _diff(base, other, &dec->reg_byte, &dec->reg_shift);
+
+    uint8_t shift = 0;
+    _encode(&ast, dec->desc, regs[REG_ACC], 1, other);
+    dec->has_imm = _diff(base, other, &dec->imm_byte, &shift);
+    dec->imm_mask = 1 << shift;
+
+    // Mnemonics sharing an opcode decode to the first of them
+    for (size_t r = 0; r < ENGINE_REGISTER_COUNT; r++) {
+      for (uint8_t imm = 0; imm < 2; imm++) {
+        _encode(&ast, dec->desc, regs[r], imm, other);
+        if (_decode[other[0]] == NULL)
+          _decode[other[0]] = dec;
+      }
+    }
+  }
+  asm_free_tree(&ast);
+}
+
+static uint8_t *_device(engine_t *cpu, uint16_t device) {
+  uint8_t **mem = &cpu->devices[device % ENGINE_DEVICE_COUNT];
+  if (*mem == NULL)
+    *mem = calloc(1, ENGINE_DEVICE_SIZE);
+  return *mem;
+}
+
+static uint16_t _read_word(engine_t *cpu, uint16_t device, uint16_t address) {
+  uint8_t *mem = cpu->devices[device % ENGINE_DEVICE_COUNT];
+  if (mem == NULL)
+    return 0;
+
+  return mem[address] << 8 | mem[(uint16_t)(address + 1)];
+}
+
+/// Returns 0 if the device could not be allocated
+static uint8_t _write_word(engine_t *cpu, uint16_t device, uint16_t address,
+                           uint16_t value) {
+  uint8_t *mem = _device(cpu, device);
+  if (mem == NULL)
+    return 0;
+
+  mem[address] = value >> 8;
+  mem[(uint16_t)(address + 1)] = value & 0xff;
+  return 1;
+}
+
+/// Stores value like st does, returns 0 if memory ran out
+static uint8_t _store(engine_t *cpu, uint16_t address, uint16_t value) {
+  switch (address) {
+  case ENGINE_IO_DEVICE_STORE:
+    cpu->io_device = value;
+    return 1;
+  case ENGINE_PROGRAM_BANK_STORE:
+    cpu->program_bank = value;
+    return 1;
+  case ENGINE_BRANCHING_MODE_STORE:
+    cpu->branching_mode = value;
+    return 1;
+  case ENGINE_RAM_DEVICE_STORE:
+    cpu->ram_device = value;
+    return 1;
+  default:
+    return _write_word(cpu, cpu->io_device, address, value);
+  }
+}
+
+static uint8_t _push(engine_t *cpu, uint16_t value) {
+  uint16_t sp = _read_word(cpu, cpu->ram_device, ENGINE_STACK_PTR_STORE) - 2;
+  return _write_word(cpu, cpu->ram_device, sp, value) &&
+         _write_word(cpu, cpu->ram_device, ENGINE_STACK_PTR_STORE, sp);
+}
+
+static uint8_t _pop(engine_t *cpu, uint16_t *value) {
+  uint16_t sp = _read_word(cpu, cpu->ram_device, ENGINE_STACK_PTR_STORE);
+  *value = _read_word(cpu, cpu->ram_device, sp);
+  return _write_word(cpu, cpu->ram_device, ENGINE_STACK_PTR_STORE, sp + 2);
+}
+
+//-- Engine Funcs --//
+
+void engine_init(engine_t *cpu) {
+  memset(cpu, 0, sizeof(engine_t));
+  cpu->pc = ENGINE_ENTRY;
+  cpu->max_steps = ENGINE_DEFAULT_STEPS;
+}
+
+void engine_free(engine_t *cpu) {
+  for (size_t i = 0; i < ENGINE_DEVICE_COUNT; i++)
+    free(cpu->devices[i]);
+  memset(cpu->devices, 0, sizeof(cpu->devices));
+}
+
+uint8_t engine_read(engine_t *cpu, uint16_t address) {
+  switch (address) {
+  case ENGINE_IO_DEVICE_STORE:
+    return cpu->io_device;
+  case ENGINE_PROGRAM_BANK_STORE:
+    return cpu->program_bank;
+  case ENGINE_BRANCHING_MODE_STORE:
+    return cpu->branching_mode;
+  case ENGINE_RAM_DEVICE_STORE:
+    return cpu->ram_device;
+  default: {
+    uint8_t *mem = cpu->devices[cpu->io_device % ENGINE_DEVICE_COUNT];
+    return mem != NULL ? mem[address] : 0;
+  }
+  }
+}
+
+engine_status_t engine_run(engine_t *cpu, const uint8_t *image, size_t size,
+                           const engine_assert_t *asserts, size_t count,
+                           engine_fail_fn fail, void *user) {
+  pthread_once(&_decode_once, _init_decode);
+
+  // Every addressable position is decoded up front, the image never
+  // changes while it runs. The extra one past the end halts.
+  size_t image_size = size;
+  if (size > ENGINE_DEVICE_SIZE)
+    size = ENGINE_DEVICE_SIZE;
+  _engine_op_t *ops = malloc(sizeof(_engine_op_t) * (size + 1));
+  if (ops == NULL)
+    return ENGINE_OUT_OF_MEMORY;
+
+  for (size_t p = 0; p <= size; p++) {
+    _engine_op_t *op = &ops[p];
+    memset(op, 0, sizeof(_engine_op_t));
+    op->exec = &&op_halt;
+    op->next = size;
+    if (p == size)
+      continue;
+
+    // Instructions cut off by the end of the image read zeros
+    uint8_t bytes[4] = {0};
+    memcpy(bytes, image + p, image_size - p < 4 ? image_size - p : 4);
+    _engine_decoder_t *dec = _decode[bytes[0]];
+    if (dec == NULL) {
+      op->exec = &&op_invalid;
+      continue;
+    }
+
+    op->next = p + dec->desc->size < size ? p + dec->desc->size : size;
+    op->operand = bytes[1] << 8 | bytes[2];
+    op->cycles = dec->desc->cycles;
+    if (dec->has_reg)
+      op->reg = (bytes[dec->reg_byte] >> dec->reg_shift) & 0x7;
+    if (dec->has_imm)
+      op->imm = (bytes[dec->imm_byte] & dec->imm_mask) != 0;
+    if (op->reg >= ENGINE_REGISTER_COUNT) {
+      op->exec = &&op_invalid;
+      continue;
+    }
+
+    switch (dec->desc->inst) {
+    case INST_LD:
+      op->exec = &&op_ld;
+      break;
+    case INST_ST:
+      op->exec = &&op_st;
+      break;
+    case INST_BRN:
+      op->exec = &&op_brn;
+      break;
+    case INST_CMP:
+      op->exec = &&op_cmp;
+      break;
+    case INST_CAL:
+      op->exec = &&op_cal;
+      break;
+    case INST_RTS:
+      op->exec = &&op_rts;
+      break;
+    case INST_RTI:
+      op->exec = &&op_rti;
+      break;
+    case INST_INT:
+      op->exec = &&op_int;
+      break;
+    case INST_DIN:
+      op->exec = &&op_din;
+      break;
+    case INST_EIN:
+      op->exec = &&op_ein;
+      break;
+    case INST_OR:
+      op->exec = &&op_or;
+      break;
+    case INST_AND:
+      op->exec = &&op_and;
+      break;
+    case INST_INC:
+    case INST_ADD:
+      op->exec = &&op_add;
+      break;
+    case INST_DEC:
+    case INST_SUB:
+      op->exec = &&op_sub;
+      break;
+    case INST_SHR:
+      op->exec = &&op_shr;
+      break;
+    case INST_SHL:
+      op->exec = &&op_shl;
+      break;
+    case INST_NOP:
+      op->exec = &&op_nop;
+      break;
+    default:
+      op->exec = &&op_invalid;
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < count && asserts[i].position <= size; i++) {
+    _engine_op_t *op = &ops[asserts[i].position];
+    if (op->assert_count++ == 0)
+      op->first_assert = i;
+  }
+  for (size_t p = 0; p <= size; p++)
+    ops[p].entry = ops[p].assert_count > 0 ? &&op_check : ops[p].exec;
+
+  uint16_t *regs = cpu->regs;
+  size_t pc = cpu->pc < size ? cpu->pc : size;
+  size_t steps = cpu->steps;
+  size_t cycles = cpu->cycles;
+  engine_status_t status = ENGINE_HALTED;
+  _engine_op_t *op;
+  uint16_t value;
+
+// Operand of the instruction, read from the selected device unless it is an
+// immediate value
+#define OPERAND() (op->imm ? op->operand : engine_read(cpu, op->operand))
+#define JUMP(target) pc = (target) < size ? (target) : size
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    op = &ops[pc];                                                             \
+    goto *op->entry;                                                           \
+  } while (0)
+#define STEP()                                                                 \
+  do {                                                                         \
+    if (steps == cpu->max_steps) {                                             \
+      status = ENGINE_STEP_LIMIT;                                              \
+      goto done;                                                               \
+    }                                                                          \
+    steps++;                                                                   \
+    cycles += op->cycles;                                                      \
+    pc = op->next;                                                             \
+  } while (0)
+
+  DISPATCH();
+
+op_check:
+  // Failures can tell how far the run got
+  cpu->pc = pc;
+  cpu->steps = steps;
+  cpu->cycles = cycles;
+  for (size_t i = op->first_assert; i < op->first_assert + op->assert_count;
+       i++) {
+    const engine_assert_t *a = &asserts[i];
+    value = a->reg != REG_INVALID ? regs[a->reg] : engine_read(cpu, a->address);
+    if (value != a->expected && fail != NULL)
+      fail(user, i, value);
+  }
+  goto *op->exec;
+
+op_ld:
+  STEP();
+  regs[op->reg] = OPERAND();
+  DISPATCH();
+
+op_st:
+  STEP();
+  if (!_store(cpu, op->operand, regs[REG_ACC])) {
+    status = ENGINE_OUT_OF_MEMORY;
+    goto done;
+  }
+  if (cpu->program_bank != 0) {
+    status = ENGINE_INVALID_BANK;
+    goto done;
+  }
+  DISPATCH();
+
+op_brn: {
+  size_t at = pc;
+  STEP();
+  if ((cpu->branching_mode == ENGINE_BRANCH_EQUAL && !cpu->equal) ||
+      (cpu->branching_mode == ENGINE_BRANCH_NOT_EQUAL && cpu->equal))
+    DISPATCH();
+
+  // Nothing changes the flag in a branch to itself, it never leaves it
+  JUMP(op->operand);
+  if (pc == at)
+    goto done;
+  DISPATCH();
+}
+
+op_cmp:
+  STEP();
+  cpu->equal = regs[op->reg] == OPERAND();
+  DISPATCH();
+
+op_cal:
+  STEP();
+  if (!_push(cpu, pc)) {
+    status = ENGINE_OUT_OF_MEMORY;
+    goto done;
+  }
+  JUMP(op->operand);
+  DISPATCH();
+
+op_rti:
+  cpu->interrupts = 1;
+  // fallthrough
+op_rts:
+  STEP();
+  if (!_pop(cpu, &value)) {
+    status = ENGINE_OUT_OF_MEMORY;
+    goto done;
+  }
+  JUMP(value);
+  DISPATCH();
+
+op_int:
+  // Traps to the host, which ends the run
+  STEP();
+  goto done;
+
+op_din:
+  STEP();
+  cpu->interrupts = 0;
+  DISPATCH();
+
+op_ein:
+  STEP();
+  cpu->interrupts = 1;
+  DISPATCH();
+
+op_or:
+  STEP();
+  regs[op->reg] |= OPERAND();
+  DISPATCH();
+
+op_and:
+  STEP();
+  regs[op->reg] &= OPERAND();
+  DISPATCH();
+
+op_add:
+  STEP();
+  regs[op->reg] += OPERAND();
+  DISPATCH();
+
+op_sub:
+  STEP();
+  regs[op->reg] -= OPERAND();
+  DISPATCH();
+
+op_shr:
+  STEP();
+  value = OPERAND();
+  regs[op->reg] = value < 16 ? regs[op->reg] >> value : 0;
+  DISPATCH();
+
+op_shl:
+  STEP();
+  value = OPERAND();
+  regs[op->reg] = value < 16 ? regs[op->reg] << value : 0;
+  DISPATCH();
+
+op_nop:
+  STEP();
+  DISPATCH();
+
+op_invalid:
+  status = ENGINE_INVALID_INSTRUCTION;
+  goto done;
+
+op_halt:
+done:
+#undef OPERAND
+#undef JUMP
+#undef DISPATCH
+#undef STEP
+  cpu->pc = pc;
+  cpu->steps = steps;
+  cpu->cycles = cycles;
+  free(ops);
+  return status;
+}
+
+const char *engine_status_name(engine_status_t status) {
+  switch (status) {
+  case ENGINE_HALTED:
+    return "Halted";
+  case ENGINE_STEP_LIMIT:
+    return "Did not halt within the step limit";
+  case ENGINE_INVALID_INSTRUCTION:
+    return "Invalid instruction";
+  case ENGINE_INVALID_BANK:
+    return "Program bank is not the image";
+  case ENGINE_OUT_OF_MEMORY:
+    return "Out of memory";
+  default:
+    return "Unknown status";
+  }
+}
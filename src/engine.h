@@ -0,0 +1,105 @@
+// t(heft)asm ; engine.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Execution engine for the theft cpu, runs assembled images in-process to
+/// check assertions about their results. Instructions are decoded with the
+/// tables of the encoder and dispatched by direct threading. Data lives on
+/// devices of 64 KiB of RAM each, selected through the reserved stores at
+/// $6000 to $6003, while code is always fetched from the image.
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <assembler.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Reserved stores, they apply on every device
+#define ENGINE_IO_DEVICE_STORE 0x6000
+#define ENGINE_PROGRAM_BANK_STORE 0x6001
+#define ENGINE_BRANCHING_MODE_STORE 0x6002
+#define ENGINE_RAM_DEVICE_STORE 0x6003
+/// Address of the stack pointer on the ram device, the stack grows down
+#define ENGINE_STACK_PTR_STORE 0x0002
+
+/// Values of the branching mode, any other value branches always
+#define ENGINE_BRANCH_ALWAYS 0
+#define ENGINE_BRANCH_EQUAL 1
+#define ENGINE_BRANCH_NOT_EQUAL 2
+
+/// The first byte of an image is reserved, execution starts after it
+#define ENGINE_ENTRY 0x0001
+#define ENGINE_DEVICE_COUNT 256
+#define ENGINE_DEVICE_SIZE 0x10000
+#define ENGINE_REGISTER_COUNT (REG_H + 1)
+/// Instructions executed before a program is stopped by default
+#define ENGINE_DEFAULT_STEPS (1ul << 24)
+
+typedef enum engine_status_t {
+  /// Execution ran past the end of the image or its addressable part,
+  /// branched to the branch itself or executed int
+  ENGINE_HALTED = 0,
+  ENGINE_STEP_LIMIT,
+  /// The bytes at pc are no instruction
+  ENGINE_INVALID_INSTRUCTION,
+  /// A program bank other than the image was selected
+  ENGINE_INVALID_BANK,
+  ENGINE_OUT_OF_MEMORY,
+} engine_status_t;
+
+/// An assertion, checked every time execution reaches its position
+typedef struct engine_assert_t {
+  size_t position;
+  /// Register compared, REG_INVALID to compare the byte at address on the
+  /// selected device
+  reg_t reg;
+  uint16_t address;
+  uint16_t expected;
+} engine_assert_t;
+
+typedef struct engine_t {
+  uint16_t regs[ENGINE_REGISTER_COUNT];
+  size_t pc;
+  /// Set by cmp if the register equals the operand
+  uint8_t equal;
+  uint8_t interrupts;
+  /// Values of the reserved stores
+  uint16_t io_device;
+  uint16_t program_bank;
+  uint16_t branching_mode;
+  uint16_t ram_device;
+  /// Devices written to, the ones which are NULL read as 0
+  uint8_t *devices[ENGINE_DEVICE_COUNT];
+  /// Instructions executed and their estimated cycles
+  size_t steps;
+  size_t cycles;
+  size_t max_steps;
+} engine_t;
+
+/// Receives the index of an assertion which does not hold and the value
+/// found instead
+typedef void (*engine_fail_fn)(void *user, size_t index, uint16_t actual);
+
+/// Resets cpu to its state at power on, with pc at ENGINE_ENTRY
+void engine_init(engine_t *cpu);
+
+void engine_free(engine_t *cpu);
+
+/// Runs the image from cpu->pc until it halts or cpu->max_steps
+/// instructions were executed. Only the first ENGINE_DEVICE_SIZE bytes of
+/// the image can be addressed, execution halts past them. asserts have to
+/// be sorted by position, the ones which can not be reached are ignored.
+/// fail is called for every check of one that does not hold.
+engine_status_t engine_run(engine_t *cpu, const uint8_t *image, size_t size,
+                           const engine_assert_t *asserts, size_t count,
+                           engine_fail_fn fail, void *user);
+
+/// Reads a byte like ld does, from the selected device
+uint8_t engine_read(engine_t *cpu, uint16_t address);
+
+/// Describes a status other than ENGINE_HALTED
+const char *engine_status_name(engine_status_t status);
+#endif
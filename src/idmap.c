@@ -0,0 +1,63 @@
+// t(heft)asm ; idmap.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <idmap.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define IDMAP_INITIAL_CAPACITY 1024
+
+/// Grows the array to cover key
+static void _grow(idmap_t *map, uint32_t key) {
+  size_t capacity =
+      map->capacity == 0 ? IDMAP_INITIAL_CAPACITY : map->capacity;
+  while (capacity <= key)
+    capacity *= 2;
+
+  // Large zeroed allocations are fresh pages, which only take up memory
+  // once they are written to
+  size_t *values = calloc(capacity, sizeof(size_t));
+  if (map->capacity > 0)
+    memcpy(values, map->values, sizeof(size_t) * map->capacity);
+
+  free(map->values);
+  map->values = values;
+  map->capacity = capacity;
+}
+
+void idmap_init(idmap_t *map) {
+  map->count = 0;
+  map->capacity = 0;
+  map->values = NULL;
+}
+
+void idmap_free(idmap_t *map) {
+  free(map->values);
+  idmap_init(map);
+}
+
+uint8_t idmap_get(idmap_t *map, uint32_t key, size_t *dest) {
+  if (key >= map->capacity || map->values[key] == 0)
+    return 0;
+
+  *dest = map->values[key] - 1;
+  return 1;
+}
+
+uint8_t idmap_put(idmap_t *map, uint32_t key, size_t value, size_t *dest) {
+  if (key >= map->capacity)
+    _grow(map, key);
+
+  if (map->values[key] != 0) {
+    if (dest != NULL)
+      *dest = map->values[key] - 1;
+    return 0;
+  }
+
+  map->values[key] = value + 1;
+  map->count++;
+  return 1;
+}
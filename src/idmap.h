@@ -0,0 +1,38 @@
+// t(heft)asm ; idmap.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Map from interned ids to values, stored as an array indexed by the id.
+/// Ids are handed out in the order strings are first seen, so the names of
+/// a tree mostly have neighbouring ids and the array stays compact. Lookups
+/// are a single index, nothing is hashed or compared.
+#ifndef IDMAP_H
+#define IDMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct idmap_t {
+  size_t count;
+  /// Number of ids the array covers
+  size_t capacity;
+  /// Value plus 1 of every id, 0 if the id is not in the map
+  size_t *values;
+} idmap_t;
+
+void idmap_init(idmap_t *map);
+
+void idmap_free(idmap_t *map);
+
+/// Looks up key, writes its value to dest and returns 1 if it is present.
+/// Returns 0 otherwise.
+uint8_t idmap_get(idmap_t *map, uint32_t key, size_t *dest);
+
+/// Inserts key with the given value. If the key is already present the map
+/// is left untouched, the existing value is written to dest (if not NULL)
+/// and 0 is returned.
+uint8_t idmap_put(idmap_t *map, uint32_t key, size_t value, size_t *dest);
+
+#endif
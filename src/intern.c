@@ -0,0 +1,216 @@
+// t(heft)asm ; intern.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <intern.h>
+
+#include <arena.h>
+#include <strmap.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/// Strings are spread over shards by their hash, each with its own lock, so
+/// threads adding different strings rarely wait for each other. The low
+/// bits of an id are its shard, the others its index in the shard plus 1.
+#define INTERN_SHARD_BITS 6
+#define INTERN_SHARD_COUNT (1u << INTERN_SHARD_BITS)
+/// The first chunk of a shard holds 1 << INTERN_CHUNK_BITS entries, every
+/// further chunk twice as many as the one before
+#define INTERN_CHUNK_BITS 8
+/// Enough chunks for every index which fits into an id
+#define INTERN_MAX_CHUNKS (32 - INTERN_SHARD_BITS - INTERN_CHUNK_BITS + 1)
+#define INTERN_INITIAL_CAPACITY 64
+
+/// Strings shorter than this are stored in their entry, so comparing them
+/// only touches a single cache line
+#define INTERN_INLINE_LEN 20
+
+typedef struct _intern_entry_t {
+  const char *str;
+  uint32_t len;
+  char inline_str[INTERN_INLINE_LEN];
+} _intern_entry_t;
+
+/// Open addressing table of the entries of a shard. A slot holds the hash
+/// of an entry in its upper and the index of the entry plus 1 in its lower
+/// half, so probing and growing never touch the entries. 0 marks a free
+/// slot.
+typedef struct _intern_table_t {
+  size_t capacity;
+  _Atomic uint64_t slots[];
+} _intern_table_t;
+
+typedef struct _intern_shard_t {
+  pthread_mutex_t lock;
+  /// Replaced by a larger copy when it fills up. Readers may still be
+  /// probing the old one, so tables are never freed.
+  _Atomic(_intern_table_t *) table;
+  /// Entries in order of their index. Chunks never move, so entries are
+  /// read without the lock.
+  _Atomic(_intern_entry_t *) chunks[INTERN_MAX_CHUNKS];
+  uint32_t count;
+  /// Holds the long strings, chunks and tables
+  arena_t arena;
+} _intern_shard_t;
+
+static _intern_shard_t _shards[INTERN_SHARD_COUNT];
+static pthread_once_t _shards_once = PTHREAD_ONCE_INIT;
+
+//-- Static Utilities --//
+
+static void _init_shards() {
+  for (uint32_t i = 0; i < INTERN_SHARD_COUNT; i++) {
+    pthread_mutex_init(&_shards[i].lock, NULL);
+    arena_init(&_shards[i].arena);
+  }
+}
+
+/// Chunk holding the entry at ix and the position of the entry in it
+static uint32_t _chunk_of(uint32_t ix, uint32_t *offset) {
+  uint32_t n = ix + (1u << INTERN_CHUNK_BITS);
+  uint32_t chunk = 31 - __builtin_clz(n) - INTERN_CHUNK_BITS;
+  *offset = n - (1u << (chunk + INTERN_CHUNK_BITS));
+  return chunk;
+}
+
+static _intern_entry_t *_entry(_intern_shard_t *shard, uint32_t ix) {
+  uint32_t offset;
+  uint32_t chunk = _chunk_of(ix, &offset);
+  return atomic_load_explicit(&shard->chunks[chunk], memory_order_acquire) +
+         offset;
+}
+
+/// Returns the index of str in the shard plus 1, 0 if it is not in table
+static uint32_t _lookup(_intern_shard_t *shard, _intern_table_t *table,
+                        const char *str, size_t len, uint32_t hash) {
+  if (table == NULL)
+    return 0;
+
+  size_t mask = table->capacity - 1;
+  size_t ix = (hash >> INTERN_SHARD_BITS) & mask;
+  for (;; ix = (ix + 1) & mask) {
+    uint64_t slot =
+        atomic_load_explicit(&table->slots[ix], memory_order_acquire);
+    if (slot == 0)
+      return 0;
+    if (slot >> 32 != hash)
+      continue;
+
+    _intern_entry_t *entry = _entry(shard, (uint32_t)slot - 1);
+    if (entry->len == len && memcmp(entry->str, str, len) == 0)
+      return (uint32_t)slot;
+  }
+}
+
+static void _insert_slot(_intern_table_t *table, uint64_t slot) {
+  size_t mask = table->capacity - 1;
+  size_t ix = ((slot >> 32) >> INTERN_SHARD_BITS) & mask;
+  while (atomic_load_explicit(&table->slots[ix], memory_order_relaxed) != 0)
+    ix = (ix + 1) & mask;
+
+  // The entry is complete before readers can find it
+  atomic_store_explicit(&table->slots[ix], slot, memory_order_release);
+}
+
+/// Returns a table of the given capacity holding every slot of old
+static _intern_table_t *_grow_table(_intern_shard_t *shard,
+                                    _intern_table_t *old, size_t capacity) {
+  _intern_table_t *table = arena_alloc(
+      &shard->arena, sizeof(_intern_table_t) + sizeof(uint64_t) * capacity);
+  table->capacity = capacity;
+  for (size_t i = 0; i < capacity; i++)
+    atomic_init(&table->slots[i], 0);
+
+  for (size_t i = 0; old != NULL && i < old->capacity; i++) {
+    uint64_t slot = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+    if (slot != 0)
+      _insert_slot(table, slot);
+  }
+
+  return table;
+}
+
+/// Adds str to a shard whose lock is held, returns its index plus 1
+static uint32_t _add(_intern_shard_t *shard, _intern_table_t *table,
+                     const char *str, size_t len, uint32_t hash) {
+  uint32_t ix = shard->count;
+  uint32_t offset;
+  uint32_t chunk = _chunk_of(ix, &offset);
+  if (offset == 0) {
+    size_t size = sizeof(_intern_entry_t) << (chunk + INTERN_CHUNK_BITS);
+    atomic_store_explicit(&shard->chunks[chunk],
+                          arena_alloc(&shard->arena, size),
+                          memory_order_release);
+  }
+
+  _intern_entry_t *entry = _entry(shard, ix);
+  if (len < INTERN_INLINE_LEN) {
+    memcpy(entry->inline_str, str, len);
+    entry->inline_str[len] = 0;
+    entry->str = entry->inline_str;
+  } else {
+    entry->str = arena_strndup(&shard->arena, str, len);
+  }
+  entry->len = len;
+  shard->count++;
+
+  // Keep the load factor below 3/4
+  if (table == NULL || (size_t)shard->count * 4 > table->capacity * 3) {
+    table = _grow_table(shard, table,
+                        table == NULL ? INTERN_INITIAL_CAPACITY
+                                      : table->capacity * 2);
+    atomic_store_explicit(&shard->table, table, memory_order_release);
+  }
+  _insert_slot(table, (uint64_t)hash << 32 | (ix + 1));
+
+  return ix + 1;
+}
+
+//-- Interning --//
+
+uint32_t intern(const char *str, size_t len) {
+  uint32_t hash = strmap_hash(str, len);
+  uint32_t s = hash & (INTERN_SHARD_COUNT - 1);
+  _intern_shard_t *shard = &_shards[s];
+
+  uint32_t slot =
+      _lookup(shard, atomic_load_explicit(&shard->table, memory_order_acquire),
+              str, len, hash);
+  if (slot != 0)
+    return slot << INTERN_SHARD_BITS | s;
+
+  // Another thread may have added it or grown the table in the meantime
+  pthread_once(&_shards_once, _init_shards);
+  pthread_mutex_lock(&shard->lock);
+  _intern_table_t *table =
+      atomic_load_explicit(&shard->table, memory_order_relaxed);
+  slot = _lookup(shard, table, str, len, hash);
+  if (slot == 0)
+    slot = _add(shard, table, str, len, hash);
+  pthread_mutex_unlock(&shard->lock);
+
+  return slot << INTERN_SHARD_BITS | s;
+}
+
+uint32_t intern_find(const char *str, size_t len) {
+  uint32_t hash = strmap_hash(str, len);
+  uint32_t s = hash & (INTERN_SHARD_COUNT - 1);
+  _intern_shard_t *shard = &_shards[s];
+
+  uint32_t slot =
+      _lookup(shard, atomic_load_explicit(&shard->table, memory_order_acquire),
+              str, len, hash);
+  return slot == 0 ? INTERN_NONE : slot << INTERN_SHARD_BITS | s;
+}
+
+const char *intern_str(uint32_t id, size_t *len) {
+  _intern_shard_t *shard = &_shards[id & (INTERN_SHARD_COUNT - 1)];
+  _intern_entry_t *entry = _entry(shard, (id >> INTERN_SHARD_BITS) - 1);
+  if (len != NULL)
+    *len = entry->len;
+
+  return entry->str;
+}
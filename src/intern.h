@@ -0,0 +1,33 @@
+// t(heft)asm ; intern.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Process wide table of identifiers. Every distinct string is stored once
+/// and gets a 32-bit id, so labels, symbols and file names are compared and
+/// hashed as integers. The table only grows, ids and strings stay valid
+/// until the process exits. All functions are thread safe, looking up a
+/// string which is interned already takes no lock.
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Never handed out, stands for "no identifier"
+#define INTERN_NONE 0
+
+/// Returns the id of the first len bytes of str, adding them to the table
+/// if they were not interned yet
+uint32_t intern(const char *str, size_t len);
+
+/// Returns the id of the first len bytes of str, or INTERN_NONE if they
+/// were never interned
+uint32_t intern_find(const char *str, size_t len);
+
+/// Returns the terminated string of an id, its length is written to len if
+/// it is not NULL
+const char *intern_str(uint32_t id, size_t *len);
+
+#endif
@@ -0,0 +1,118 @@
+// t(heft)asm ; lexer.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <lexer.h>
+
+#include <assembler.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint8_t _is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+uint8_t lexer_map_file(const char *path, const char **src, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return 0;
+  }
+
+  *size = st.st_size;
+  *src = NULL;
+  if (*size == 0) {
+    close(fd);
+    return 1;
+  }
+
+  void *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  madvise(map, *size, MADV_SEQUENTIAL);
+  *src = map;
+  return 1;
+}
+
+void lexer_unmap_file(const char *src, size_t size) {
+  if (src != NULL)
+    munmap((void *)src, size);
+}
+
+size_t lexer_line_len(const char *src, size_t remaining) {
+  const char *end = memchr(src, '\n', remaining);
+  return end == NULL ? remaining : (size_t)(end - src);
+}
+
+void lexer_init(lexer_t *lex, const char *line, size_t len) {
+  lex->line = line;
+  lex->len = len;
+  lex->pos = 0;
+}
+
+uint8_t lexer_next(lexer_t *lex, asm_tok_t *tok) {
+  const char *line = lex->line;
+
+  for (;;) {
+    while (lex->pos < lex->len && _is_space(line[lex->pos]))
+      lex->pos++;
+
+    if (lex->pos >= lex->len || line[lex->pos] == TASM_CHAR_COMMENT)
+      return 0;
+
+    tok->col = lex->pos < UINT16_MAX ? lex->pos + 1 : UINT16_MAX;
+    tok->flags = 0;
+
+    if (line[lex->pos] == TASM_CHAR_STRING_CONT) {
+      size_t start = lex->pos + 1;
+      size_t i = start;
+      tok->flags = TOK_STRING;
+      while (i < lex->len && line[i] != TASM_CHAR_STRING_CONT) {
+        if (line[i] == TASM_CHAR_ESCAPE) {
+          tok->flags |= TOK_ESCAPED;
+          i++;
+        }
+        i++;
+      }
+
+      if (i >= lex->len) {
+        tok->flags |= TOK_UNTERMINATED;
+        i = lex->len;
+        lex->pos = lex->len;
+      } else {
+        lex->pos = i + 1;
+      }
+
+      tok->str = line + start;
+      tok->len = i - start;
+
+      if (lex->pos < lex->len && line[lex->pos] == TASM_CHAR_PARAM_SEPERATOR)
+        lex->pos++;
+      return 1;
+    }
+
+    size_t start = lex->pos;
+    while (lex->pos < lex->len && !_is_space(line[lex->pos]))
+      lex->pos++;
+
+    tok->str = line + start;
+    tok->len = lex->pos - start;
+    if (line[lex->pos - 1] == TASM_CHAR_PARAM_SEPERATOR)
+      tok->len--;
+
+    // A lone seperator is not a token
+    if (tok->len > 0)
+      return 1;
+  }
+}
@@ -0,0 +1,58 @@
+// t(heft)asm ; lexer.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Zero-copy tokenizer for theft assembly. Source files are mapped into
+/// memory and tokens are slices of that mapping, nothing is copied unless
+/// a string contains escape sequences.
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// The token is a string literal, str/len exclude the quotes
+#define TOK_STRING 0x01
+/// The string literal contains escape sequences which have to be converted
+#define TOK_ESCAPED 0x02
+/// The string literal is not closed before the end of the line
+#define TOK_UNTERMINATED 0x04
+/// The text is not from the source but made up by the assembler, it lives
+/// in the arena of the tree
+#define TOK_COMPUTED 0x08
+
+/// A slice of source text. The string is not terminated.
+typedef struct asm_tok_t {
+  const char *str;
+  uint32_t len;
+  /// Column of the token within its line, starting at 1. Saturates at
+  /// UINT16_MAX.
+  uint16_t col;
+  uint8_t flags;
+} asm_tok_t;
+
+/// Cursor over a single line of source text
+typedef struct lexer_t {
+  const char *line;
+  size_t len;
+  size_t pos;
+} lexer_t;
+
+/// Maps the file at path read-only into memory. Returns 0 on failure with
+/// errno set. Empty files yield a NULL mapping of size 0.
+uint8_t lexer_map_file(const char *path, const char **src, size_t *size);
+
+void lexer_unmap_file(const char *src, size_t size);
+
+/// Returns the length of the line starting at src, excluding the newline
+size_t lexer_line_len(const char *src, size_t remaining);
+
+void lexer_init(lexer_t *lex, const char *line, size_t len);
+
+/// Reads the next token of the line into tok. Returns 0 once the end of the
+/// line or a comment is reached.
+uint8_t lexer_next(lexer_t *lex, asm_tok_t *tok);
+
+#endif
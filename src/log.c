@@ -1,45 +1,84 @@
+// t(heft)asm ; log.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
 #include <log.h>
 
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-void log_dbg(const char *format, ...) {
-  printf("%s ", LOG_PREFIX_DBG);
-  va_list arg;
+static int level = LOG_LEVEL_INF;
+static _Thread_local uint8_t muted = LOG_MUTE_NONE;
 
-  va_start(arg, format);
-  vfprintf(stdout, format, arg);
-  va_end(arg);
-  printf(ANSI_RESET);
+static const char *prefixes[] = {LOG_PREFIX_ERR, LOG_PREFIX_WRN,
+                                 LOG_PREFIX_INF, LOG_PREFIX_DBG,
+                                 LOG_PREFIX_TRC};
+
+void log_init() {
+  setvbuf(stdout, NULL, _IOFBF, LOG_BUFFER_SIZE);
 }
 
-void log_inf(const char *format, ...) {
-  printf("%s ", LOG_PREFIX_INF);
-  va_list arg;
+void log_set_level(int new_level) {
+  level = new_level;
+}
 
-  va_start(arg, format);
-  vfprintf(stdout, format, arg);
-  va_end(arg);
-  printf(ANSI_RESET);
+int log_get_level() {
+  return level;
 }
 
-void log_wrn(const char *format, ...) {
-  printf("%s ", LOG_PREFIX_WRN);
-  va_list arg;
+uint8_t log_enabled(int msg_level) {
+  if (msg_level > level || msg_level > LOG_MAX_LEVEL)
+    return 0;
 
-  va_start(arg, format);
-  vfprintf(stdout, format, arg);
-  va_end(arg);
-  printf(ANSI_RESET);
+  if (muted == LOG_MUTE_ALL)
+    return 0;
+
+  return msg_level <= LOG_LEVEL_WRN || muted == LOG_MUTE_NONE;
 }
 
-void log_err(const char *format, ...) {
-  printf("%s ", LOG_PREFIX_ERR);
-  va_list arg;
+uint8_t log_mute(uint8_t mute) {
+  uint8_t prev = muted;
+  muted = mute;
+  return prev;
+}
+
+uint8_t log_get_mute() {
+  return muted;
+}
 
+void log_write(int msg_level, const char *format, ...) {
+  if (!log_enabled(msg_level))
+    return;
+
+  // The message is formatted in one piece, so that it is a single write to
+  // stdout which does not get mixed up with the messages of other threads
+  char buf[512];
+  char *msg = buf;
+  va_list arg;
   va_start(arg, format);
-  vfprintf(stdout, format, arg);
+  int len = vsnprintf(buf, sizeof(buf), format, arg);
   va_end(arg);
-  printf(ANSI_RESET);
+  if (len < 0)
+    return;
+
+  if ((size_t)len >= sizeof(buf)) {
+    msg = malloc(len + 1);
+    va_start(arg, format);
+    vsnprintf(msg, len + 1, format, arg);
+    va_end(arg);
+  }
+
+  flockfile(stdout);
+  fputs(prefixes[msg_level], stdout);
+  fputc(' ', stdout);
+  fwrite(msg, 1, len, stdout);
+  fputs(ANSI_RESET, stdout);
+  if (msg_level <= LOG_LEVEL_WRN)
+    fflush(stdout);
+  funlockfile(stdout);
+
+  if (msg != buf)
+    free(msg);
 }
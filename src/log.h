@@ -4,7 +4,9 @@
 // Licensed under the BSD 3-Clause License
 //----------------------------------------
 
-/// Simple logging functionality with different status indicators
+/// Simple logging functionality with different status indicators. Messages
+/// above the level set with log_set_level are dropped, messages above
+/// LOG_MAX_LEVEL are not even compiled in.
 #ifndef LOG_H
 #define LOG_H
 
@@ -15,14 +17,72 @@
 #define ANSI_ORANGE ESC "[33m"
 #define ANSI_RED ESC "[31m"
 
+#define LOG_PREFIX_TRC ANSI_GRAY "[t]"
 #define LOG_PREFIX_DBG ANSI_GRAY "[*]"
 #define LOG_PREFIX_INF ANSI_GREEN "[i]"
 #define LOG_PREFIX_WRN ANSI_ORANGE "[w]"
 #define LOG_PREFIX_ERR ANSI_RED "[e]"
 
-void log_dbg(const char *format, ...);
-void log_inf(const char *format, ...);
-void log_wrn(const char *format, ...);
-void log_err(const char *format, ...);
+#define LOG_LEVEL_ERR 0
+#define LOG_LEVEL_WRN 1
+#define LOG_LEVEL_INF 2
+#define LOG_LEVEL_DBG 3
+/// Dumps of the tree and the encoded output
+#define LOG_LEVEL_TRC 4
+
+/// Highest level compiled in, release builds leave out debug and trace
+/// output including their call sites
+#ifndef LOG_MAX_LEVEL
+#ifdef NDEBUG
+#define LOG_MAX_LEVEL LOG_LEVEL_INF
+#else
+#define LOG_MAX_LEVEL LOG_LEVEL_TRC
+#endif
+#endif
+
+/// Values of log_mute
+#define LOG_MUTE_NONE 0
+/// Drops debug and info messages
+#define LOG_MUTE_INFO 1
+/// Drops every message
+#define LOG_MUTE_ALL 2
+
+/// Size of the stdout buffer set up by log_init
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+#include <stdint.h>
+
+/// Makes stdout fully buffered. Warnings and errors flush it, everything
+/// else is written in large chunks.
+void log_init();
+
+/// Sets the highest level which is written, LOG_LEVEL_INF by default
+void log_set_level(int level);
+
+int log_get_level();
+
+/// Returns 1 if messages of the given level are written by the calling
+/// thread
+uint8_t log_enabled(int level);
+
+/// Suppresses messages of the calling thread according to one of the
+/// LOG_MUTE_* values. Returns the previous setting. Tasks of a pool run with
+/// the setting of the thread which queued them.
+uint8_t log_mute(uint8_t mute);
+
+uint8_t log_get_mute();
+
+void log_write(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_DBG
+#define log_dbg(...) log_write(LOG_LEVEL_DBG, __VA_ARGS__)
+#else
+#define log_dbg(...) ((void)0)
+#endif
+
+#define log_inf(...) log_write(LOG_LEVEL_INF, __VA_ARGS__)
+#define log_wrn(...) log_write(LOG_LEVEL_WRN, __VA_ARGS__)
+#define log_err(...) log_write(LOG_LEVEL_ERR, __VA_ARGS__)
 
 #endif
@@ -5,35 +5,177 @@
 
 #include <assembler.h>
 #include <log.h>
+#include <server.h>
+#include <tef.h>
+#include <watch.h>
 
 #include <argp.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define AUTHOR "Marie Eckert"
 
-const char *argp_program_version = "tasm 0.1.0 (testing)";
+#define OPT_STATS 0x100
+#define OPT_BATCH 0x101
+#define OPT_SERVE 0x102
+#define OPT_CONNECT 0x103
+#define OPT_WATCH 0x104
+#define OPT_STREAM 0x105
+#define OPT_LINK 0x106
+#define OPT_INCLUDE_ONCE 0x107
+#define OPT_CYCLES 0x108
+#define OPT_RUN 0x109
+
+/// Output of -i if -o is not given
+#define TASM_DEFAULT_OUT "asm.out"
+
+const char *argp_program_version = "tasm " TASM_VERSION " (testing)";
 const char *argp_program_bug_address =
     "https://github.com/FelixEcker/tasm/issues";
 const char description[] = "Assembler for the Theft fantasy cpu\n"
                            "Author: " AUTHOR;
-const char args_doc[] = "";
+const char args_doc[] = "[FILE...]";
 
 static struct argp_option options[] = {
     {"in", 'i', "FILE", 0, "Specify the input assembly source"},
     {"out", 'o', "FILE", 0, "Specify the output filename"},
     {"format", 'f', "rom/tef", 0, "Specify the output format (default=rom)"},
-    {"search-dirs", 's', "DIRßCOTRY", 0,
+    {"search-dirs", 's', "DIRECTORIES", 0,
      "Specify a colon seperated list of "
      "directories to search through for included files"},
+    {"include-once", OPT_INCLUDE_ONCE, 0, 0,
+     "Include every file only once, leaving out later includes of it"},
+    {"optimize", 'O', 0, 0,
+     "Remove redundant instructions, reporting what was removed"},
+    {"cycles", OPT_CYCLES, 0, 0,
+     "Print the estimated cycles of every instruction and label"},
+    {"run", OPT_RUN, 0, 0,
+     "Run the assembled rom and check the assertions it makes"},
+    {"jobs", 'j', "N", 0,
+     "Number of worker threads used for assembling (default=1)"},
+    {"cache-dir", 'c', "DIRECTORY", 0,
+     "Cache parsed source files in DIRECTORY to speed up later runs"},
+    {"stats", OPT_STATS, 0, 0,
+     "Print statistics of the run, followed by a JSON summary line"},
+    {"batch", OPT_BATCH, "MANIFEST", 0,
+     "Assemble every \"input output [format]\" line of MANIFEST"},
+    {"serve", OPT_SERVE, "SOCKET", 0,
+     "Run as a server on SOCKET, keeping parsed files in memory"},
+    {"connect", OPT_CONNECT, "SOCKET", 0,
+     "Let the server on SOCKET assemble, defaults to $TASM_SERVER"},
+    {"watch", OPT_WATCH, 0, 0,
+     "Assemble again whenever one of the source files changes"},
+    {"stream", OPT_STREAM, 0, 0,
+     "Assemble in a single pass, patching forward references at the end"},
+    {"link", OPT_LINK, 0, 0,
+     "Link the tef objects given as arguments into a rom"},
+    {"quiet", 'q', 0, 0,
+     "Only print warnings and errors, given twice only errors"},
+    {"verbose", 'v', 0, 0,
+     "Print debug messages, given twice also dump the tree and output"},
     {0, 0, 0, 0}};
 
 struct arguments {
   char *in;
+  /// NULL unless given, see TASM_DEFAULT_OUT
   char *out;
   char *format;
-  char *search_dirs;
+  asm_opts_t opts;
+  /// Socket to serve on or to send the jobs to
+  char *serve;
+  char *connect;
+  uint8_t watch;
+  uint8_t link;
+  int log_level;
+  /// Batch of inputs given as arguments or in a manifest
+  size_t batch_count;
+  size_t batch_capacity;
+  asm_batch_job_t *batch;
 };
 
+static void _add_batch_job(struct arguments *args, char *in, char *out,
+                           char *format) {
+  if (args->batch_count == args->batch_capacity) {
+    args->batch_capacity = args->batch_capacity ? args->batch_capacity * 2 : 8;
+    args->batch =
+        realloc(args->batch, sizeof(asm_batch_job_t) * args->batch_capacity);
+  }
+
+  asm_batch_job_t *job = &args->batch[args->batch_count++];
+  memset(job, 0, sizeof(asm_batch_job_t));
+  job->in = in;
+  job->out = out;
+  job->format = format;
+}
+
+/// Output of an input given as argument: its name with the extension
+/// replaced by the format
+static char *_batch_out_name(char *in, char *format) {
+  size_t len = strlen(in);
+  char *dot = strrchr(in, '.');
+  if (dot != NULL && strchr(dot, '/') == NULL)
+    len = dot - in;
+
+  char *out = malloc(len + strlen(format) + 2);
+  sprintf(out, "%.*s.%s", (int)len, in, format);
+  return out;
+}
+
+/// Reads a manifest, a line per job of the form "input output [format]".
+/// Empty lines and lines starting with '#' or ';' are skipped.
+static uint8_t _read_manifest(struct arguments *args, char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+
+  char *line = NULL;
+  size_t line_cap = 0;
+  size_t line_num = 0;
+  while (getline(&line, &line_cap, f) != -1) {
+    line_num++;
+    char *save;
+    char *in = strtok_r(line, " \t\r\n", &save);
+    if (in == NULL || in[0] == '#' || in[0] == ';')
+      continue;
+
+    char *out = strtok_r(NULL, " \t\r\n", &save);
+    char *format = strtok_r(NULL, " \t\r\n", &save);
+    if (out == NULL) {
+      log_err("%s:%zu: missing output file\n", path, line_num);
+      continue;
+    }
+
+    // Without a format the job uses -f, which may still follow
+    _add_batch_job(args, strdup(in), strdup(out),
+                   format != NULL ? strdup(format) : NULL);
+  }
+
+  free(line);
+  fclose(f);
+  return 1;
+}
+
+/// Runs the jobs in watch mode or hands them to the server if requested.
+/// Returns 0 if they have to be assembled right here.
+static uint8_t _dispatch(struct arguments *args, asm_batch_job_t *jobs,
+                        size_t count, uint8_t batch, err_t *err) {
+  if (args->watch) {
+    *err = watch_run(jobs, count, batch, &args->opts);
+    return 1;
+  }
+
+  if (args->connect == NULL || args->connect[0] == 0)
+    return 0;
+
+  if (server_request(args->connect, jobs, count, batch, &args->opts,
+                     args->log_level, err))
+    return 1;
+
+  log_wrn("No server on \"%s\", assembling locally\n", args->connect);
+  return 0;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   struct arguments *args = state->input;
   switch (key) {
@@ -47,7 +189,60 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     args->format = arg;
     break;
   case 's':
-    args->search_dirs = arg;
+    args->opts.search_dirs = arg;
+    break;
+  case 'j':
+    args->opts.jobs = strtoul(arg, NULL, 10);
+    if (args->opts.jobs == 0)
+      argp_error(state, "invalid number of jobs \"%s\"", arg);
+    break;
+  case 'c':
+    args->opts.cache_dir = arg;
+    break;
+  case OPT_STATS:
+    args->opts.stats = 1;
+    break;
+  case OPT_BATCH:
+    if (!_read_manifest(args, arg))
+      argp_error(state, "could not read manifest \"%s\"", arg);
+    break;
+  case OPT_SERVE:
+    args->serve = arg;
+    break;
+  case OPT_CONNECT:
+    args->connect = arg;
+    break;
+  case OPT_WATCH:
+    args->watch = 1;
+    break;
+  case OPT_STREAM:
+    args->opts.stream = 1;
+    break;
+  case OPT_LINK:
+    args->link = 1;
+    break;
+  case OPT_INCLUDE_ONCE:
+    args->opts.include_once = 1;
+    break;
+  case 'O':
+    args->opts.optimize = 1;
+    break;
+  case OPT_CYCLES:
+    args->opts.cycles = 1;
+    break;
+  case OPT_RUN:
+    args->opts.run = 1;
+    break;
+  case 'q':
+    if (args->log_level > LOG_LEVEL_ERR)
+      args->log_level--;
+    break;
+  case 'v':
+    if (args->log_level < LOG_LEVEL_TRC)
+      args->log_level++;
+    break;
+  case ARGP_KEY_ARG:
+    _add_batch_job(args, arg, NULL, NULL);
     break;
   default:
     return ARGP_ERR_UNKNOWN;
@@ -61,17 +256,98 @@ static struct argp argp = {options, parse_opt, args_doc, description};
 int main(int argc, char **argv) {
   struct arguments args;
   args.in = NULL;
-  args.out = "asm.out";
+  args.out = NULL;
   args.format = TASM_OUT_ROM;
+  asm_init_opts(&args.opts);
+  args.batch_count = 0;
+  args.batch_capacity = 0;
+  args.serve = NULL;
+  args.connect = getenv("TASM_SERVER");
+  args.watch = 0;
+  args.link = 0;
+  args.log_level = LOG_LEVEL_INF;
+  args.batch = NULL;
 
   argp_parse(&argp, argc, argv, 0, 0, &args);
 
-  printf("%s by " AUTHOR "\n\n", argp_program_version);
+  log_init();
+  log_set_level(args.log_level);
+  if (args.log_level >= LOG_LEVEL_INF)
+    printf("%s by " AUTHOR "\n\n", argp_program_version);
+
+  // Streaming keeps nothing around to watch or serve from
+  if (args.opts.stream && (args.watch || args.serve != NULL)) {
+    log_err("--stream can not be combined with --watch or --serve\n");
+    return 1;
+  }
+
+  if (args.serve != NULL)
+    return server_run(args.serve, &args.opts);
+
+  if (args.link) {
+    if (args.in != NULL)
+      _add_batch_job(&args, args.in, NULL, NULL);
+    if (args.batch_count == 0) {
+      log_err("Missing objects to link!\n");
+      return 1;
+    }
+
+    char **paths = malloc(sizeof(char *) * args.batch_count);
+    for (size_t i = 0; i < args.batch_count; i++)
+      paths[i] = args.batch[i].in;
+    err_t err = tef_link(paths, args.batch_count,
+                         args.out != NULL ? args.out : TASM_DEFAULT_OUT);
+    free(paths);
+    return err;
+  }
+
+  if (args.batch_count > 0) {
+    // -o names the output of -i, or of the only input given as argument
+    size_t unnamed = 0;
+    for (size_t i = 0; i < args.batch_count; i++)
+      unnamed += args.batch[i].out == NULL;
+    if (args.in != NULL) {
+      _add_batch_job(&args, args.in,
+                     args.out != NULL ? args.out : TASM_DEFAULT_OUT,
+                     args.format);
+    } else if (args.out != NULL && unnamed != 1) {
+      log_err("-o can only be used with a single input\n");
+      return 1;
+    } else if (args.out != NULL) {
+      for (size_t i = 0; i < args.batch_count; i++)
+        if (args.batch[i].out == NULL)
+          args.batch[i].out = args.out;
+    }
+
+    // Inputs given as arguments only know their format once all options
+    // are parsed
+    for (size_t i = 0; i < args.batch_count; i++) {
+      asm_batch_job_t *job = &args.batch[i];
+      if (job->format == NULL)
+        job->format = args.format;
+      if (job->out == NULL)
+        job->out = _batch_out_name(job->in, job->format);
+    }
+
+    err_t err;
+    if (_dispatch(&args, args.batch, args.batch_count, 1, &err))
+      return err;
+
+    return asm_write_batch(args.batch, args.batch_count, &args.opts, NULL);
+  }
 
   if (args.in == NULL) {
     log_err("Missing assembler input file!\n");
     return 1;
   }
 
-  return asm_write_file(args.in, args.out, args.format);
+  if (args.out == NULL)
+    args.out = TASM_DEFAULT_OUT;
+
+  asm_batch_job_t job = {.in = args.in, .out = args.out, .format = args.format};
+  err_t err;
+  if (_dispatch(&args, &job, 1, 0, &err))
+    return err;
+
+  return asm_write_file(args.in, args.out, args.format, &args.opts);
 }
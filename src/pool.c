@@ -0,0 +1,117 @@
+// t(heft)asm ; pool.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <pool.h>
+
+#include <log.h>
+
+#include <stdlib.h>
+
+/// Pops the next queued task, the pool lock has to be held
+static pool_task_t *_pop(pool_t *pool) {
+  pool_task_t *task = pool->head;
+  if (task == NULL)
+    return NULL;
+
+  pool->head = task->next;
+  if (pool->head == NULL)
+    pool->tail = NULL;
+  return task;
+}
+
+/// Runs task with the pool lock released, the lock has to be held
+static void _run(pool_t *pool, pool_task_t *task) {
+  pthread_mutex_unlock(&pool->lock);
+  uint8_t mute = log_mute(task->mute);
+  task->fn(task->arg);
+  log_mute(mute);
+  pthread_mutex_lock(&pool->lock);
+
+  task->done = 1;
+  pthread_cond_broadcast(&pool->done_cond);
+}
+
+static void *_worker(void *arg) {
+  pool_t *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    pool_task_t *task = _pop(pool);
+    if (task != NULL) {
+      _run(pool, task);
+      continue;
+    }
+
+    if (pool->stop)
+      break;
+
+    pthread_cond_wait(&pool->work_cond, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+void pool_init(pool_t *pool, size_t thread_count) {
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+  pool->head = NULL;
+  pool->tail = NULL;
+  pool->stop = 0;
+  pool->thread_count = thread_count;
+  pool->threads = malloc(sizeof(pthread_t) * thread_count);
+
+  for (size_t i = 0; i < thread_count; i++)
+    pthread_create(&pool->threads[i], NULL, _worker, pool);
+}
+
+void pool_destroy(pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->thread_count; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  free(pool->threads);
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+void pool_submit(pool_t *pool, pool_task_t *task, void (*fn)(void *),
+                 void *arg) {
+  task->fn = fn;
+  task->arg = arg;
+  task->done = 0;
+  task->mute = log_get_mute();
+  task->next = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail == NULL)
+    pool->head = task;
+  else
+    pool->tail->next = task;
+  pool->tail = task;
+
+  pthread_cond_signal(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(pool_t *pool, pool_task_t *task) {
+  pthread_mutex_lock(&pool->lock);
+  while (!task->done) {
+    pool_task_t *queued = _pop(pool);
+    if (queued != NULL) {
+      _run(pool, queued);
+      continue;
+    }
+
+    pthread_cond_wait(&pool->done_cond, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
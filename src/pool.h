@@ -0,0 +1,54 @@
+// t(heft)asm ; pool.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Fixed size pool of worker threads executing queued tasks. Tasks are
+/// embedded in the caller's data, the pool never allocates per task.
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct pool_task_t {
+  void (*fn)(void *arg);
+  void *arg;
+  /// Set once fn has returned, read under the pool lock
+  uint8_t done;
+  /// log_mute of the thread which queued the task, fn runs with it
+  uint8_t mute;
+  struct pool_task_t *next;
+} pool_task_t;
+
+typedef struct pool_t {
+  pthread_mutex_t lock;
+  /// Signaled when a task is queued or the pool is stopped
+  pthread_cond_t work_cond;
+  /// Broadcast whenever a task finishes
+  pthread_cond_t done_cond;
+  pool_task_t *head;
+  pool_task_t *tail;
+  uint8_t stop;
+  size_t thread_count;
+  pthread_t *threads;
+} pool_t;
+
+/// Starts thread_count worker threads
+void pool_init(pool_t *pool, size_t thread_count);
+
+/// Waits for all queued tasks to finish and joins the workers
+void pool_destroy(pool_t *pool);
+
+/// Queues fn(arg) using the given task storage, which has to stay valid
+/// until the task is done. May be called from within a task.
+void pool_submit(pool_t *pool, pool_task_t *task, void (*fn)(void *),
+                 void *arg);
+
+/// Blocks until task is done. The calling thread executes queued tasks
+/// while it waits, so waiting from the thread which submitted is fine.
+void pool_wait(pool_t *pool, pool_task_t *task);
+
+#endif
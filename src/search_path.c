@@ -0,0 +1,132 @@
+// t(heft)asm ; search_path.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <search_path.h>
+
+#include <intern.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+//-- Static Utilities --//
+
+static uint8_t _is_file(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && !S_ISDIR(st.st_mode);
+}
+
+/// Returns where path is found, allocated with malloc
+static char *_locate(search_t *search, const char *path, size_t len) {
+  char *given = strndup(path, len);
+  if (search->literal || given[0] == '/' || _is_file(given))
+    return given;
+
+  for (size_t i = 0; i < search->dir_count; i++) {
+    char *candidate = malloc(strlen(search->dirs[i]) + len + 2);
+    sprintf(candidate, "%s/%s", search->dirs[i], given);
+    if (_is_file(candidate)) {
+      free(given);
+      return candidate;
+    }
+
+    free(candidate);
+  }
+
+  return given;
+}
+
+//-- Search --//
+
+void search_init(search_t *search, const char *dirs, uint8_t literal) {
+  pthread_mutex_init(&search->lock, NULL);
+  arena_init(&search->arena);
+  search->dir_count = 0;
+  search->dirs = NULL;
+  search->literal = literal;
+  strmap_init(&search->map);
+  search->file_count = 0;
+  search->file_capacity = 0;
+  search->files = NULL;
+  idmap_init(&search->claimed);
+
+  size_t dir_capacity = 0;
+  while (dirs != NULL && *dirs != 0) {
+    const char *end = strchr(dirs, SEARCH_PATH_SEPARATOR);
+    size_t len = end != NULL ? (size_t)(end - dirs) : strlen(dirs);
+
+    // Empty entries are skipped, trailing slashes are left out
+    while (len > 1 && dirs[len - 1] == '/')
+      len--;
+    if (len > 0) {
+      arena_grow_array(&search->arena, (void **)&search->dirs, sizeof(char *),
+                       search->dir_count, &dir_capacity);
+      search->dirs[search->dir_count++] =
+          arena_strndup(&search->arena, dirs, len);
+    }
+
+    dirs = end != NULL ? end + 1 : dirs + strlen(dirs);
+  }
+}
+
+void search_free(search_t *search) {
+  idmap_free(&search->claimed);
+  strmap_free(&search->map);
+  arena_free(&search->arena);
+  pthread_mutex_destroy(&search->lock);
+}
+
+const search_file_t *search_find(search_t *search, const char *path,
+                                 size_t len) {
+  pthread_mutex_lock(&search->lock);
+  size_t ix;
+  search_file_t *file = NULL;
+  if (strmap_get(&search->map, path, len, &ix))
+    file = search->files[ix];
+  pthread_mutex_unlock(&search->lock);
+  if (file != NULL)
+    return file;
+
+  // The disk is looked at without the lock. A path looked up by two threads
+  // at once is located twice, the first result is kept.
+  char *located = _locate(search, path, len);
+  uint32_t id = search_canonical(search, located);
+
+  pthread_mutex_lock(&search->lock);
+  if (strmap_get(&search->map, path, len, &ix)) {
+    file = search->files[ix];
+  } else {
+    file = arena_alloc(&search->arena, sizeof(search_file_t));
+    file->path = arena_strdup(&search->arena, located);
+    file->id = id;
+    strmap_put(&search->map, arena_strndup(&search->arena, path, len), len,
+               search->file_count, NULL);
+    arena_grow_array(&search->arena, (void **)&search->files,
+                     sizeof(search_file_t *), search->file_count,
+                     &search->file_capacity);
+    search->files[search->file_count++] = file;
+  }
+  pthread_mutex_unlock(&search->lock);
+
+  free(located);
+  return file;
+}
+
+uint32_t search_canonical(search_t *search, const char *path) {
+  char resolved[PATH_MAX];
+  if (!search->literal && realpath(path, resolved) != NULL)
+    path = resolved;
+
+  return intern(path, strlen(path));
+}
+
+uint8_t search_claim(search_t *search, uint32_t id) {
+  pthread_mutex_lock(&search->lock);
+  uint8_t claimed = idmap_put(&search->claimed, id, 0, NULL);
+  pthread_mutex_unlock(&search->lock);
+  return claimed;
+}
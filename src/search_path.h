@@ -0,0 +1,70 @@
+// t(heft)asm ; search_path.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Lookup of included files. A path is looked for relative to the working
+/// directory first and then in every search directory in order. Every file
+/// is identified by its canonical path, so the same file reached through
+/// different paths is recognized. Lookups are kept for the rest of the run,
+/// a path included many times is only looked up once.
+#ifndef SEARCH_PATH_H
+#define SEARCH_PATH_H
+
+#include <arena.h>
+#include <idmap.h>
+#include <strmap.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Separates the directories of a search path
+#define SEARCH_PATH_SEPARATOR ':'
+
+typedef struct search_file_t {
+  /// Where the file was found, or the path as included if it was found
+  /// nowhere, so opening it fails with the usual error
+  const char *path;
+  /// Interned canonical path
+  uint32_t id;
+} search_file_t;
+
+/// Lookups of a run, all functions are thread safe
+typedef struct search_t {
+  pthread_mutex_t lock;
+  /// Holds the directories, the files and their paths
+  arena_t arena;
+  size_t dir_count;
+  char **dirs;
+  /// Paths are taken as they are and files are never looked at, for
+  /// sources which do not come from the disk
+  uint8_t literal;
+  /// Maps included paths to their index in files
+  strmap_t map;
+  size_t file_count;
+  size_t file_capacity;
+  search_file_t **files;
+  /// Canonical paths of the files claimed by search_claim
+  idmap_t claimed;
+} search_t;
+
+/// dirs is a list of directories separated by SEARCH_PATH_SEPARATOR, it
+/// may be NULL
+void search_init(search_t *search, const char *dirs, uint8_t literal);
+
+void search_free(search_t *search);
+
+/// Looks up the first len bytes of path. The result stays valid until the
+/// search is freed.
+const search_file_t *search_find(search_t *search, const char *path,
+                                 size_t len);
+
+/// Returns the interned canonical path of path, which is not searched for
+uint32_t search_canonical(search_t *search, const char *path);
+
+/// Returns 1 if the file with the canonical path id was not claimed before
+uint8_t search_claim(search_t *search, uint32_t id);
+
+#endif
@@ -0,0 +1,450 @@
+// t(heft)asm ; server.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <server.h>
+
+#include <log.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVER_MAGIC 0x53534154 // "TASS"
+
+/// Requests larger than this are rejected
+#define SERVER_MAX_PAYLOAD (16 * 1024 * 1024)
+/// Clients which stall for longer while sending a request or receiving the
+/// response are dropped, so they can not block the ones behind them
+#define SERVER_TIMEOUT_SEC 5
+
+/// Start of a request, sent together with the client's stdout and stderr.
+/// It is followed by size bytes of terminated strings: the working
+/// directory and the search directories, then input, output and format of
+/// every job.
+typedef struct _request_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;
+  uint32_t job_count;
+  uint32_t jobs;
+  uint8_t stats;
+  uint8_t batch;
+  uint8_t log_level;
+  uint8_t include_once;
+  uint8_t optimize;
+  uint8_t cycles;
+  uint8_t run;
+} _request_t;
+
+/// Answer to a request, sent once all jobs are done
+typedef struct _response_t {
+  uint32_t magic;
+  int32_t err;
+} _response_t;
+
+//-- Static Utilities --//
+
+static double _now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static uint8_t _write_all(int fd, const void *buf, size_t size) {
+  const char *ptr = buf;
+  while (size > 0) {
+    ssize_t n = write(fd, ptr, size);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    ptr += n;
+    size -= n;
+  }
+
+  return 1;
+}
+
+static uint8_t _read_all(int fd, void *buf, size_t size) {
+  char *ptr = buf;
+  while (size > 0) {
+    ssize_t n = read(fd, ptr, size);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    ptr += n;
+    size -= n;
+  }
+
+  return 1;
+}
+
+/// Fills addr with the socket path, returns 0 if it is too long
+static uint8_t _socket_addr(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path))
+    return 0;
+
+  strcpy(addr->sun_path, path);
+  return 1;
+}
+
+/// Connects to the socket at path, returns -1 on failure
+static int _connect(const char *path) {
+  struct sockaddr_un addr;
+  if (!_socket_addr(path, &addr))
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/// Binds a listening socket to path. A socket file left behind by a server
+/// which is gone is replaced, a running server is left alone.
+static int _listen(const char *path) {
+  struct sockaddr_un addr;
+  if (!_socket_addr(path, &addr)) {
+    log_err("Socket path \"%s\" is too long\n", path);
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    log_err("Error creating socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  if (bound == -1 && errno == EADDRINUSE) {
+    int running = _connect(path);
+    if (running != -1) {
+      close(running);
+      close(fd);
+      log_err("A server is already listening on \"%s\"\n", path);
+      return -1;
+    }
+
+    unlink(path);
+    bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  }
+
+  if (bound == -1 || listen(fd, 16) == -1) {
+    log_err("Error listening on \"%s\": %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/// Takes the next string of a request payload, NULL if there is none
+static char *_next_str(char **pos, char *end) {
+  char *str = *pos;
+  if (str >= end)
+    return NULL;
+
+  char *nul = memchr(str, 0, end - str);
+  if (nul == NULL)
+    return NULL;
+
+  *pos = nul + 1;
+  return str;
+}
+
+//-- Server --//
+
+/// Redirects stdout and stderr to out and err, flushing what was written
+/// before
+static void _redirect(int out, int err) {
+  fflush(stdout);
+  fflush(stderr);
+  dup2(out, STDOUT_FILENO);
+  dup2(err, STDERR_FILENO);
+}
+
+/// Closes every descriptor received with msg
+static void _close_received(struct msghdr *msg) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; i++) {
+      int received;
+      memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      close(received);
+    }
+  }
+}
+
+/// Handles a single connection. Everything the assembler logs goes to the
+/// client's streams.
+static void _serve(int fd, asm_opts_t *opts, asm_share_t *share,
+                   int saved_out, int saved_err) {
+  _request_t req;
+  struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * 2)];
+    struct cmsghdr align;
+  } ctrl;
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+
+  struct timeval timeout = {.tv_sec = SERVER_TIMEOUT_SEC};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  ssize_t n = recvmsg(fd, &msg, MSG_WAITALL);
+  struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg == NULL || (msg.msg_flags & MSG_CTRUNC) ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2) ||
+      CMSG_NXTHDR(&msg, cmsg) != NULL) {
+    if (n > 0)
+      _close_received(&msg);
+    log_wrn("Dropped a request without output streams\n");
+    return;
+  }
+
+  int streams[2];
+  memcpy(streams, CMSG_DATA(cmsg), sizeof(streams));
+
+  char *payload = NULL;
+  _response_t res = {.magic = SERVER_MAGIC, .err = TASM_IO_ERROR};
+  if (n != sizeof(req) || req.magic != SERVER_MAGIC ||
+      req.version != SERVER_PROTOCOL_VERSION || req.job_count == 0 ||
+      req.size > SERVER_MAX_PAYLOAD) {
+    log_wrn("Dropped a malformed request\n");
+    goto serve_cleanup;
+  }
+
+  payload = malloc(req.size);
+  if (!_read_all(fd, payload, req.size)) {
+    log_wrn("Dropped an incomplete request\n");
+    goto serve_cleanup;
+  }
+
+  char *pos = payload;
+  char *end = payload + req.size;
+  char *cwd = _next_str(&pos, end);
+  char *search_dirs = _next_str(&pos, end);
+  if (search_dirs == NULL)
+    cwd = NULL;
+  asm_batch_job_t *jobs = calloc(req.job_count, sizeof(asm_batch_job_t));
+  for (size_t i = 0; i < req.job_count && cwd != NULL; i++) {
+    jobs[i].in = _next_str(&pos, end);
+    jobs[i].out = _next_str(&pos, end);
+    jobs[i].format = _next_str(&pos, end);
+    if (jobs[i].format == NULL)
+      cwd = NULL;
+  }
+
+  if (cwd == NULL) {
+    log_wrn("Dropped a malformed request\n");
+    free(jobs);
+    goto serve_cleanup;
+  }
+
+  double start = _now_ms();
+  size_t hits = share->hits;
+  size_t refreshes = share->refreshes;
+  _redirect(streams[0], streams[1]);
+
+  int server_level = log_get_level();
+  log_set_level(req.log_level);
+  asm_opts_t req_opts = *opts;
+  req_opts.jobs = req.jobs > 0 ? req.jobs : 1;
+  req_opts.stats = req.stats;
+  req_opts.search_dirs = search_dirs[0] != 0 ? search_dirs : NULL;
+  req_opts.include_once = req.include_once;
+  req_opts.optimize = req.optimize;
+  req_opts.cycles = req.cycles;
+  req_opts.run = req.run;
+  if (chdir(cwd) == -1) {
+    log_err("Error entering \"%s\": %s\n", cwd, strerror(errno));
+    res.err = TASM_IO_ERROR;
+  } else if (req.batch) {
+    res.err = asm_write_batch(jobs, req.job_count, &req_opts, share);
+  } else {
+    res.err = asm_write_job(&jobs[0], &req_opts, share);
+  }
+
+  _redirect(saved_out, saved_err);
+  log_set_level(server_level);
+
+  // No tree of the request is alive anymore
+  asm_share_sweep(share);
+  log_inf("%s%s: %s in %.2f ms, %zu files reused, %zu parsed again\n",
+          jobs[0].in, req.job_count > 1 ? " ..." : "",
+          asm_errname(res.err), _now_ms() - start, share->hits - hits,
+          share->refreshes - refreshes);
+  fflush(stdout);
+  free(jobs);
+
+serve_cleanup:
+  if (!_write_all(fd, &res, sizeof(res)))
+    log_wrn("Client went away before the result was sent\n");
+  close(streams[0]);
+  close(streams[1]);
+  free(payload);
+}
+
+err_t server_run(const char *path, asm_opts_t *opts) {
+  // Clients going away must not take the server with them
+  signal(SIGPIPE, SIG_IGN);
+
+  // Requests change the working directory, the cache has to stay put
+  asm_opts_t server_opts = *opts;
+  char *cache_dir = NULL;
+  if (opts->cache_dir != NULL && opts->cache_dir[0] != '/') {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+      cache_dir = malloc(strlen(cwd) + strlen(opts->cache_dir) + 2);
+      sprintf(cache_dir, "%s/%s", cwd, opts->cache_dir);
+      server_opts.cache_dir = cache_dir;
+    }
+  }
+
+  int sock = _listen(path);
+  if (sock == -1) {
+    free(cache_dir);
+    return TASM_IO_ERROR;
+  }
+
+  asm_share_t share;
+  asm_share_init(&share, &server_opts);
+  share.persistent = 1;
+
+  int saved_out = dup(STDOUT_FILENO);
+  int saved_err = dup(STDERR_FILENO);
+  log_inf("Listening on \"%s\"\n", path);
+  fflush(stdout);
+
+  for (;;) {
+    int fd = accept(sock, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      log_err("Error accepting a connection: %s\n", strerror(errno));
+      break;
+    }
+
+    _serve(fd, &server_opts, &share, saved_out, saved_err);
+    close(fd);
+  }
+
+  close(saved_out);
+  close(saved_err);
+  close(sock);
+  unlink(path);
+  asm_share_free(&share);
+  free(cache_dir);
+  return TASM_IO_ERROR;
+}
+
+//-- Client --//
+
+uint8_t server_request(const char *path, asm_batch_job_t *jobs, size_t count,
+                       uint8_t batch, asm_opts_t *opts, int log_level,
+                       err_t *err) {
+  char cwd[PATH_MAX];
+  if (count == 0 || getcwd(cwd, sizeof(cwd)) == NULL)
+    return 0;
+
+  int fd = _connect(path);
+  if (fd == -1)
+    return 0;
+
+  const char *search_dirs = opts->search_dirs != NULL ? opts->search_dirs : "";
+  size_t size = strlen(cwd) + strlen(search_dirs) + 2;
+  for (size_t i = 0; i < count; i++)
+    size += strlen(jobs[i].in) + strlen(jobs[i].out) +
+            strlen(jobs[i].format) + 3;
+
+  char *payload = malloc(size);
+  char *pos = stpcpy(payload, cwd) + 1;
+  pos = stpcpy(pos, search_dirs) + 1;
+  for (size_t i = 0; i < count; i++) {
+    pos = stpcpy(pos, jobs[i].in) + 1;
+    pos = stpcpy(pos, jobs[i].out) + 1;
+    pos = stpcpy(pos, jobs[i].format) + 1;
+  }
+
+  _request_t req = {.magic = SERVER_MAGIC,
+                    .version = SERVER_PROTOCOL_VERSION,
+                    .size = size,
+                    .job_count = count,
+                    .jobs = opts->jobs,
+                    .stats = opts->stats,
+                    .batch = batch,
+                    .log_level = log_level,
+                    .include_once = opts->include_once,
+                    .optimize = opts->optimize,
+                    .cycles = opts->cycles,
+                    .run = opts->run};
+  struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * 2)];
+    struct cmsghdr align;
+  } ctrl;
+  memset(&ctrl, 0, sizeof(ctrl));
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+  int streams[2] = {STDOUT_FILENO, STDERR_FILENO};
+  memcpy(CMSG_DATA(cmsg), streams, sizeof(streams));
+
+  // The server writes to the same streams, anything buffered goes first
+  fflush(stdout);
+  fflush(stderr);
+
+  uint8_t sent = sendmsg(fd, &msg, 0) == sizeof(req) &&
+                 _write_all(fd, payload, size);
+  free(payload);
+  if (!sent) {
+    close(fd);
+    return 0;
+  }
+
+  _response_t res;
+  if (!_read_all(fd, &res, sizeof(res)) || res.magic != SERVER_MAGIC) {
+    log_err("Lost the connection to the server at \"%s\"\n", path);
+    *err = TASM_IO_ERROR;
+  } else {
+    *err = res.err;
+  }
+
+  close(fd);
+  return 1;
+}
@@ -0,0 +1,38 @@
+// t(heft)asm ; server.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Assembler daemon listening on a Unix domain socket. The server keeps
+/// every file it parsed in a persistent asm_share_t, so repeated requests
+/// only parse what changed. Clients send their jobs together with their
+/// working directory and their stdout and stderr, which the server writes
+/// to while it handles the request. The result is the same as assembling
+/// with the client's options locally.
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <assembler.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Bumped whenever the layout of a request or a response changes
+#define SERVER_PROTOCOL_VERSION 6
+
+/// Serves requests on the socket at path until the process is terminated.
+/// Requests are handled one at a time. Parsed files are stored in the
+/// cache directory of opts as well. Only returns if the socket can not be
+/// set up.
+err_t server_run(const char *path, asm_opts_t *opts);
+
+/// Lets the server listening at path assemble the jobs with opts, logging
+/// up to log_level. Without batch a single job is assembled like
+/// asm_write_file, otherwise like asm_write_batch. Returns 0 if no server
+/// could be reached, the result of the request is written to err.
+uint8_t server_request(const char *path, asm_batch_job_t *jobs, size_t count,
+                       uint8_t batch, asm_opts_t *opts, int log_level,
+                       err_t *err);
+
+#endif
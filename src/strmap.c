@@ -0,0 +1,117 @@
+// t(heft)asm ; strmap.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <strmap.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define STRMAP_INITIAL_CAPACITY 64
+
+uint32_t strmap_hash(const char *str, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)str[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static strmap_entry_t *_find_slot(strmap_entry_t *entries, size_t capacity,
+                                  const char *key, size_t len,
+                                  uint32_t hash) {
+  size_t ix = hash & (capacity - 1);
+  for (;;) {
+    strmap_entry_t *entry = &entries[ix];
+    if (entry->key == NULL)
+      return entry;
+
+    if (entry->hash == hash && entry->len == len &&
+        memcmp(entry->key, key, len) == 0)
+      return entry;
+
+    ix = (ix + 1) & (capacity - 1);
+  }
+}
+
+static void _resize(strmap_t *map, size_t new_capacity) {
+  strmap_entry_t *new_entries = calloc(new_capacity, sizeof(strmap_entry_t));
+
+  for (size_t i = 0; i < map->capacity; i++) {
+    strmap_entry_t *entry = &map->entries[i];
+    if (entry->key == NULL)
+      continue;
+
+    *_find_slot(new_entries, new_capacity, entry->key, entry->len,
+                entry->hash) = *entry;
+  }
+
+  free(map->entries);
+  map->entries = new_entries;
+  map->capacity = new_capacity;
+}
+
+static void _grow(strmap_t *map) {
+  _resize(map, map->capacity == 0 ? STRMAP_INITIAL_CAPACITY
+                                  : map->capacity * 2);
+}
+
+void strmap_init(strmap_t *map) {
+  map->count = 0;
+  map->capacity = 0;
+  map->entries = NULL;
+}
+
+void strmap_free(strmap_t *map) {
+  free(map->entries);
+  strmap_init(map);
+}
+
+void strmap_reserve(strmap_t *map, size_t count) {
+  size_t capacity = map->capacity == 0 ? STRMAP_INITIAL_CAPACITY
+                                       : map->capacity;
+  while (count * 4 > capacity * 3)
+    capacity *= 2;
+
+  if (capacity != map->capacity)
+    _resize(map, capacity);
+}
+
+uint8_t strmap_get(strmap_t *map, const char *key, size_t len, size_t *dest) {
+  if (map->count == 0)
+    return 0;
+
+  strmap_entry_t *entry = _find_slot(map->entries, map->capacity, key, len,
+                                     strmap_hash(key, len));
+  if (entry->key == NULL)
+    return 0;
+
+  *dest = entry->value;
+  return 1;
+}
+
+uint8_t strmap_put(strmap_t *map, const char *key, size_t len, size_t value,
+                   size_t *dest) {
+  // Keep the load factor below 3/4
+  if ((map->count + 1) * 4 > map->capacity * 3)
+    _grow(map);
+
+  uint32_t hash = strmap_hash(key, len);
+  strmap_entry_t *entry =
+      _find_slot(map->entries, map->capacity, key, len, hash);
+  if (entry->key != NULL) {
+    if (dest != NULL)
+      *dest = entry->value;
+    return 0;
+  }
+
+  entry->key = key;
+  entry->len = len;
+  entry->hash = hash;
+  entry->value = value;
+  map->count++;
+  return 1;
+}
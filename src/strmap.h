@@ -0,0 +1,48 @@
+// t(heft)asm ; strmap.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Open addressing hash map from strings to indices. Keys are borrowed,
+/// the caller has to keep them alive for as long as the map is in use.
+#ifndef STRMAP_H
+#define STRMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct strmap_entry_t {
+  const char *key;
+  size_t len;
+  uint32_t hash;
+  size_t value;
+} strmap_entry_t;
+
+typedef struct strmap_t {
+  size_t count;
+  size_t capacity;
+  strmap_entry_t *entries;
+} strmap_t;
+
+/// FNV-1a hash of the first len bytes of str
+uint32_t strmap_hash(const char *str, size_t len);
+
+void strmap_init(strmap_t *map);
+
+void strmap_free(strmap_t *map);
+
+/// Grows the map so that it holds count keys without growing again
+void strmap_reserve(strmap_t *map, size_t count);
+
+/// Looks up key, writes its value to dest and returns 1 if it is present.
+/// Returns 0 otherwise.
+uint8_t strmap_get(strmap_t *map, const char *key, size_t len, size_t *dest);
+
+/// Inserts key with the given value. If the key is already present the map
+/// is left untouched, the existing value is written to dest (if not NULL)
+/// and 0 is returned.
+uint8_t strmap_put(strmap_t *map, const char *key, size_t len, size_t value,
+                   size_t *dest);
+
+#endif
@@ -0,0 +1,376 @@
+// t(heft)asm ; tef.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <tef.h>
+
+#include <log.h>
+#include <strmap.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Layout of an object: the header, followed by the section, symbol and
+/// relocation tables, the names and finally the data of every section in
+/// order. All fields are fixed size, stored in host byte order, and the
+/// structs contain no padding.
+typedef struct _tef_header_t {
+  uint32_t magic;
+  uint32_t format;
+  uint32_t section_count;
+  uint32_t symbol_count;
+  uint32_t reloc_count;
+  uint32_t string_size;
+} _tef_header_t;
+
+typedef struct _tef_section_t {
+  /// Offset into the names
+  uint32_t name;
+  uint32_t name_len;
+  uint32_t size;
+  uint32_t reserved;
+} _tef_section_t;
+
+typedef struct _tef_symbol_t {
+  uint32_t name;
+  uint32_t name_len;
+  uint32_t section;
+  uint32_t value;
+} _tef_symbol_t;
+
+typedef struct _tef_reloc_t {
+  uint32_t section;
+  uint32_t offset;
+  uint32_t kind;
+  uint32_t target;
+} _tef_reloc_t;
+
+//-- Static Utilities --//
+
+/// Makes room for one more element in a growable array
+static void _grow(void **array, size_t elem_size, size_t count,
+                  size_t *capacity) {
+  if (count < *capacity)
+    return;
+
+  *capacity = *capacity ? *capacity * 2 : 8;
+  *array = realloc(*array, elem_size * *capacity);
+}
+
+/// Logs that the object at path is malformed
+static err_t _invalid(const char *path, const char *reason) {
+  log_err("\"%s\" is no valid object: %s\n", path, reason);
+  return TASM_INVALID_OBJECT;
+}
+
+/// Address of the first byte of a section while linking
+static size_t _base(size_t *bases, size_t *first, size_t obj,
+                    uint32_t section) {
+  return bases[first[obj] + section];
+}
+
+//-- Objects --//
+
+void tef_init(tef_object_t *obj) { memset(obj, 0, sizeof(tef_object_t)); }
+
+void tef_free(tef_object_t *obj) {
+  for (size_t i = 0; i < obj->section_count; i++)
+    free(obj->sections[i].name);
+  for (size_t i = 0; i < obj->symbol_count; i++)
+    free(obj->symbols[i].name);
+  free(obj->sections);
+  free(obj->symbols);
+  free(obj->relocs);
+  if (obj->map != NULL)
+    munmap(obj->map, obj->map_size);
+  tef_init(obj);
+}
+
+uint32_t tef_add_section(tef_object_t *obj, const char *name, size_t size) {
+  _grow((void **)&obj->sections, sizeof(tef_section_t), obj->section_count,
+        &obj->section_capacity);
+  obj->sections[obj->section_count] =
+      (tef_section_t){.name = strdup(name), .size = size, .data = NULL};
+  return obj->section_count++;
+}
+
+uint32_t tef_add_symbol(tef_object_t *obj, const char *name, size_t len,
+                        uint32_t section, uint32_t value) {
+  _grow((void **)&obj->symbols, sizeof(tef_symbol_t), obj->symbol_count,
+        &obj->symbol_capacity);
+  obj->symbols[obj->symbol_count] =
+      (tef_symbol_t){.name = strndup(name, len),
+                     .len = len,
+                     .section = section,
+                     .value = value};
+  return obj->symbol_count++;
+}
+
+void tef_add_reloc(tef_object_t *obj, uint32_t section, uint32_t offset,
+                   tef_reloc_kind_t kind, uint32_t target) {
+  _grow((void **)&obj->relocs, sizeof(tef_reloc_t), obj->reloc_count,
+        &obj->reloc_capacity);
+  obj->relocs[obj->reloc_count++] = (tef_reloc_t){
+      .section = section, .offset = offset, .kind = kind, .target = target};
+}
+
+void tef_write_header(tef_object_t *obj, writer_t *out) {
+  size_t string_size = 0;
+  for (size_t i = 0; i < obj->section_count; i++)
+    string_size += strlen(obj->sections[i].name);
+  for (size_t i = 0; i < obj->symbol_count; i++)
+    string_size += obj->symbols[i].len;
+
+  _tef_header_t header = {.magic = TEF_MAGIC,
+                          .format = TEF_FORMAT_VERSION,
+                          .section_count = obj->section_count,
+                          .symbol_count = obj->symbol_count,
+                          .reloc_count = obj->reloc_count,
+                          .string_size = string_size};
+  writer_write(out, &header, sizeof(header));
+
+  uint32_t name = 0;
+  for (size_t i = 0; i < obj->section_count; i++) {
+    _tef_section_t section = {.name = name,
+                              .name_len = strlen(obj->sections[i].name),
+                              .size = obj->sections[i].size};
+    writer_write(out, &section, sizeof(section));
+    name += section.name_len;
+  }
+
+  for (size_t i = 0; i < obj->symbol_count; i++) {
+    tef_symbol_t *symbol = &obj->symbols[i];
+    _tef_symbol_t entry = {.name = name,
+                           .name_len = symbol->len,
+                           .section = symbol->section,
+                           .value = symbol->value};
+    writer_write(out, &entry, sizeof(entry));
+    name += symbol->len;
+  }
+
+  for (size_t i = 0; i < obj->reloc_count; i++) {
+    tef_reloc_t *reloc = &obj->relocs[i];
+    _tef_reloc_t entry = {.section = reloc->section,
+                          .offset = reloc->offset,
+                          .kind = reloc->kind,
+                          .target = reloc->target};
+    writer_write(out, &entry, sizeof(entry));
+  }
+
+  for (size_t i = 0; i < obj->section_count; i++)
+    writer_write(out, obj->sections[i].name, strlen(obj->sections[i].name));
+  for (size_t i = 0; i < obj->symbol_count; i++)
+    writer_write(out, obj->symbols[i].name, obj->symbols[i].len);
+}
+
+err_t tef_read(const char *path, tef_object_t *obj) {
+  tef_init(obj);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    log_err("Error opening \"%s\": %s\n", path, strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return TASM_IO_ERROR;
+  }
+
+  if ((size_t)st.st_size < sizeof(_tef_header_t)) {
+    close(fd);
+    return _invalid(path, "too short");
+  }
+
+  // Mapped privately, so relocations can be applied in place
+  obj->map_size = st.st_size;
+  obj->map = mmap(NULL, obj->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                  fd, 0);
+  close(fd);
+  if (obj->map == MAP_FAILED) {
+    obj->map = NULL;
+    log_err("Error reading \"%s\": %s\n", path, strerror(errno));
+    return TASM_IO_ERROR;
+  }
+
+  uint8_t *data = obj->map;
+  _tef_header_t header;
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != TEF_MAGIC)
+    return _invalid(path, "wrong magic");
+  if (header.format != TEF_FORMAT_VERSION)
+    return _invalid(path, "unsupported format version");
+
+  uint64_t tables = sizeof(_tef_header_t) +
+                    (uint64_t)header.section_count * sizeof(_tef_section_t) +
+                    (uint64_t)header.symbol_count * sizeof(_tef_symbol_t) +
+                    (uint64_t)header.reloc_count * sizeof(_tef_reloc_t);
+  if (tables + header.string_size > obj->map_size)
+    return _invalid(path, "truncated tables");
+
+  const uint8_t *ptr = data + sizeof(_tef_header_t);
+  const char *strings = (const char *)data + tables;
+  uint64_t offset = tables + header.string_size;
+  for (uint32_t i = 0; i < header.section_count; i++) {
+    _tef_section_t section;
+    memcpy(&section, ptr, sizeof(section));
+    ptr += sizeof(section);
+    if ((uint64_t)section.name + section.name_len > header.string_size)
+      return _invalid(path, "section name out of bounds");
+    if (offset + section.size > obj->map_size)
+      return _invalid(path, "truncated section data");
+
+    char *name = strndup(strings + section.name, section.name_len);
+    tef_add_section(obj, name, section.size);
+    free(name);
+    obj->sections[i].data = data + offset;
+    offset += section.size;
+  }
+
+  for (uint32_t i = 0; i < header.symbol_count; i++) {
+    _tef_symbol_t symbol;
+    memcpy(&symbol, ptr, sizeof(symbol));
+    ptr += sizeof(symbol);
+    if ((uint64_t)symbol.name + symbol.name_len > header.string_size)
+      return _invalid(path, "symbol name out of bounds");
+    if (symbol.section != TEF_UNDEFINED &&
+        (symbol.section >= header.section_count ||
+         symbol.value > obj->sections[symbol.section].size))
+      return _invalid(path, "symbol out of bounds");
+
+    tef_add_symbol(obj, strings + symbol.name, symbol.name_len,
+                   symbol.section, symbol.value);
+  }
+
+  for (uint32_t i = 0; i < header.reloc_count; i++) {
+    _tef_reloc_t reloc;
+    memcpy(&reloc, ptr, sizeof(reloc));
+    ptr += sizeof(reloc);
+    if (reloc.section >= header.section_count ||
+        (uint64_t)reloc.offset + 2 > obj->sections[reloc.section].size)
+      return _invalid(path, "relocation out of bounds");
+    if ((reloc.kind == TEF_RELOC_SECTION &&
+         reloc.target >= header.section_count) ||
+        (reloc.kind == TEF_RELOC_SYMBOL &&
+         reloc.target >= header.symbol_count) ||
+        reloc.kind > TEF_RELOC_SYMBOL)
+      return _invalid(path, "invalid relocation");
+
+    tef_add_reloc(obj, reloc.section, reloc.offset, reloc.kind,
+                  reloc.target);
+  }
+
+  return TASM_OK;
+}
+
+//-- Linking --//
+
+err_t tef_link(char **paths, size_t count, const char *out_fl) {
+  err_t err = TASM_OK;
+  tef_object_t *objs = calloc(count, sizeof(tef_object_t));
+  size_t *first = calloc(count + 1, sizeof(size_t));
+  size_t *bases = NULL;
+  strmap_t exports;
+  strmap_init(&exports);
+
+  log_inf("Linking %zu objects into \"%s\"\n", count, out_fl);
+  for (size_t i = 0; i < count && err == TASM_OK; i++) {
+    err = tef_read(paths[i], &objs[i]);
+    first[i + 1] = first[i] + objs[i].section_count;
+  }
+  if (err != TASM_OK)
+    goto tef_link_cleanup;
+
+  // Sections are placed one after the other
+  bases = malloc(sizeof(size_t) * (first[count] + 1));
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) {
+    for (size_t s = 0; s < objs[i].section_count; s++) {
+      bases[first[i] + s] = size;
+      size += objs[i].sections[s].size;
+    }
+  }
+
+  for (size_t i = 0; i < count && err == TASM_OK; i++) {
+    for (size_t s = 0; s < objs[i].symbol_count; s++) {
+      tef_symbol_t *symbol = &objs[i].symbols[s];
+      if (symbol->section == TEF_UNDEFINED)
+        continue;
+
+      size_t address = _base(bases, first, i, symbol->section) + symbol->value;
+      if (!strmap_put(&exports, symbol->name, symbol->len, address, NULL)) {
+        log_err("Label \"%s\" of \"%s\" is exported by another object "
+                "already\n",
+                symbol->name, paths[i]);
+        err = TASM_DUPLICATE_LABEL;
+        break;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < count && err == TASM_OK; i++) {
+    for (size_t r = 0; r < objs[i].reloc_count; r++) {
+      tef_reloc_t *reloc = &objs[i].relocs[r];
+      uint8_t *field = objs[i].sections[reloc->section].data + reloc->offset;
+      size_t address = field[0] << 8 | field[1];
+
+      if (reloc->kind == TEF_RELOC_SECTION) {
+        address += _base(bases, first, i, reloc->target);
+      } else {
+        tef_symbol_t *symbol = &objs[i].symbols[reloc->target];
+        if (symbol->section != TEF_UNDEFINED) {
+          address = _base(bases, first, i, symbol->section) + symbol->value;
+        } else if (!strmap_get(&exports, symbol->name, symbol->len,
+                               &address)) {
+          log_err("Label \"%s\" used by \"%s\" is not exported by any "
+                  "object\n",
+                  symbol->name, paths[i]);
+          err = TASM_INVALID_LABEL;
+          break;
+        }
+      }
+
+      // Addresses wrap like they do when assembling a ROM directly
+      field[0] = (address & 0xff00) >> 8;
+      field[1] = address & 0xff;
+    }
+  }
+  if (err != TASM_OK)
+    goto tef_link_cleanup;
+
+  writer_t out;
+  if (!writer_open(&out, out_fl)) {
+    log_err("Error opening \"%s\": %s\n", out_fl, strerror(errno));
+    err = TASM_IO_ERROR;
+    goto tef_link_cleanup;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    for (size_t s = 0; s < objs[i].section_count; s++)
+      writer_write(&out, objs[i].sections[s].data, objs[i].sections[s].size);
+  }
+
+  if (!writer_close(&out)) {
+    log_err("Error writing \"%s\": %s\n", out_fl, strerror(errno));
+    err = TASM_IO_ERROR;
+    if (out.regular)
+      remove(out_fl);
+    goto tef_link_cleanup;
+  }
+
+  log_inf("Linked %zu bytes\n", size);
+
+tef_link_cleanup:
+  for (size_t i = 0; i < count; i++)
+    tef_free(&objs[i]);
+  free(objs);
+  free(first);
+  free(bases);
+  strmap_free(&exports);
+  return err;
+}
@@ -0,0 +1,99 @@
+// t(heft)asm ; tef.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Theft executable format, a relocatable object file holding one assembled
+/// module. Labels named by .export are visible to other objects, labels
+/// which are used but not defined are imported from them. Every label
+/// operand has a relocation, so linking only places the sections of all
+/// objects one after the other and patches those operands.
+#ifndef TEF_H
+#define TEF_H
+
+#include <assembler.h>
+#include <writer.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TEF_MAGIC 0x00464554u /* "TEF\0" */
+/// Bumped whenever the layout changes
+#define TEF_FORMAT_VERSION 1
+/// Section of imported symbols
+#define TEF_UNDEFINED 0xffffffffu
+
+typedef enum tef_reloc_kind_t {
+  /// The operand holds an offset into the target section
+  TEF_RELOC_SECTION = 0,
+  /// The operand is the address of the target symbol
+  TEF_RELOC_SYMBOL = 1,
+} tef_reloc_kind_t;
+
+typedef struct tef_section_t {
+  char *name;
+  size_t size;
+  /// Only set for objects which were read
+  uint8_t *data;
+} tef_section_t;
+
+typedef struct tef_symbol_t {
+  char *name;
+  size_t len;
+  /// TEF_UNDEFINED for imports
+  uint32_t section;
+  uint32_t value;
+} tef_symbol_t;
+
+/// A 16-bit big endian operand at offset in section
+typedef struct tef_reloc_t {
+  uint32_t section;
+  uint32_t offset;
+  uint32_t kind;
+  /// Section or symbol index, depending on kind
+  uint32_t target;
+} tef_reloc_t;
+
+typedef struct tef_object_t {
+  size_t section_count;
+  size_t section_capacity;
+  tef_section_t *sections;
+  size_t symbol_count;
+  size_t symbol_capacity;
+  tef_symbol_t *symbols;
+  size_t reloc_count;
+  size_t reloc_capacity;
+  tef_reloc_t *relocs;
+  /// Mapping of a read object
+  void *map;
+  size_t map_size;
+} tef_object_t;
+
+void tef_init(tef_object_t *obj);
+
+void tef_free(tef_object_t *obj);
+
+/// Adds a section of size bytes, returns its index
+uint32_t tef_add_section(tef_object_t *obj, const char *name, size_t size);
+
+/// Adds a symbol named by the first len bytes of name, returns its index
+uint32_t tef_add_symbol(tef_object_t *obj, const char *name, size_t len,
+                        uint32_t section, uint32_t value);
+
+void tef_add_reloc(tef_object_t *obj, uint32_t section, uint32_t offset,
+                   tef_reloc_kind_t kind, uint32_t target);
+
+/// Writes everything but the data of the sections to out. The data has to
+/// follow, one section after the other.
+void tef_write_header(tef_object_t *obj, writer_t *out);
+
+/// Reads the object at path. Returns TASM_IO_ERROR if it can not be read
+/// and TASM_INVALID_OBJECT if it is malformed, both are logged.
+err_t tef_read(const char *path, tef_object_t *obj);
+
+/// Links the objects at paths into a ROM at out_fl. The sections are
+/// placed one after the other in the order of the objects.
+err_t tef_link(char **paths, size_t count, const char *out_fl);
+
+#endif
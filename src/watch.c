@@ -0,0 +1,227 @@
+// t(heft)asm ; watch.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <watch.h>
+
+#include <log.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Directories are watched instead of the files themselves, since editors
+/// often replace a file instead of writing to it
+#define WATCH_EVENTS                                                         \
+  (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE)
+
+typedef struct _watch_t {
+  int fd;
+  /// Watched directories and their watch descriptors
+  size_t dir_count;
+  size_t dir_capacity;
+  char **dirs;
+  int *wds;
+  strmap_t dir_map;
+  /// Absolute paths of the watched files
+  size_t file_count;
+  size_t file_capacity;
+  char **files;
+  strmap_t file_map;
+  /// Number of entries of the store which are watched already
+  size_t entry_count;
+} _watch_t;
+
+//-- Static Utilities --//
+
+static double _now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/// Appends str to a growable array of strings
+static void _push_str(char ***array, size_t *count, size_t *capacity,
+                      char *str) {
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 8;
+    *array = realloc(*array, sizeof(char *) * *capacity);
+  }
+
+  (*array)[(*count)++] = str;
+}
+
+/// Returns path as a newly allocated absolute path
+static char *_absolute(const char *path) {
+  char cwd[PATH_MAX];
+  if (path[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL)
+    return strdup(path);
+
+  char *abs = malloc(strlen(cwd) + strlen(path) + 2);
+  sprintf(abs, "%s/%s", cwd, path);
+  return abs;
+}
+
+/// Watches the directory dir, which is taken over
+static void _watch_dir(_watch_t *watch, char *dir) {
+  size_t ix;
+  if (strmap_get(&watch->dir_map, dir, strlen(dir), &ix)) {
+    free(dir);
+    return;
+  }
+
+  int wd = inotify_add_watch(watch->fd, dir, WATCH_EVENTS);
+  if (wd == -1) {
+    log_wrn("Can not watch \"%s\": %s\n", dir, strerror(errno));
+    free(dir);
+    return;
+  }
+
+  // Both arrays grow in lockstep
+  size_t capacity = watch->dir_capacity;
+  strmap_put(&watch->dir_map, dir, strlen(dir), watch->dir_count, NULL);
+  _push_str(&watch->dirs, &watch->dir_count, &watch->dir_capacity, dir);
+  if (capacity != watch->dir_capacity)
+    watch->wds = realloc(watch->wds, sizeof(int) * watch->dir_capacity);
+  watch->wds[watch->dir_count - 1] = wd;
+}
+
+/// Watches the file at path for changes, it does not have to exist
+static void _watch_file(_watch_t *watch, const char *path) {
+  char *abs = _absolute(path);
+  size_t len = strlen(abs);
+  size_t ix;
+  if (strmap_get(&watch->file_map, abs, len, &ix)) {
+    free(abs);
+    return;
+  }
+
+  strmap_put(&watch->file_map, abs, len, watch->file_count, NULL);
+  _push_str(&watch->files, &watch->file_count, &watch->file_capacity, abs);
+
+  char *slash = strrchr(abs, '/');
+  size_t dir_len = slash == abs ? 1 : (size_t)(slash - abs);
+  _watch_dir(watch, strndup(abs, dir_len));
+}
+
+/// Watches the files of all entries added to the store since the last call
+static void _watch_entries(_watch_t *watch, asm_share_t *share) {
+  for (; watch->entry_count < share->entry_count; watch->entry_count++) {
+    // Keys are the path prefixed with the kind of section
+    _watch_file(watch, share->entries[watch->entry_count]->key + 1);
+  }
+}
+
+/// Returns 1 if an event concerns a watched file
+static uint8_t _is_watched(_watch_t *watch, struct inotify_event *event) {
+  if (event->mask & IN_Q_OVERFLOW)
+    return 1;
+
+  if (event->len == 0)
+    return 0;
+
+  for (size_t i = 0; i < watch->dir_count; i++) {
+    if (watch->wds[i] != event->wd)
+      continue;
+
+    char path[PATH_MAX];
+    const char *dir = watch->dirs[i];
+    int len = snprintf(path, sizeof(path), "%s/%s",
+                       strcmp(dir, "/") == 0 ? "" : dir, event->name);
+    size_t ix;
+    return len > 0 && (size_t)len < sizeof(path) &&
+           strmap_get(&watch->file_map, path, len, &ix);
+  }
+
+  return 0;
+}
+
+/// Reads the pending events, returns -1 on failure and otherwise whether a
+/// watched file changed
+static int _read_events(_watch_t *watch) {
+  char buf[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n = read(watch->fd, buf, sizeof(buf));
+  if (n == -1)
+    return errno == EINTR ? 0 : -1;
+
+  int changed = 0;
+  for (char *ptr = buf; ptr < buf + n;) {
+    struct inotify_event *event = (struct inotify_event *)ptr;
+    changed |= _is_watched(watch, event);
+    ptr += sizeof(struct inotify_event) + event->len;
+  }
+
+  return changed;
+}
+
+/// Blocks until a watched file changed and no further changes followed for
+/// WATCH_SETTLE_MS. Returns 0 if the events can not be read.
+static uint8_t _wait_change(_watch_t *watch) {
+  int changed;
+  do {
+    changed = _read_events(watch);
+  } while (changed == 0);
+
+  struct pollfd pfd = {.fd = watch->fd, .events = POLLIN};
+  while (changed != -1 && poll(&pfd, 1, WATCH_SETTLE_MS) != 0) {
+    if (_read_events(watch) == -1)
+      changed = -1;
+  }
+
+  return changed != -1;
+}
+
+//-- Watch Mode --//
+
+err_t watch_run(asm_batch_job_t *jobs, size_t count, uint8_t batch,
+                asm_opts_t *opts) {
+  _watch_t watch = {0};
+  strmap_init(&watch.dir_map);
+  strmap_init(&watch.file_map);
+  watch.fd = inotify_init1(IN_CLOEXEC);
+  if (watch.fd == -1) {
+    log_err("Error setting up file watching: %s\n", strerror(errno));
+    return TASM_IO_ERROR;
+  }
+
+  asm_share_t share;
+  asm_share_init(&share, opts);
+  share.persistent = 1;
+
+  do {
+    double start = _now_ms();
+    size_t parsed = share.entry_count + share.refreshes;
+    err_t err = batch ? asm_write_batch(jobs, count, opts, &share)
+                      : asm_write_job(&jobs[0], opts, &share);
+
+    // Nothing of the assembly is alive anymore
+    asm_share_sweep(&share);
+    _watch_entries(&watch, &share);
+    log_inf("%s in %.2f ms, %zu files parsed\n", asm_errname(err),
+            _now_ms() - start, share.entry_count + share.refreshes - parsed);
+    log_inf("Watching %zu files for changes\n", watch.file_count);
+    fflush(stdout);
+  } while (_wait_change(&watch));
+
+  log_err("Error watching files: %s\n", strerror(errno));
+  for (size_t i = 0; i < watch.dir_count; i++)
+    free(watch.dirs[i]);
+  for (size_t i = 0; i < watch.file_count; i++)
+    free(watch.files[i]);
+  free(watch.dirs);
+  free(watch.wds);
+  free(watch.files);
+  strmap_free(&watch.dir_map);
+  strmap_free(&watch.file_map);
+  close(watch.fd);
+  asm_share_free(&share);
+  return TASM_IO_ERROR;
+}
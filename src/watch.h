@@ -0,0 +1,30 @@
+// t(heft)asm ; watch.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Watch mode, assembling again whenever one of the files of an assembly
+/// changes. Parsed files are kept in a persistent asm_share_t, so only the
+/// changed files are parsed again before labels and symbols are resolved
+/// and the output is rewritten.
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <assembler.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Time to wait for further changes before assembling, editors tend to
+/// write a file in several steps
+#define WATCH_SETTLE_MS 50
+
+/// Assembles the jobs and then again after every change to one of the
+/// files they read, until the process is terminated. Without batch a
+/// single job is assembled like asm_write_file, otherwise like
+/// asm_write_batch. Only returns if the files can not be watched.
+err_t watch_run(asm_batch_job_t *jobs, size_t count, uint8_t batch,
+                asm_opts_t *opts);
+
+#endif
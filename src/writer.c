@@ -0,0 +1,188 @@
+// t(heft)asm ; writer.c
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+
+#include <writer.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//-- Static Utilities --//
+
+/// Returns 1 if size bytes of data, a multiple of 64, are all 0
+static uint8_t _is_zero(const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; i += 64) {
+    uint64_t acc = 0;
+    for (size_t w = 0; w < 64; w += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, data + i + w, sizeof(word));
+      acc |= word;
+    }
+
+    if (acc != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+/// Writes size bytes of data at position
+static void _write_at(writer_t *writer, const uint8_t *data, size_t size,
+                      size_t position) {
+  if (position < writer->head_size) {
+    size_t n = writer->head_size - position;
+    memcpy(writer->head + position, data, n < size ? n : size);
+  }
+
+  while (size > 0 && writer->err == 0) {
+    ssize_t n = writer->regular ? pwrite(writer->fd, data, size, position)
+                                : write(writer->fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      writer->err = n < 0 ? errno : EIO;
+      return;
+    }
+
+    data += n;
+    size -= n;
+    position += n;
+  }
+}
+
+/// Writes out the buffer, skipping aligned blocks of zeros
+static void _flush(writer_t *writer) {
+  size_t start = 0;
+  if (writer->regular) {
+    size_t i = (WRITER_HOLE_SIZE - writer->offset % WRITER_HOLE_SIZE) %
+               WRITER_HOLE_SIZE;
+    for (; i + WRITER_HOLE_SIZE <= writer->len; i += WRITER_HOLE_SIZE) {
+      if (!_is_zero(writer->buf + i, WRITER_HOLE_SIZE))
+        continue;
+
+      _write_at(writer, writer->buf + start, i - start,
+                writer->offset + start);
+      start = i + WRITER_HOLE_SIZE;
+    }
+  }
+
+  _write_at(writer, writer->buf + start, writer->len - start,
+            writer->offset + start);
+  writer->offset += writer->len;
+  writer->len = 0;
+}
+
+static void _grow_size(writer_t *writer) {
+  if (writer->offset + writer->len > writer->size)
+    writer->size = writer->offset + writer->len;
+}
+
+//-- Writer --//
+
+uint8_t writer_open(writer_t *writer, const char *path) {
+  memset(writer, 0, sizeof(writer_t));
+  writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (writer->fd == -1)
+    return 0;
+
+  struct stat st;
+  writer->regular = fstat(writer->fd, &st) == 0 && S_ISREG(st.st_mode);
+  writer->buf = malloc(WRITER_BUFFER_SIZE);
+  return 1;
+}
+
+void writer_write(writer_t *writer, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  while (size > 0) {
+    size_t n = WRITER_BUFFER_SIZE - writer->len;
+    if (n > size)
+      n = size;
+
+    memcpy(writer->buf + writer->len, bytes, n);
+    writer->len += n;
+    _grow_size(writer);
+    if (writer->len == WRITER_BUFFER_SIZE)
+      _flush(writer);
+
+    bytes += n;
+    size -= n;
+  }
+}
+
+void writer_fill(writer_t *writer, uint8_t value, size_t size) {
+  // Long runs of zeros are left out entirely
+  if (value == 0 && writer->regular && size >= WRITER_HOLE_SIZE) {
+    _flush(writer);
+    writer->offset += size;
+    _grow_size(writer);
+    return;
+  }
+
+  // Whole buffers of value are written without filling the buffer again
+  uint8_t filled = 0;
+  while (size > 0) {
+    if (writer->len == 0 && size >= WRITER_BUFFER_SIZE) {
+      if (!filled)
+        memset(writer->buf, value, WRITER_BUFFER_SIZE);
+      filled = 1;
+      _write_at(writer, writer->buf, WRITER_BUFFER_SIZE, writer->offset);
+      writer->offset += WRITER_BUFFER_SIZE;
+      _grow_size(writer);
+      size -= WRITER_BUFFER_SIZE;
+      continue;
+    }
+
+    size_t n = WRITER_BUFFER_SIZE - writer->len;
+    if (n > size)
+      n = size;
+
+    memset(writer->buf + writer->len, value, n);
+    writer->len += n;
+    _grow_size(writer);
+    if (writer->len == WRITER_BUFFER_SIZE)
+      _flush(writer);
+
+    size -= n;
+  }
+}
+
+void writer_seek(writer_t *writer, size_t position) {
+  if (position == writer->offset + writer->len)
+    return;
+
+  if (!writer->regular) {
+    if (writer->err == 0)
+      writer->err = ESPIPE;
+    return;
+  }
+
+  _flush(writer);
+  writer->offset = position;
+}
+
+void writer_capture(writer_t *writer, uint8_t *head, size_t size) {
+  memset(head, 0, size);
+  writer->head = head;
+  writer->head_size = size;
+}
+
+uint8_t writer_close(writer_t *writer) {
+  _flush(writer);
+
+  // Holes at the end of the output are not part of the file yet
+  if (writer->regular && writer->err == 0 &&
+      ftruncate(writer->fd, writer->size) != 0)
+    writer->err = errno;
+  if (close(writer->fd) != 0 && writer->err == 0)
+    writer->err = errno;
+  free(writer->buf);
+  writer->buf = NULL;
+
+  errno = writer->err;
+  return writer->err == 0;
+}
@@ -0,0 +1,63 @@
+// t(heft)asm ; writer.h
+//----------------------------------------
+// Copyright (c) 2023, Marie Eckert
+// Licensed under the BSD 3-Clause License
+//----------------------------------------
+
+/// Buffered writer for output images. Output is collected in a fixed size
+/// buffer and written in large blocks, so the memory used does not depend
+/// on the size of the image. Zeros are never written to regular files:
+/// long runs of them are skipped and left as holes, which read as 0.
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Size of the buffer, output is written in blocks of this size
+#define WRITER_BUFFER_SIZE (256 * 1024)
+/// Buffered blocks of zeros this size and aligned to it are skipped
+#define WRITER_HOLE_SIZE 4096
+
+typedef struct writer_t {
+  int fd;
+  /// Set if the output is a regular file, which can have holes and be
+  /// written at any position. Other files are written sequentially.
+  uint8_t regular;
+  /// Position of the first buffered byte in the file
+  size_t offset;
+  size_t len;
+  uint8_t *buf;
+  /// Size of the output so far
+  size_t size;
+  /// errno of the first failed write, further output is dropped
+  int err;
+  /// Copy of the start of the output, see writer_capture
+  uint8_t *head;
+  size_t head_size;
+} writer_t;
+
+/// Opens path for writing, truncating it. Returns 0 with errno set if it
+/// can not be opened.
+uint8_t writer_open(writer_t *writer, const char *path);
+
+void writer_write(writer_t *writer, const void *data, size_t size);
+
+/// Writes size bytes of value
+void writer_fill(writer_t *writer, uint8_t value, size_t size);
+
+/// Continues writing at position, which may be before the end of the
+/// output. Since zeros are not written, output may only be written over
+/// where it is 0.
+void writer_seek(writer_t *writer, size_t position);
+
+/// Keeps a copy of everything written to the first size bytes of the output
+/// in head, which is cleared first. The copy is complete once the writer is
+/// closed, head is not freed with it.
+void writer_capture(writer_t *writer, uint8_t *head, size_t size);
+
+/// Writes out the buffer and closes the file. Returns 0 if any write
+/// failed, errno is then set to the first error.
+uint8_t writer_close(writer_t *writer);
+
+#endif